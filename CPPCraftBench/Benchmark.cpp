@@ -0,0 +1,515 @@
+/**
+    Benchmarks of the record collections. Every case runs a number of warm-up runs, then measured runs of a fixed
+    number of operations each. Every operation is timed on its own for the latency percentiles, so the latencies
+    include the cost of reading the clock. The throughput is the operations of all measured runs divided by their
+    total time. All data and queries come from a seeded generator, so runs with the same options see the same
+    data and queries.
+
+    Usage: CPPCraftBench [options]
+        --rows N[,N...]          dataset sizes (default 100000)
+        --cardinality N[,N...]   distinct values per column, each exact match selects rows / N rows (default 1000)
+        --ops N                  operations per run (default 1000)
+        --baseline-ops N         operations per run of the base implementation cases (default 20)
+        --warmup N               warm-up runs per case (default 2)
+        --runs N                 measured runs per case (default 10)
+        --seed N                 seed of the data and query generator (default 42)
+        --cases NAME[,NAME...]   only run these cases (default all)
+        --json PATH              also write the results as JSON to PATH, - for stdout (the table then goes to stderr)
+*/
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "QBStringScan.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+    std::vector<size_t> rows = { 100000 };
+    std::vector<size_t> cardinalities = { 1000 };
+    size_t ops = 1000;
+    size_t baselineOps = 20;
+    size_t warmup = 2;
+    size_t runs = 10;
+    uint64_t seed = 42;
+    std::vector<std::string> cases;
+    std::string jsonPath;
+};
+
+struct CaseResult {
+    std::string name;
+    size_t rows = 0;
+    size_t cardinality = 0;
+    size_t ops = 0;
+    size_t runs = 0;
+    double p50 = 0;
+    double p99 = 0;
+    double mean = 0;
+    double min = 0;
+    double max = 0;
+    double throughput = 0;
+    double throughputStdDev = 0;
+};
+
+/**
+    The rows of a benchmark, with ids in random order. Every column takes its values from a pool of cardinality
+    distinct values, picked uniformly.
+*/
+struct Dataset {
+    struct Row {
+        int32_t id;
+        std::string column1;
+        int64_t column2;
+        std::string column3;
+    };
+
+    std::vector<std::string> strings;
+    std::vector<Row> rows;
+
+    Dataset(size_t rowsCount, size_t cardinality, std::mt19937_64& rng) {
+        static constexpr char Alphanum[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+        std::uniform_int_distribution<size_t> lengths(5, 29);
+        std::uniform_int_distribution<size_t> chars(0, sizeof(Alphanum) - 2);
+        strings.resize(cardinality);
+        for (auto& s : strings) {
+            s.resize(lengths(rng));
+            for (auto& c : s) {
+                c = Alphanum[chars(rng)];
+            }
+        }
+
+        std::vector<int32_t> ids(rowsCount);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::shuffle(ids.begin(), ids.end(), rng);
+
+        std::uniform_int_distribution<size_t> values(0, cardinality - 1);
+        rows.reserve(rowsCount);
+        for (int32_t id : ids) {
+            rows.push_back(Row{ id, strings[values(rng)], int64_t(values(rng)), strings[values(rng)] });
+        }
+    }
+
+    static qb::Record<4> toRecord(const Row& row) {
+        qb::Record<4> r;
+        r.columns[0] = std::make_unique<qb::Int32RecordValue>(row.id);
+        r.columns[1] = std::make_unique<qb::StrRecordValue>(row.column1);
+        r.columns[2] = std::make_unique<qb::Int64RecordValue>(row.column2);
+        r.columns[3] = std::make_unique<qb::StrRecordValue>(row.column3);
+        return r;
+    }
+
+    std::vector<qb::Record<4>> records() const {
+        std::vector<qb::Record<4>> res;
+        res.reserve(rows.size());
+        for (const auto& row : rows) {
+            res.push_back(toRecord(row));
+        }
+        return res;
+    }
+
+    // The rows as cells referencing the strings of the dataset, for loading without building records.
+    std::vector<qb::QBRecordCollection::RowType> cells() const {
+        std::vector<qb::QBRecordCollection::RowType> res(rows.size());
+        for (size_t i = 0; i < rows.size(); i++) {
+            res[i] = { qb::CellView::int32(rows[i].id), qb::CellView::string(rows[i].column1),
+                       qb::CellView::int64(rows[i].column2), qb::CellView::string(rows[i].column3) };
+        }
+        return res;
+    }
+
+    base_impl::QBRecordCollection baseRecords() const {
+        base_impl::QBRecordCollection res;
+        res.reserve(rows.size());
+        for (const auto& row : rows) {
+            res.push_back(base_impl::QBRecord{ uint32_t(row.id), row.column1, row.column2, row.column3 });
+        }
+        return res;
+    }
+};
+
+// Indexed the same way as the collection the tests measure.
+void createIndices(qb::QBRecordCollection& c) {
+    c.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram);
+    c.createIndex("column2", qb::RecordValueType::Int64);
+    c.createIndex("column3", qb::RecordValueType::String, qb::IndexKind::NGram);
+}
+
+// Keeps the compiler from dropping the operations whose results are otherwise unused.
+size_t sink = 0;
+
+// Nearest-rank percentile of sorted values.
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = size_t(std::ceil(p / 100.0 * double(sorted.size())));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+/**
+    Runs the warm-up and measured runs of a case. setup() prepares every run and is not timed, op(i) is the i-th
+    of the ops timed operations of the run.
+*/
+CaseResult measure(const Config& config, size_t ops, const std::function<void()>& setup,
+                   const std::function<void(size_t)>& op) {
+    std::vector<double> latencies;
+    latencies.reserve(ops * config.runs);
+    std::vector<double> throughputs;
+    double totalSeconds = 0;
+
+    for (size_t run = 0; run < config.warmup + config.runs; run++) {
+        setup();
+
+        bool measured = run >= config.warmup;
+        auto runStart = Clock::now();
+        for (size_t i = 0; i < ops; i++) {
+            auto start = Clock::now();
+            op(i);
+            auto end = Clock::now();
+            if (measured) {
+                latencies.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+            }
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - runStart).count();
+
+        if (measured) {
+            totalSeconds += seconds;
+            throughputs.push_back(double(ops) / seconds);
+        }
+    }
+
+    CaseResult res;
+    res.ops = ops;
+    res.runs = config.runs;
+    if (latencies.empty()) {
+        return res;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    res.p50 = percentile(latencies, 50);
+    res.p99 = percentile(latencies, 99);
+    res.mean = std::accumulate(latencies.begin(), latencies.end(), 0.0) / double(latencies.size());
+    res.min = latencies.front();
+    res.max = latencies.back();
+    res.throughput = double(latencies.size()) / totalSeconds;
+
+    double meanThroughput = std::accumulate(throughputs.begin(), throughputs.end(), 0.0) / double(throughputs.size());
+    double variance = 0;
+    for (double t : throughputs) {
+        variance += (t - meanThroughput) * (t - meanThroughput);
+    }
+    res.throughputStdDev = throughputs.size() > 1 ? std::sqrt(variance / double(throughputs.size() - 1)) : 0;
+    return res;
+}
+
+struct Benchmark {
+    Benchmark(const Config& config, std::ostream& table) : config(config), table(table) {}
+
+    const Config& config;
+    // The table of results, on stderr when the JSON goes to stdout.
+    std::ostream& table;
+    std::vector<CaseResult> results;
+
+    bool wanted(const std::string& name) const {
+        return config.cases.empty() || std::find(config.cases.begin(), config.cases.end(), name) != config.cases.end();
+    }
+
+    void run(const std::string& name, size_t rows, size_t cardinality, size_t ops, const std::function<void()>& setup,
+             const std::function<void(size_t)>& op) {
+        if (!wanted(name)) {
+            return;
+        }
+
+        CaseResult res = measure(config, ops, setup, op);
+        res.name = name;
+        res.rows = rows;
+        res.cardinality = cardinality;
+        print(table, res);
+        results.push_back(res);
+    }
+
+    static void print(std::ostream& out, const CaseResult& r) {
+        out << std::left << std::setw(24) << r.name << std::right
+                  << " rows " << std::setw(9) << r.rows
+                  << "  card " << std::setw(7) << r.cardinality
+                  << std::fixed << std::setprecision(0)
+                  << "  p50 " << std::setw(11) << r.p50 << "ns"
+                  << "  p99 " << std::setw(11) << r.p99 << "ns"
+                  << "  " << std::setw(12) << r.throughput << " ops/s"
+                  << " +- " << r.throughputStdDev << std::endl;
+    }
+
+    void runDataset(size_t rowsCount, size_t cardinality) {
+        // Every dataset gets its own generator, so its data and queries do not depend on the other datasets.
+        std::mt19937_64 rng(config.seed ^ (uint64_t(rowsCount) << 32) ^ cardinality);
+        Dataset data(rowsCount, cardinality, rng);
+        auto cells = data.cells();
+
+        std::vector<std::string> stringQueries(std::max(config.ops, config.baselineOps));
+        std::vector<std::string> numberQueries(stringQueries.size());
+        std::vector<std::string> idQueries(stringQueries.size());
+        std::uniform_int_distribution<size_t> values(0, cardinality - 1);
+        std::uniform_int_distribution<size_t> rowIdx(0, rowsCount - 1);
+        for (size_t i = 0; i < stringQueries.size(); i++) {
+            stringQueries[i] = data.strings[values(rng)];
+            numberQueries[i] = std::to_string(values(rng));
+            idQueries[i] = std::to_string(data.rows[rowIdx(rng)].id);
+        }
+
+        std::optional<qb::QBRecordCollection> c;
+        auto load = [&]() {
+            c.reset();
+            c.emplace(qb::QBRecordCollection::ColumnNamesType{ "column0", "column1", "column2", "column3" });
+            createIndices(*c);
+            c->bulkInsertRows(cells);
+        };
+        auto noSetup = []() {};
+
+        // Loading the whole dataset is the one timed operation of every run.
+        std::vector<qb::Record<4>> records;
+        run("bulk_load", rowsCount, cardinality, 1, [&]() {
+            c.reset();
+            c.emplace(qb::QBRecordCollection::ColumnNamesType{ "column0", "column1", "column2", "column3" });
+            createIndices(*c);
+            records = data.records();
+        }, [&](size_t) {
+            c->bulkInsert(std::move(records));
+        });
+
+        // The same load one record at a time, which bulk_load has to beat.
+        run("row_load", rowsCount, cardinality, 1, [&]() {
+            c.reset();
+            c.emplace(qb::QBRecordCollection::ColumnNamesType{ "column0", "column1", "column2", "column3" });
+            createIndices(*c);
+            records = data.records();
+        }, [&](size_t) {
+            for (auto& record : records) {
+                sink += c->insertRecord(std::move(record));
+            }
+        });
+
+        // Reopening a snapshot of the loaded dataset, the alternative to loading it again.
+        const std::string snapshotPath = (std::filesystem::temp_directory_path() / "qb_bench.snapshot").string();
+        std::unique_ptr<std::optional<qb::QBRecordCollection>> opened;
+        if (wanted("snapshot_open")) {
+            load();
+            c->save(snapshotPath);
+        }
+        run("snapshot_open", rowsCount, cardinality, 1, [&]() {
+            opened.reset();
+        }, [&](size_t) {
+            opened = std::make_unique<std::optional<qb::QBRecordCollection>>(qb::QBRecordCollection::open(snapshotPath));
+            sink += (*opened)->size();
+        });
+        opened.reset();
+        std::filesystem::remove(snapshotPath);
+
+        std::vector<qb::Record<4>> newRecords;
+        run("insert", rowsCount, cardinality, config.ops, [&]() {
+            load();
+            newRecords.clear();
+            for (size_t i = 0; i < config.ops; i++) {
+                auto row = data.rows[i % rowsCount];
+                row.id = int32_t(rowsCount + i);
+                newRecords.push_back(Dataset::toRecord(row));
+            }
+        }, [&](size_t i) {
+            sink += c->insertRecord(std::move(newRecords[i]));
+        });
+
+        std::vector<int32_t> removeIds;
+        run("remove", rowsCount, cardinality, std::min(config.ops, rowsCount), [&]() {
+            load();
+            removeIds.clear();
+            for (size_t i = 0; i < std::min(config.ops, rowsCount); i++) {
+                removeIds.push_back(data.rows[i].id);
+            }
+        }, [&](size_t i) {
+            c->remove(uint32_t(removeIds[i]));
+        });
+
+        if (wanted("match_column0") || wanted("match_column1") || wanted("match_column2") ||
+            wanted("match_column3")) {
+            load();
+        }
+        run("match_column0", rowsCount, cardinality, config.ops, noSetup, [&](size_t i) {
+            sink += qb::QBFindMatchingRecords(*c, "column0", idQueries[i]).size();
+        });
+        run("match_column1", rowsCount, cardinality, config.ops, noSetup, [&](size_t i) {
+            sink += qb::QBFindMatchingRecords(*c, "column1", stringQueries[i]).size();
+        });
+        run("match_column2", rowsCount, cardinality, config.ops, noSetup, [&](size_t i) {
+            sink += qb::QBFindMatchingRecords(*c, "column2", numberQueries[i]).size();
+        });
+        run("match_column3", rowsCount, cardinality, config.ops, noSetup, [&](size_t i) {
+            sink += qb::QBFindMatchingRecords(*c, "column3", stringQueries[i]).size();
+        });
+        c.reset();
+
+        base_impl::QBRecordCollection base;
+        if (wanted("baseline_match_column1") || wanted("baseline_match_column2") ||
+            wanted("baseline_match_column3")) {
+            base = data.baseRecords();
+        }
+        run("baseline_match_column1", rowsCount, cardinality, config.baselineOps, noSetup, [&](size_t i) {
+            sink += base_impl::QBFindMatchingRecords(base, "column1", stringQueries[i]).size();
+        });
+        run("baseline_match_column2", rowsCount, cardinality, config.baselineOps, noSetup, [&](size_t i) {
+            sink += base_impl::QBFindMatchingRecords(base, "column2", numberQueries[i]).size();
+        });
+        run("baseline_match_column3", rowsCount, cardinality, config.baselineOps, noSetup, [&](size_t i) {
+            sink += base_impl::QBFindMatchingRecords(base, "column3", stringQueries[i]).size();
+        });
+    }
+};
+
+std::string jsonString(std::string_view s) {
+    std::string res = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+        }
+        res += c;
+    }
+    return res + "\"";
+}
+
+void writeJson(std::ostream& out, const Config& config, const std::vector<CaseResult>& results) {
+    out << std::fixed << std::setprecision(1);
+    out << "{\n";
+    out << "  \"isa\": " << jsonString(qb::scan::isaName(qb::scan::detectedIsa())) << ",\n";
+    out << "  \"seed\": " << config.seed << ",\n";
+    out << "  \"warmup\": " << config.warmup << ",\n";
+    out << "  \"runs\": " << config.runs << ",\n";
+    out << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        out << (i ? ",\n" : "\n") << "    {"
+            << "\"case\": " << jsonString(r.name)
+            << ", \"rows\": " << r.rows
+            << ", \"cardinality\": " << r.cardinality
+            << ", \"selectivity\": " << std::setprecision(6) << 1.0 / double(r.cardinality) << std::setprecision(1)
+            << ", \"ops\": " << r.ops
+            << ", \"runs\": " << r.runs
+            << ", \"p50_ns\": " << r.p50
+            << ", \"p99_ns\": " << r.p99
+            << ", \"mean_ns\": " << r.mean
+            << ", \"min_ns\": " << r.min
+            << ", \"max_ns\": " << r.max
+            << ", \"throughput_ops_per_s\": " << r.throughput
+            << ", \"throughput_stddev\": " << r.throughputStdDev << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+template <typename T>
+bool parseList(const std::string& s, std::vector<T>& out) {
+    out.clear();
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if constexpr (std::is_same_v<T, std::string>) {
+            out.push_back(item);
+        }
+        else {
+            int64_t v = 0;
+            if (!core::toInt64(item.c_str(), v) || v <= 0) {
+                return false;
+            }
+            out.push_back(T(v));
+        }
+    }
+    return !out.empty();
+}
+
+bool parseCount(const std::string& s, size_t& out, bool allowZero) {
+    int64_t v = 0;
+    if (!core::toInt64(s.c_str(), v) || v < 0 || (v == 0 && !allowZero)) {
+        return false;
+    }
+    out = size_t(v);
+    return true;
+}
+
+bool parseArgs(int argc, char* argv[], Config& config) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            return false;
+        }
+        std::string value = argv[++i];
+
+        bool ok = false;
+        if (arg == "--rows") ok = parseList(value, config.rows);
+        else if (arg == "--cardinality") ok = parseList(value, config.cardinalities);
+        else if (arg == "--ops") ok = parseCount(value, config.ops, false);
+        else if (arg == "--baseline-ops") ok = parseCount(value, config.baselineOps, false);
+        else if (arg == "--warmup") ok = parseCount(value, config.warmup, true);
+        else if (arg == "--runs") ok = parseCount(value, config.runs, false);
+        else if (arg == "--cases") ok = parseList(value, config.cases);
+        else if (arg == "--json") ok = !(config.jsonPath = value).empty();
+        else if (arg == "--seed") {
+            size_t seed = 0;
+            ok = parseCount(value, seed, true);
+            config.seed = seed;
+        }
+
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Config config;
+    if (!parseArgs(argc, argv, config)) {
+        std::cerr << "Usage: CPPCraftBench [--rows N,...] [--cardinality N,...] [--ops N] [--baseline-ops N] "
+                     "[--warmup N] [--runs N] [--seed N] [--cases NAME,...] [--json PATH|-]" << std::endl;
+        return 1;
+    }
+
+    std::ostream& table = config.jsonPath == "-" ? std::cerr : std::cout;
+    table << "isa " << qb::scan::isaName(qb::scan::detectedIsa()) << ", seed " << config.seed << ", "
+              << config.warmup << " warm-up and " << config.runs << " measured runs per case" << std::endl;
+
+    Benchmark bench(config, table);
+    for (size_t rows : config.rows) {
+        for (size_t cardinality : config.cardinalities) {
+            bench.runDataset(rows, cardinality);
+        }
+    }
+
+    if (config.jsonPath == "-") {
+        writeJson(std::cout, config, bench.results);
+    }
+    else if (!config.jsonPath.empty()) {
+        std::ofstream out(config.jsonPath);
+        writeJson(out, config, bench.results);
+        if (!out) {
+            std::cerr << "Cannot write " << config.jsonPath << std::endl;
+            return 1;
+        }
+    }
+
+    // Printed so the sink is used.
+    table << "checksum " << sink << std::endl;
+    return 0;
+}
@@ -2,40 +2,104 @@
 
 #include <algorithm>
 #include <iterator>
+#include <string>
+
+#include "QBThreadPool.h"
 
 namespace base_impl {
 
+namespace {
+
 /**
-    Return records that contains a string in the StringValue field
-    records - the initial set of records to filter
-    matchString - the string to search for
+    Matches records against one column. Numeric match strings are parsed once, on construction, which throws
+    like std::stoul and std::stol do.
 */
-QBRecordCollection QBFindMatchingRecords(const QBRecordCollection& records, const std::string& columnName, const std::string& matchString) {
-    QBRecordCollection result;
-
-    std::copy_if(records.begin(), records.end(), std::back_inserter(result), [&](QBRecord rec) {
+struct Matcher {
+    Matcher(const std::string& columnName, const std::string& matchString) : matchString(matchString) {
         if (columnName == "column0") {
-            uint32_t matchValue = std::stoul(matchString);
-            return matchValue == rec.column0;
+            column = 0;
+            matchValue = std::stoul(matchString);
         }
         else if (columnName == "column1") {
-            return rec.column1.find(matchString) != std::string::npos;
+            column = 1;
         }
         else if (columnName == "column2") {
-            int64_t matchValue = std::stol(matchString);
-            return matchValue == rec.column2;
+            column = 2;
+            matchValue = std::stol(matchString);
         }
         else if (columnName == "column3") {
-            return rec.column3.find(matchString) != std::string::npos;
+            column = 3;
         }
-        else {
-            return false;
+    }
+
+    bool operator()(const QBRecord& rec) const {
+        switch (column) {
+            case 0:
+                return uint32_t(matchValue) == rec.column0;
+            case 1:
+                return rec.column1.find(matchString) != std::string::npos;
+            case 2:
+                return matchValue == rec.column2;
+            case 3:
+                return rec.column3.find(matchString) != std::string::npos;
+            default:
+                return false;
         }
+    }
+
+    const std::string& matchString;
+    int column = -1;
+    int64_t matchValue = 0;
+};
+
+bool isMatching(const QBRecord& rec, const std::string& columnName, const std::string& matchString) {
+    return Matcher(columnName, matchString)(rec);
+}
+
+} // namespace
+
+/**
+    Return records that contains a string in the StringValue field
+    records - the initial set of records to filter
+    matchString - the string to search for
+*/
+QBRecordCollection QBFindMatchingRecords(const QBRecordCollection& records, const std::string& columnName, const std::string& matchString) {
+    QBRecordCollection result;
+
+    std::copy_if(records.begin(), records.end(), std::back_inserter(result), [&](QBRecord rec) {
+        return isMatching(rec, columnName, matchString);
     });
 
     return result;
 }
 
+/**
+    Same as QBFindMatchingRecords, but scans chunks of the records concurrently on the pool. Every chunk is
+    filtered into its own result and the results are joined in the original order. An invalid numeric match
+    string throws on the calling thread.
+*/
+QBRecordCollection QBFindMatchingRecordsParallel(const QBRecordCollection& records, const std::string& columnName, const std::string& matchString, qb::ThreadPool& pool) {
+    static constexpr size_t MinChunkSize = 4096;
+
+    // Parse on this thread, a throw in a pool thread would terminate the program.
+    const Matcher matcher(columnName, matchString);
+
+    size_t chunks = std::min(pool.threadsCount() * 4, std::max<size_t>(records.size() / MinChunkSize, 1));
+    std::vector<QBRecordCollection> parts(chunks);
+    pool.parallelFor(chunks, [&](size_t i) {
+        auto first = records.begin() + records.size() * i / chunks;
+        auto last = records.begin() + records.size() * (i + 1) / chunks;
+        std::copy_if(first, last, std::back_inserter(parts[i]), matcher);
+    });
+
+    QBRecordCollection result;
+    for (auto& part : parts) {
+        result.insert(result.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+    }
+
+    return result;
+}
+
 /**
     Utility to populate a record collection
     prefix - prefix for the string value for every record
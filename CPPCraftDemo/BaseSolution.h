@@ -3,6 +3,10 @@
 #include <string>
 #include <vector>
 
+namespace qb {
+struct ThreadPool;
+}
+
 namespace base_impl {
 
 /**
@@ -35,6 +39,14 @@ typedef std::vector<QBRecord> QBRecordCollection;
 */
 QBRecordCollection QBFindMatchingRecords(const QBRecordCollection& records, const std::string& columnName, const std::string& matchString);
 
+/**
+    Same as QBFindMatchingRecords, but scans chunks of the records concurrently on the pool
+    records - the initial set of records to filter
+    matchString - the string to search for
+    pool - the threads to scan with
+*/
+QBRecordCollection QBFindMatchingRecordsParallel(const QBRecordCollection& records, const std::string& columnName, const std::string& matchString, qb::ThreadPool& pool);
+
 /**
     Utility to populate a record collection
     prefix - prefix for the string value for every record
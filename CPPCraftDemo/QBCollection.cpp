@@ -2,9 +2,9 @@
 
 namespace qb {
 
-QBRecordCollection QBFindMatchingRecords(const QBRecordCollection& records, const std::string& columnName, const std::string& matchString) {
+QBRecordResultSet QBFindMatchingRecords(const QBRecordCollection& records, const std::string& columnName, const std::string& matchString) {
     bool ok = false;
-    QBRecordCollection ret = records.match(columnName, matchString, ok);
+    QBRecordResultSet ret = records.match(columnName, matchString, ok);
     assert(ok);
     return ret;
 }
@@ -3,15 +3,38 @@
 #include <assert.h>
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <iterator>
+#include <limits>
 #include <string>
 #include <string_view>
-#include <unordered_map>
-#include <unordered_set>
 #include <vector>
 #include <array>
 #include <memory>
+#include <memory_resource>
+#include <optional>
+#include <span>
 #include <type_traits>
 #include <stdexcept>
+#include <variant>
+
+#include "QBColumnStore.h"
+#include "QBCompressedPostingList.h"
+#include "QBFlatHashMap.h"
+#include "QBHashIndex.h"
+#include "QBIdSlotTable.h"
+#include "QBMemory.h"
+#include "QBNGramIndex.h"
+#include "QBOrderedIndex.h"
+#include "QBResultCache.h"
+#include "QBPostingList.h"
+#include "QBResultSet.h"
+#include "QBSnapshot.h"
+#include "QBThreadPool.h"
+#include "QBWriteAheadLog.h"
 
 #ifdef _DEBUG
 #include <iostream>
@@ -28,7 +51,30 @@ enum struct RecordValueType {
     SENTINEL
 };
 
+enum struct IndexKind {
+    None,
+    // Exact match lookups.
+    Hash,
+    // Substring (contains) lookups on string columns.
+    NGram,
+    // Exact and range lookups in key order on int64 columns.
+    Ordered,
+
+    SENTINEL
+};
+
+enum struct ColumnEncoding {
+    Plain,
+    // String columns only. Rows store 32-bit codes into a dictionary of the distinct values.
+    Dictionary,
+
+    SENTINEL
+};
+
 struct RecordValue {
+    virtual ~RecordValue() = default;
+
+    virtual RecordValueType type() const = 0;
     virtual bool fromStr(std::string_view s) = 0;
     virtual std::string toStr() const = 0;
     virtual std::unique_ptr<RecordValue> copy() const = 0;
@@ -45,6 +91,10 @@ struct StrRecordValue : public RecordValue {
     StrRecordValue(const std::string& s) : value(s) {}
     StrRecordValue(std::string&& s) : value(std::move(s)) {}
 
+    RecordValueType type() const override {
+        return RecordValueType::String;
+    }
+
     bool fromStr(std::string_view s) override {
         value = s;
         return true;
@@ -69,6 +119,10 @@ struct Int32RecordValue : public RecordValue {
 
     Int32RecordValue(int32_t v) : value(v) {}
 
+    RecordValueType type() const override {
+        return RecordValueType::Int32;
+    }
+
     bool fromStr(std::string_view s) override {
         return core::toInt32(s.data(), value);
     }
@@ -92,6 +146,10 @@ struct Int64RecordValue : public RecordValue {
 
     Int64RecordValue(int64_t v) : value(v) {}
 
+    RecordValueType type() const override {
+        return RecordValueType::Int64;
+    }
+
     bool fromStr(std::string_view s) override {
         return core::toInt64(s.data(), value);
     }
@@ -105,6 +163,55 @@ struct Int64RecordValue : public RecordValue {
     }
 };
 
+/**
+    A condition on a single column, with the same meaning as Collection::match(columnName, matchString).
+*/
+struct Predicate {
+    std::string columnName;
+    std::string matchString;
+};
+
+/**
+    The value of a single cell. Unlike RecordValue it references its string instead of owning it, so rows can be
+    inserted straight from parsed input, see Collection::insertRow().
+*/
+struct CellView {
+    RecordValueType type = RecordValueType::None;
+    // The value of Int32 and Int64 cells.
+    int64_t number = 0;
+    // The value of String cells.
+    std::string_view text;
+
+    static CellView int32(int32_t v) { return CellView{ RecordValueType::Int32, v, {} }; }
+    static CellView int64(int64_t v) { return CellView{ RecordValueType::Int64, v, {} }; }
+    static CellView string(std::string_view v) { return CellView{ RecordValueType::String, 0, v }; }
+};
+
+/**
+    The COUNT, SUM, MIN and MAX of a numeric column over a set of rows, see Collection::aggregate(). min and max
+    are only meaningful if count > 0. The sum wraps around on overflow.
+*/
+struct Aggregate {
+    size_t count = 0;
+    int64_t sum = 0;
+    int64_t min = std::numeric_limits<int64_t>::max();
+    int64_t max = std::numeric_limits<int64_t>::min();
+
+    void add(int64_t v) {
+        count++;
+        sum = int64_t(uint64_t(sum) + uint64_t(v));
+        min = std::min(min, v);
+        max = std::max(max, v);
+    }
+
+    void merge(const Aggregate& other) {
+        count += other.count;
+        sum = int64_t(uint64_t(sum) + uint64_t(other.sum));
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+};
+
 template <size_t N>
 struct Record {
     using IdType = uint32_t;
@@ -125,8 +232,10 @@ struct Column {
     std::string_view name;
     RecordValueType type;
     int32_t index;
+    IndexKind indexKind = IndexKind::None;
+    ColumnEncoding encoding = ColumnEncoding::Plain;
 
-    Column() : name({}), type(RecordValueType::None), index(-1) {}
+    Column() : name(), type(RecordValueType::None), index(-1) {}
     Column(std::string_view s, RecordValueType t, int32_t i) : name(s), type(t), index(i) {}
 };
 
@@ -135,14 +244,61 @@ struct Collection {
     static_assert(RecordSize > 0, "RecordSize must be greater than 0");
 
     using RecordType = Record<RecordSize>;
-    using ColumnsType = std::unordered_map<std::string, Column>;
+    using IdType = typename RecordType::IdType;
+    using ColumnsType = HashMap<std::string, Column, StringHash, StringEqual>;
     using ColumnNamesType = std::array<std::string, RecordSize>;
+    using StoreType = ColumnStore<RecordSize>;
+
+    using StrIndices = HashIndex<std::pmr::string>;
+    using Int64Indices = HashIndex<int64_t>;
+    using CodeIndices = HashIndex<StringDictionary::CodeType>;
+
+    /**
+        A lightweight reference to a single row in the collection. It reads the cells directly from the column
+        storage and is invalidated by any modification of the collection.
+    */
+    struct RowView {
+        const Collection* collection;
+        SlotType slot;
+
+        IdType id() const { return collection->idAt(slot); }
+
+        // T must be one of int32_t, int64_t or std::string_view and must match the column type.
+        template <typename T>
+        T get(size_t column) const {
+            if constexpr (std::is_same_v<T, std::string_view>) {
+                return collection->stringAt(column, slot);
+            }
+            else {
+                using ColumnType = typename ColumnFor<T>::Type;
+                return std::get<ColumnType>(collection->m_store.column(column)).get(slot);
+            }
+        }
 
-    using RecordsMapType = std::unordered_map<typename RecordType::IdType, RecordType>;
-    using StrIndices = std::unordered_map<std::string, std::vector<typename RecordType::IdType>>;
-    using Int64Indices = std::unordered_map<int64_t, std::vector<typename RecordType::IdType>>;
-
-    Collection(std::array<std::string, RecordSize>&& columnNames) {
+        RecordType toRecord() const { return collection->materialize(slot); }
+    };
+
+    // Collections smaller than this are scanned on the calling thread, waking the pool would cost more.
+    static constexpr size_t DefaultMinParallelSlots = 1 << 16;
+    static constexpr size_t MinChunkSlots = 4096;
+    // Batches of rows with more distinct values drop a column's cached substring matches instead of checking them.
+    static constexpr size_t MaxContainsChecks = 64;
+    // Removed rows are compacted away once they make up more than this fraction of the row slots.
+    static constexpr double DefaultCompactionThreshold = 0.25;
+
+    using ConstIterator = LiveRowIterator<Collection>;
+    using ResultSet = BasicResultSet<Collection>;
+    // A row given as cells, one per column. Inserting rows instead of records saves a RecordValue per cell.
+    using RowType = std::array<CellView, RecordSize>;
+
+    /**
+        All row storage, index structures and the id map allocate from the memory resource, see
+        makeMemoryResource() for the built-in ones. Without one the global heap is used.
+    */
+    Collection(std::array<std::string, RecordSize>&& columnNames, MemoryResourcePtr memory = nullptr) :
+        m_memory(memory ? std::move(memory) : makeMemoryResource(AllocatorKind::Default)),
+        m_store(m_memory.get()),
+        m_slots(m_memory.get()) {
         if (columnNames.size() != RecordSize) {
             throw std::invalid_argument("Invalid column names size");
         }
@@ -151,287 +307,865 @@ struct Collection {
         for (size_t i = 0; i < RecordSize; i++) {
             m_columns.insert(std::make_pair(m_columnNames[i], Column{ m_columnNames[i], RecordValueType::None, -1 }));
         }
+
+        // The first column is always the record id.
+        setColumnType(0, m_columns.at(m_columnNames[0]), RecordValueType::Int32);
+    }
+
+    /**
+        Creates an index on the column. Hash indices answer exact matches on String and Int64 columns. NGram
+        indices answer substring (contains) matches on String columns, the same question the base implementation
+        answers. Ordered indices answer exact and range matches on Int64 columns.
+
+        The rows already in the collection are indexed right away, in one sorted pass. To index a large
+        collection that is in use, see startIndexBuild().
+    */
+    bool createIndex(const std::string& columnName, RecordValueType type, IndexKind kind = IndexKind::Hash) {
+        if (findIndexBuild(columnName) != m_indexBuilds.end() || !addIndex(columnName, type, kind)) {
+            return false;
+        }
+
+        if (!empty()) {
+            indexColumns(liveSlots(), { columnPosition(columnName) });
+        }
+        return true;
     }
 
-    bool createIndex(const std::string& columnName, RecordValueType type) {
+    /**
+        Starts building an index on the column on a background thread and returns at once. Until
+        finishIndexBuild() switches the column over to the new index, queries on the column keep being answered
+        by scanning it, and rows can still be inserted and removed.
+
+        The background thread reads and sorts the keys of the current rows from a copy of the column, so it never
+        touches the collection. The switch-over builds the index from the sorted keys and adds the rows inserted
+        in the meantime. Compaction is postponed while a build is pending, so the slots of rows removed in the
+        meantime are not reused.
+
+        Returns false if createIndex() would, or if a build on the column is already pending.
+    */
+    bool startIndexBuild(const std::string& columnName, RecordValueType type, IndexKind kind = IndexKind::Hash) {
         auto it = m_columns.find(columnName);
+        if (it == m_columns.end() || findIndexBuild(columnName) != m_indexBuilds.end()) {
+            return false;
+        }
 
-        bool ok = false;
-        if (it != m_columns.end()) {
-            int32_t index = 0;
-            it->second.type = type;
+        const auto& column = it->second;
+        bool typeMatches = column.type == RecordValueType::None || column.type == type;
+        if (column.index != -1 || !typeMatches || !canIndex(type, kind)) {
+            return false;
+        }
 
-            switch (type) {
-                case RecordValueType::String:
-                    index = static_cast<int32_t>(m_strIndices.size());
-                    m_strIndices.push_back(StrIndices());
-                    ok = true;
-                    break;
-                case RecordValueType::Int64:
-                    index = static_cast<int32_t>(m_int64Indices.size());
-                    m_int64Indices.push_back(Int64Indices());
-                    ok = true;
-                    break;
-                default:
-                    break;
+        size_t pos = columnPosition(columnName);
+        auto build = std::make_shared<IndexBuild>();
+        build->slots = liveSlots();
+
+        // The copy allocates from the global heap, which is safe to use from the background thread. NGram keys
+        // are read from the strings, so a dictionary encoded column is decoded, as its dictionary keeps growing.
+        const auto* dict = std::get_if<DictStringColumn>(&m_store.column(pos));
+        if (dict && kind == IndexKind::NGram) {
+            StringColumn strings;
+            strings.resize(m_store.slotCount());
+            for (SlotType slot : build->slots) {
+                strings.set(slot, dict->get(slot));
             }
+            build->column = std::move(strings);
+        }
+        else {
+            build->column = m_store.column(pos);
+        }
+
+        m_indexBuilds.push_back(PendingIndexBuild{
+            columnName, type, kind, build,
+            std::async(std::launch::async, [build, kind]() { build->keys = sortKeys(build->column, kind, build->slots); })
+        });
+        return true;
+    }
+
+    // Returns true once the background part of the build on the column is done, so finishIndexBuild() will not wait.
+    bool isIndexBuildReady(const std::string& columnName) const {
+        auto it = findIndexBuild(columnName);
+        return it != m_indexBuilds.end() && it->sorted.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    /**
+        Waits for the build on the column started by startIndexBuild() and switches the column over to the new
+        index. Returns false if no build is pending on the column, or if the column took a type the index does not
+        support in the meantime.
+    */
+    bool finishIndexBuild(const std::string& columnName) {
+        auto it = findIndexBuild(columnName);
+        if (it == m_indexBuilds.end()) {
+            return false;
+        }
 
-            it->second.index = index;
+        it->sorted.get();
+        PendingIndexBuild pending = std::move(*it);
+        m_indexBuilds.erase(it);
+
+        bool ok = addIndex(columnName, pending.type, pending.kind);
+        if (ok) {
+            insertKeys(m_columns.at(columnName), pending.build->keys);
+
+            // Rows removed since the start are dead, queries skip them until compaction drops them. Rows inserted
+            // since are live, but were not seen by the build.
+            std::vector<SlotType> live = liveSlots();
+            std::vector<SlotType> added;
+            std::set_difference(live.begin(), live.end(), pending.build->slots.begin(), pending.build->slots.end(),
+                                std::back_inserter(added));
+            indexColumns(added, { columnPosition(columnName) });
         }
 
+        compactIfNeeded();
         return ok;
     }
 
+
+    /**
+        Fixes the type of the column's values before any row sets it. Returns false if the column already has
+        another type.
+    */
+    bool setColumnType(const std::string& columnName, RecordValueType type) {
+        auto it = m_columns.find(columnName);
+        return it != m_columns.end() && setColumnType(columnPosition(columnName), it->second, type);
+    }
+
+    /**
+        Sets how a column stores its values. Dictionary encoding stores a 32-bit code per row into a dictionary
+        shared by all dictionary encoded columns of the collection, and Hash indices on such columns are keyed
+        by code. Must be called while the collection is empty and before createIndex on the column.
+    */
+    bool setEncoding(const std::string& columnName, ColumnEncoding encoding) {
+        auto it = m_columns.find(columnName);
+        if (it == m_columns.end() || it->second.index != -1 || !empty()) {
+            return false;
+        }
+
+        auto& column = it->second;
+        size_t pos = columnPosition(columnName);
+        if (pos == 0) {
+            // The id column is always plain.
+            return false;
+        }
+
+        if (encoding == ColumnEncoding::Dictionary) {
+            if (column.type != RecordValueType::None && column.type != RecordValueType::String) {
+                return false;
+            }
+
+            if (!m_dictionary) {
+                m_dictionary = std::make_shared<StringDictionary>(m_memory.get());
+            }
+
+            column.type = RecordValueType::String;
+            m_store.setColumnType(pos, DictStringColumn(m_dictionary, m_memory.get()));
+        }
+        else if (encoding == ColumnEncoding::Plain && column.encoding == ColumnEncoding::Dictionary) {
+            m_store.template setColumnType<StringColumn>(pos);
+        }
+
+        column.encoding = encoding;
+        return true;
+    }
+
+    /**
+        Lets scans of unindexed columns run on the pool. Collections with at least minParallelSlots row slots are
+        split into chunks that are scanned concurrently, each into its own result, and the results are joined in
+        slot order. Pass nullptr to scan on the calling thread only. The pool must outlive the collection.
+    */
+    void setThreadPool(ThreadPool* pool, size_t minParallelSlots = DefaultMinParallelSlots) {
+        m_threadPool = pool;
+        m_minParallelSlots = std::max<size_t>(minParallelSlots, 1);
+    }
+
+    /**
+        Logs every insertRecord(), bulkInsert() and remove() to the log before applying it, so the changes since
+        the last snapshot can be replayed after a crash, see replay() and checkpoint(). Changes the log does not
+        take are rejected: inserts return false and remove() keeps the row. Pass nullptr to stop logging. The log
+        must outlive the collection.
+
+        A log serves one collection only, since its entries do not say which collection they belong to. Returns
+        false if another collection uses the log.
+    */
+    bool setWriteAheadLog(WriteAheadLog* log) {
+        if (log == m_log.get()) {
+            return true;
+        }
+        if (log && !log->attach()) {
+            return false;
+        }
+        m_log.reset(log);
+        return true;
+    }
+
+    /**
+        Lends the collection a log claimed elsewhere, see WriteAheadLog::attach(), and takes it back, without
+        claiming or releasing it. Lets ConcurrentCollection log through one of its copies at a time.
+    */
+    void adoptWriteAheadLog(WriteAheadLog* log) { m_log.reset(log); }
+    WriteAheadLog* releaseWriteAheadLog() { return m_log.release(); }
+
+    /**
+        Sets the fraction of row slots that removed rows may take up before remove() compacts the collection.
+        A threshold of 1 or more turns automatic compaction off, see compact().
+    */
+    void setCompactionThreshold(double threshold) { m_compactionThreshold = threshold; }
+
+    /**
+        Caches up to capacity results of match() that had to be computed rather than referenced from an index:
+        scans, NGram matches and posting lists holding removed rows. Repeating such a query costs a hash lookup
+        and shares the cached result. Inserts and removes only drop the results their row belongs to, found from
+        the values of the row. Pass 0 to turn the cache off.
+    */
+    void setResultCacheCapacity(size_t capacity) {
+        m_cache = capacity ? std::make_unique<ResultCache>(RecordSize, capacity) : nullptr;
+    }
+
+    // The result cache, or nullptr if it is off.
+    const ResultCache* resultCache() const { return m_cache.get(); }
+
+    // Number of removed rows that have not been compacted away yet.
+    size_t deadCount() const { return m_store.deadCount(); }
+
     void reserve(size_t n) {
-        m_records.reserve(n);
+        m_store.reserve(n);
+        m_slots.reserve(n);
     }
 
-    bool empty() const { return m_records.empty(); }
+    bool empty() const { return m_store.empty(); }
+
+    size_t size() const { return m_store.size(); }
 
-    size_t size() const { return m_records.size(); }
+    const ColumnNamesType& columnNames() const { return m_columnNames; }
 
-    RecordsMapType::const_iterator begin() const { return m_records.begin(); }
-    RecordsMapType::const_iterator end() const { return m_records.end(); }
+    ConstIterator begin() const { return ConstIterator{ this, &m_store.slots(), m_store.slots().nextLive(0) }; }
+    ConstIterator end() const { return ConstIterator{ this, &m_store.slots(), SlotType(m_store.slotCount()) }; }
 
     bool insertRecord(RecordType&& record) {
-        bool ok = true;
+        RowType row;
+        return rowOf(record, row) && insertRow(row);
+    }
 
-        if (record.columns.size() < 1) {
-            ok = false;
-            return ok;
+    // Same as insertRecord(), for a row of cells. The strings are copied into the columns.
+    bool insertRow(const RowType& row) {
+        // Validate every value against its column before touching the storage.
+        auto types = columnTypes();
+        IdType id = 0;
+        if (!validateRow(row, types, id)) {
+            return false;
         }
 
-        Int32RecordValue* idRecord = dynamic_cast<Int32RecordValue*>(record.columns[0].get());
-        if (!idRecord) {
-            // The first column must be the recrod id!
+        if (m_slots.contains(id)) {
+            // Ids are unique.
             return false;
         }
-        auto id = idRecord->value;
 
-        // Create indices for each column
-        for (size_t i = 1; i < RecordSize; i++) {
-            auto& columnName = m_columnNames[i];
-            auto columnIt = m_columns.find(columnName);
-            if (columnIt == m_columns.end()) {
-                ok = false;
-                break;
-            }
-            auto& column = columnIt->second;
-            auto& value = record.columns[i];
+        // Everything that can fail is checked before the row is logged, so the log only holds inserted rows.
+        auto prevTypes = columnTypes();
+        if (!applyColumnTypes(types)) {
+            return false;
+        }
+        if (!fitsRows(std::span(&row, 1)) || !logInsert(row)) {
+            restoreColumnTypes(prevTypes);
+            return false;
+        }
 
-            if (column.index == -1) {
-                // No index set for this column
-                continue;
-            }
+        SlotType slot = m_store.allocate();
+        writeRow(slot, row);
 
-            if (column.type == RecordValueType::String) {
-                if (column.index >= m_strIndices.size()) {
-                    ok = false;
-                    break;
-                }
+        indexSlot(slot);
+        m_slots.insert(id, slot);
+        invalidateCached(std::span(&slot, 1));
 
-                StrIndices& strIndices = m_strIndices[column.index];
-                StrRecordValue* strRecord = dynamic_cast<StrRecordValue*>(value.get());
-                if (strRecord) {
-                    auto it = strIndices.find(strRecord->value);
-                    if (it == strIndices.end()) {
-                        it = strIndices.insert({ strRecord->value, { uint32_t(id) } }).first;
-                    }
+        return true;
+    }
 
-                    it->second.push_back(id);
-                    ok = true;
-                }
-                else {
-                    ok = false;
-                    break;
-                }
+    /**
+        Inserts a batch of records, either all of them or none. Returns false and leaves the collection unchanged
+        if any record is invalid or its id is taken, also by another record of the batch.
+
+        Faster than inserting the records one by one: the storage, the id map and every index are sized once,
+        and each index gets its keys grouped in linear time, so every posting list is extended once per batch.
+        The keys of different indices are grouped in parallel on the thread pool, see setThreadPool().
+    */
+    bool bulkInsert(std::vector<RecordType>&& records) {
+        std::vector<RowType> rows(records.size());
+        for (size_t r = 0; r < records.size(); r++) {
+            if (!rowOf(records[r], rows[r])) {
+                return false;
             }
-            else if (column.type == RecordValueType::Int64) {
-                if (column.index >= m_int64Indices.size()) {
-                    ok = false;
-                    break;
-                }
+        }
+        return bulkInsertRows(rows);
+    }
 
-                Int64Indices& int64Indices = m_int64Indices[column.index];
-                Int64RecordValue* int64Record = dynamic_cast<Int64RecordValue*>(value.get());
-                if (int64Record) {
-                    auto it = int64Indices.find(int64Record->value);
-                    if (it == int64Indices.end()) {
-                        it = int64Indices.insert({ int64Record->value, { uint32_t(id) } }).first;
-                    }
+    // Same as bulkInsert(), for rows of cells. The strings are copied into the columns.
+    bool bulkInsertRows(std::span<const RowType> rows) {
+        if (rows.empty()) {
+            return true;
+        }
 
-                    it->second.push_back(id);
-                    ok = true;
-                }
-                else {
-                    ok = false;
-                    break;
-                }
+        auto types = columnTypes();
+        std::vector<IdType> ids(rows.size());
+        for (size_t r = 0; r < rows.size(); r++) {
+            if (!validateRow(rows[r], types, ids[r]) || m_slots.contains(ids[r])) {
+                return false;
             }
-            else {
-                ok = false;
-                break;
+        }
+
+        std::vector<IdType> sortedIds = ids;
+        std::sort(sortedIds.begin(), sortedIds.end());
+        if (std::adjacent_find(sortedIds.begin(), sortedIds.end()) != sortedIds.end()) {
+            return false;
+        }
+
+        auto prevTypes = columnTypes();
+        if (!applyColumnTypes(types)) {
+            return false;
+        }
+        if (!fitsRows(rows)) {
+            restoreColumnTypes(prevTypes);
+            return false;
+        }
+
+        for (const auto& row : rows) {
+            if (!logInsert(row)) {
+                restoreColumnTypes(prevTypes);
+                return false;
             }
         }
 
-        if (ok) {
-            // Insert record
-            m_records.insert(std::make_pair(id, std::move(record)));
+        reserve(size() + rows.size());
+        std::vector<SlotType> slots(rows.size());
+        for (size_t r = 0; r < rows.size(); r++) {
+            slots[r] = m_store.allocate();
+            writeRow(slots[r], rows[r]);
         }
 
-        return ok;
+        for (size_t r = 0; r < rows.size(); r++) {
+            m_slots.insert(ids[r], slots[r]);
+        }
+        indexSlots(slots);
+        invalidateCached(slots);
+        return true;
     }
 
-    Collection<RecordSize> match(const std::string& columnName, const std::string& matchString, bool& ok) const {
-        ColumnNamesType namesCopy = m_columnNames;
-        Collection<RecordSize> res (std::move(namesCopy));
+    ResultSet match(const std::string& columnName, const std::string& matchString, bool& ok) const {
+        size_t pos = 0;
+        std::string key;
+        if (!m_cache || !cacheKey(columnName, matchString, pos, key)) {
+            return matchUncached(columnName, matchString, ok);
+        }
 
-        bool isTheIdColumn = columnName == m_columnNames[0];
+        if (auto slots = m_cache->find(pos, key)) {
+            ok = true;
+            return ResultSet(this, std::move(slots));
+        }
 
-        if (isTheIdColumn) {
+        ResultSet res = matchUncached(columnName, matchString, ok);
+        if (ok && res.sharedSlots()) {
+            m_cache->insert(pos, key, res.sharedSlots());
+        }
+        return res;
+    }
+
+    /**
+        Calls fn(row) for every row whose value in the column falls in the range, in increasing key order. The
+        column must have an Ordered index. Stops early if fn returns false. Returns false if the column has no
+        Ordered index.
+    */
+    template <typename Fn>
+    bool forEachInRange(const std::string& columnName, const KeyRange& range, Fn&& fn) const {
+        const OrderedIndex* index = findOrderedIndex(columnName);
+        if (!index) {
+            return false;
+        }
+
+        index->forEachInRange(range, [&](int64_t, const PostingList& list) {
+            for (SlotType slot : list) {
+                if (m_store.isLive(slot) && !fn(RowView{ this, slot })) {
+                    return false;
+                }
+            }
+            return true;
+        });
+        return true;
+    }
+
+    // Returns the rows whose value in the column falls in the range, in increasing key order.
+    ResultSet matchRange(const std::string& columnName, const KeyRange& range, bool& ok) const {
+        std::vector<SlotType> slots;
+        ok = forEachInRange(columnName, range, [&](const RowView& row) {
+            slots.push_back(row.slot);
+            return true;
+        });
+        return ResultSet(this, std::move(slots));
+    }
+
+    /**
+        Calls fn(row) for every row matching the column, with the same semantics and in the same slot order as
+        match(), but without collecting the result first. Stops as soon as fn returns false: indexed columns are
+        walked one posting at a time and unindexed ones are scanned MinChunkSlots slots at a time, so the rest
+        of the work is skipped.
+    */
+    template <typename Fn>
+    void forEachMatch(const std::string& columnName, const std::string& matchString, bool& ok, Fn&& fn) const {
+        if (columnName == m_columnNames[0]) {
             int32_t id = 0;
             ok = core::toInt32(matchString.data(), id);
-            if (!ok) return res;
+            if (!ok) return;
 
-            auto it = m_records.find(id);
-            if (it != m_records.end()) {
-                // When matching the id column there is only one record to return
-                auto recCpy = it->second.copy();
-                res.insertRecord(std::move(recCpy));
+            SlotType slot = m_slots.find(IdType(id));
+            if (slot != IdSlotTable::NoSlot) {
+                fn(RowView{ this, slot });
             }
-
-            ok = true;
-            return res;
+            return;
         }
 
         auto columnIt = m_columns.find(columnName);
         if (columnIt == m_columns.end()) {
             ok = false;
-            return res;
+            return;
         }
 
-        auto& column = columnIt->second;
+        const auto& column = columnIt->second;
+        size_t pos = columnPosition(columnName);
         if (column.index == -1) {
-            // No index set for this column
-            ok = false;
-            return res;
+            forEachByScan(pos, column, matchString, ok, fn);
+            return;
         }
 
-        auto insertRangeFromIndex = [&](const auto& indices, const auto& val) {
-            auto range = indices.equal_range(val);
-            for (auto it = range.first; it != range.second; it++) {
-                for (auto& id : it->second) {
-                    auto recIt = m_records.find(id);
-                    if (recIt != m_records.end()) {
-                        auto recCpy = recIt->second.copy();
-                        res.insertRecord(std::move(recCpy));
-                    }
-                }
+        if (column.indexKind == IndexKind::NGram) {
+            ok = column.index < m_ngramIndices.size();
+            if (ok) {
+                forEachContaining(pos, m_ngramIndices[column.index], matchString, fn);
             }
-        };
+            return;
+        }
 
-        if (column.type == RecordValueType::String) {
-            if (column.index >= m_strIndices.size()) {
-                ok = false;
-                return res;
+        visitIndexList(column, matchString, ok, [&](const auto& list) { forEachLiveIn(list, fn); });
+    }
+
+    /**
+        Returns at most limit of the rows match() returns, after skipping the first offset of them. Only the first
+        offset + limit matches are visited, see forEachMatch(), so a page costs time proportional to its end rather
+        than to the whole result.
+    */
+    ResultSet matchPage(const std::string& columnName, const std::string& matchString, size_t offset, size_t limit,
+                        bool& ok) const {
+        std::vector<SlotType> slots;
+        slots.reserve(std::min(limit, size()));
+        forEachMatch(columnName, matchString, ok, [&](const RowView& row) {
+            if (offset > 0) {
+                offset--;
+                return true;
             }
+            if (slots.size() == limit) {
+                return false;
+            }
+            slots.push_back(row.slot);
+            return slots.size() < limit;
+        });
+        return ResultSet(this, std::move(slots));
+    }
 
-            const auto& strIndices = m_strIndices[column.index];
-            insertRangeFromIndex(strIndices, matchString);
+    /**
+        Returns the number of rows match() returns, without collecting them and without the result cache. Exact
+        matches on Hash and Ordered indices are answered from the length of the posting list, as long as no
+        removed rows wait for compaction, without visiting any row. Other matches count the rows forEachMatch()
+        visits.
+    */
+    size_t count(const std::string& columnName, const std::string& matchString, bool& ok) const {
+        size_t n = 0;
+        auto columnIt = m_columns.find(columnName);
+        if (columnName != m_columnNames[0] && columnIt != m_columns.end() && columnIt->second.index != -1 &&
+            columnIt->second.indexKind != IndexKind::NGram) {
+            visitIndexList(columnIt->second, matchString, ok, [&](const auto& list) {
+                if (m_store.deadCount() == 0) {
+                    n = list.size();
+                    return;
+                }
+                for (SlotType slot : list) {
+                    n += m_store.isLive(slot);
+                }
+            });
+            return n;
         }
-        else if (column.type == RecordValueType::Int64) {
-            if (column.index >= m_int64Indices.size()) {
-                ok = false;
-                return res;
-            }
 
-            int64_t v;
-            ok = core::toInt64(matchString.data(), v);
-            if (!ok) return res;
+        forEachMatch(columnName, matchString, ok, [&](const RowView&) {
+            n++;
+            return true;
+        });
+        return n;
+    }
 
-            const auto& int64Indices = m_int64Indices[column.index];
-            insertRangeFromIndex(int64Indices, v);
+    /**
+        Returns the count, sum, minimum and maximum of the Int32 or Int64 valueColumn over the rows match() returns.
+        The values are read straight from the column storage, no row is materialized. ok is false if the match
+        fails or valueColumn is not numeric.
+    */
+    Aggregate aggregate(const std::string& columnName, const std::string& matchString, const std::string& valueColumn,
+                        bool& ok) const {
+        Aggregate res;
+        size_t valuePos = 0;
+        ok = findNumericColumn(valueColumn, valuePos);
+        if (!ok) {
+            return res;
         }
 
-        ok = true;
+        // match() only returns live rows.
+        match(columnName, matchString, ok).visitSlots([&](const auto& slots) {
+            aggregateSlots(valuePos, slots, false, res);
+        });
         return res;
     }
 
-    void remove(typename RecordType::IdType id) {
-        auto it = m_records.find(id);
-        if (it != m_records.end()) {
-            for (size_t i = 1; i < RecordSize; i++) {
-                auto& columnName = m_columnNames[i];
-                auto columnIt = m_columns.find(columnName);
-                if (columnIt == m_columns.end()) {
-                    continue;
+    /**
+        Calls fn(key, count) for every distinct value of groupColumn and the number of rows holding it.
+        groupColumn must have a Hash or Ordered index, whose buckets are the groups. Without removed rows waiting
+        for compaction, the counts are the lengths of the posting lists and no row is visited. Groups come in key
+        order for Ordered indices and in no particular order for Hash ones. The keys are Int64 or String cells,
+        valid until the collection is modified. Returns false if groupColumn has no such index.
+    */
+    template <typename Fn>
+    bool groupCount(const std::string& groupColumn, Fn&& fn) const {
+        return forEachGroup(groupColumn, [&](const CellView& key, const auto& list) {
+            size_t n = 0;
+            if (m_store.deadCount() == 0) {
+                n = list.size();
+            }
+            else {
+                for (SlotType slot : list) {
+                    n += m_store.isLive(slot);
                 }
-                auto& column = columnIt->second;
-                auto& value = it->second.columns[i];
+            }
+            if (n > 0) {
+                fn(key, n);
+            }
+        });
+    }
 
-                if (column.index == -1) {
-                    // No index set for this column
-                    continue;
-                }
+    /**
+        Calls fn(key, aggregate) for every distinct value of groupColumn, with the aggregate of the Int32 or Int64
+        valueColumn over the rows holding it. The groups are the buckets of the index as for groupCount(). Returns
+        false if groupColumn has no Hash or Ordered index or valueColumn is not numeric.
+    */
+    template <typename Fn>
+    bool groupBy(const std::string& groupColumn, const std::string& valueColumn, Fn&& fn) const {
+        size_t valuePos = 0;
+        if (!findNumericColumn(valueColumn, valuePos)) {
+            return false;
+        }
 
-                // Remove from indices
+        return forEachGroup(groupColumn, [&](const CellView& key, const auto& list) {
+            Aggregate res;
+            aggregateSlots(valuePos, list, m_store.deadCount() != 0, res);
+            if (res.count > 0) {
+                fn(key, res);
+            }
+        });
+    }
 
-                auto removeIdFromIndex = [&](auto& indices, auto& val) {
-                    auto it = indices.find(val);
-                    if (it != indices.end()) {
-                        auto& vec = it->second;
-                        vec.erase(std::remove(vec.begin(), vec.end(), id), vec.end());
-                    }
-                };
+    /**
+        Returns the rows that match all predicates. Predicates answered by a posting list (the id column, Hash and
+        Ordered indices) are intersected from the shortest list to the longest. The other predicates are then
+        checked row by row on the remaining candidates, so their columns are never scanned in full. Without any
+        posting list predicate, one of the others is matched first, preferably one with an NGram index.
+    */
+    ResultSet matchAll(const std::vector<Predicate>& predicates, bool& ok) const {
+        ok = true;
+        if (predicates.size() == 1) {
+            return match(predicates[0].columnName, predicates[0].matchString, ok);
+        }
 
-                if (column.type == RecordValueType::String) {
-                    if (column.index >= m_strIndices.size()) {
-                        continue;
-                    }
+        std::vector<ResultSet> lists;
+        std::vector<RowFilter> filters;
+        for (const auto& predicate : predicates) {
+            auto columnIt = m_columns.find(predicate.columnName);
+            if (columnIt == m_columns.end()) {
+                ok = false;
+                return ResultSet(this);
+            }
 
-                    StrIndices& strIndices = m_strIndices[column.index];
-                    StrRecordValue* strRecord = dynamic_cast<StrRecordValue*>(value.get());
-                    if (strRecord) {
-                        removeIdFromIndex(strIndices, strRecord->value);
-                    }
-                }
-                else if (column.type == RecordValueType::Int64) {
-                    if (column.index >= m_int64Indices.size()) {
-                        continue;
-                    }
+            const auto& column = columnIt->second;
+            size_t pos = columnPosition(predicate.columnName);
+            bool hasList = pos == 0 || (column.index != -1 && column.indexKind != IndexKind::NGram);
+            if (hasList) {
+                lists.push_back(match(predicate.columnName, predicate.matchString, ok));
+            }
+            else {
+                filters.push_back(makeRowFilter(pos, column, predicate.matchString, ok));
+            }
 
-                    Int64Indices& int64Indices = m_int64Indices[column.index];
-                    Int64RecordValue* int64Record = dynamic_cast<Int64RecordValue*>(value.get());
-                    if (int64Record) {
-                        removeIdFromIndex(int64Indices, int64Record->value);
-                    }
-                }
+            if (!ok) {
+                return ResultSet(this);
+            }
+        }
+
+        std::vector<SlotType> slots;
+        if (lists.empty() && filters.empty()) {
+            slots = liveSlots();
+        }
+        else if (lists.empty()) {
+            auto first = std::find_if(filters.begin(), filters.end(), [this](const RowFilter& f) {
+                return m_columns.at(m_columnNames[f.pos]).indexKind == IndexKind::NGram;
+            });
+            if (first == filters.end()) {
+                first = filters.begin();
             }
 
-            m_records.erase(it);
+            match(m_columnNames[first->pos], first->pattern, ok).visitSlots([&](const auto& s) {
+                slots.assign(s.begin(), s.end());
+            });
+            filters.erase(first);
+        }
+        else {
+            std::sort(lists.begin(), lists.end(), [](const ResultSet& a, const ResultSet& b) {
+                return a.size() < b.size();
+            });
+
+            lists[0].visitSlots([&](const auto& s) { slots.assign(s.begin(), s.end()); });
+            for (size_t i = 1; i < lists.size() && !slots.empty(); i++) {
+                lists[i].visitSlots([&](const auto& s) { intersectWith(slots, s); });
+            }
         }
+
+        auto it = std::remove_if(slots.begin(), slots.end(), [&](SlotType slot) {
+            return !std::all_of(filters.begin(), filters.end(), [&](const RowFilter& f) { return rowMatches(f, slot); });
+        });
+        slots.erase(it, slots.end());
+        return ResultSet(this, std::move(slots));
     }
 
-#ifdef _DEBUG
+    /**
+        Returns the rows that match any of the predicates, in slot order. Every predicate is matched on its own and
+        the results are merged from the shortest to the longest.
+    */
+    ResultSet matchAny(const std::vector<Predicate>& predicates, bool& ok) const {
+        ok = true;
+        if (predicates.size() == 1) {
+            return match(predicates[0].columnName, predicates[0].matchString, ok);
+        }
 
-    void debug_PrintCollection(bool printIndices = false) const {
-       std::cout << "Records: " << std::endl;
-        for (auto& rec : m_records) {
-            std::cout << "\t{ " ;
-            for (size_t i = 0; i < RecordSize; i++) {
-                std::cout << m_columnNames[i] << ": " << rec.second.columns[i]->toStr() << ", ";
+        std::vector<std::vector<SlotType>> parts;
+        for (const auto& predicate : predicates) {
+            auto res = match(predicate.columnName, predicate.matchString, ok);
+            if (!ok) {
+                return ResultSet(this);
             }
-            std::cout << "}" << std::endl;
+            res.visitSlots([&](const auto& s) { parts.emplace_back(s.begin(), s.end()); });
         }
 
-        if (printIndices) {
+        std::vector<SlotType> slots;
+        uniteSorted(std::move(parts), slots);
+        return ResultSet(this, std::move(slots));
+    }
+
+    /**
+        Removes the row in O(1). The row is only marked dead, its index entries and values stay in place and
+        queries skip it, until enough rows are dead for compact() to run, see setCompactionThreshold().
+    */
+    void remove(IdType id) {
+        if (!m_slots.contains(id) || (m_log && !m_log->append(WriteAheadLog::EntryKind::Remove, std::as_bytes(std::span(&id, 1))))) {
+            return;
+        }
+
+        SlotType slot = m_slots.erase(id);
+        if (slot != IdSlotTable::NoSlot) {
+            invalidateCached(std::span(&slot, 1));
+            m_store.markDead(slot);
+            compactIfNeeded();
+        }
+    }
+
+    /**
+        Drops the removed rows from every index in one pass over each index and makes their slots available
+        to new rows. Costs O(index entries), so remove() only runs it after a fraction of the rows died. Does
+        nothing while an index build is pending, see startIndexBuild().
+    */
+    void compact() {
+        if (m_store.deadCount() == 0 || !m_indexBuilds.empty()) {
+            return;
+        }
+
+        auto isDead = [this](SlotType slot) { return !m_store.isLive(slot); };
+        for (auto& index : m_strIndices) index.eraseSlotsIf(isDead);
+        for (auto& index : m_int64Indices) index.eraseSlotsIf(isDead);
+        for (auto& index : m_ngramIndices) index.eraseSlotsIf(isDead);
+        for (auto& index : m_orderedIndices) index.eraseSlotsIf(isDead);
+        for (auto& index : m_codeIndices) index.eraseSlotsIf(isDead);
+        m_store.reclaimDead();
+    }
+
+    /**
+        Writes the column types, the rows and every index into a binary snapshot file, see open(). The indices
+        are written as built, posting lists included, so open() copies them back instead of rebuilding them.
+        Removed rows are left out: their values are written cleared and their slots are dropped from the posting
+        lists. Columns with a pending index build are saved without the index. Returns false if any write failed.
+    */
+    bool save(const std::string& path) const {
+        snapshot::Writer out(path);
+
+        snapshot::Header header{};
+        std::copy(std::begin(snapshot::Magic), std::end(snapshot::Magic), header.magic);
+        header.version = snapshot::Version;
+        header.byteOrderMark = snapshot::ByteOrderMark;
+        header.columnsCount = uint32_t(RecordSize);
+        header.slotCount = m_store.slotCount();
+        bool ok = out.value(header);
+
+        for (size_t i = 0; i < RecordSize && ok; i++) {
+            const auto& column = m_columns.at(m_columnNames[i]);
+            ok = out.string(m_columnNames[i]) &&
+                 out.value(SnapshotColumn{ uint8_t(column.type), uint8_t(column.encoding), uint8_t(column.indexKind) });
+        }
+
+        std::vector<uint8_t> live(m_store.slotCount());
+        for (size_t slot = 0; slot < live.size(); slot++) {
+            live[slot] = m_store.isLive(SlotType(slot));
+        }
+        ok = ok && out.array(std::span<const uint8_t>(live));
+
+        for (size_t i = 0; i < RecordSize && ok; i++) {
+            ok = writeColumn(out, i);
+        }
+
+        ok = ok && out.value(uint8_t(m_dictionary != nullptr));
+        if (m_dictionary) {
+            ok = ok && out.array(std::span<const StringColumn::Span>(m_dictionary->values().spans)) &&
+                 out.array(std::span<const char>(m_dictionary->values().blob));
+        }
+
+        for (size_t i = 1; i < RecordSize && ok; i++) {
+            const auto& column = m_columns.at(m_columnNames[i]);
+            if (column.index != -1) {
+                ok = writeIndex(out, column);
+            }
+        }
+
+        return ok && out.finish();
+    }
+
+    /**
+        Saves a snapshot like save() and then drops the entries of the write-ahead log, which the snapshot now
+        covers. The log belongs to this collection alone, see setWriteAheadLog(). The snapshot is written to a
+        temporary file, flushed to disk and renamed, so a crash leaves either the old snapshot and the whole log
+        or the new snapshot. Returns false if any step failed.
+    */
+    bool checkpoint(const std::string& snapshotPath) {
+        const std::string tmpPath = snapshotPath + ".tmp";
+        if (!save(tmpPath) || !WriteAheadLog::syncFile(tmpPath)) {
+            return false;
+        }
+
+        std::error_code error;
+        std::filesystem::rename(tmpPath, snapshotPath, error);
+        return !error && (!m_log || m_log->truncate());
+    }
+
+    /**
+        Applies the changes logged in the write-ahead log at path, e.g. on top of the collection open() returned
+        for the latest snapshot. Runs of inserts are applied with bulkInsert(), so replaying costs about as much as
+        a bulk load. Inserts that the collection rejects, e.g. because the snapshot already has their ids, are
+        skipped. Replay stops at a torn entry at the end of the log. Nothing is logged while replaying. Returns
+        false if the log cannot be read.
+    */
+    bool replay(const std::string& logPath) {
+        auto log = std::move(m_log);
+        std::vector<RecordType> batch;
+        auto flush = [&]() {
+            // A rejected batch is unchanged, retry its records one by one to keep the valid ones.
+            if (!bulkInsert(std::move(batch))) {
+                for (auto& record : batch) {
+                    insertRecord(std::move(record));
+                }
+            }
+            batch.clear();
+        };
+
+        bool ok = WriteAheadLog::replay(logPath, [&](WriteAheadLog::EntryKind kind, std::span<const std::byte> payload) {
+            if (kind == WriteAheadLog::EntryKind::Insert) {
+                RecordType record;
+                if (decodeRecord(payload, record)) {
+                    batch.push_back(std::move(record));
+                }
+            }
+            else if (kind == WriteAheadLog::EntryKind::Remove && payload.size() == sizeof(IdType)) {
+                IdType id = 0;
+                std::memcpy(&id, payload.data(), sizeof(id));
+                flush();
+                remove(id);
+            }
+        });
+        flush();
+
+        m_log = std::move(log);
+        return ok;
+    }
+
+    /**
+        Opens a snapshot written by save(). The file is memory mapped and the columns, the dictionary and the
+        posting lists of every index are copied out of it array by array, so nothing is parsed row by row and no
+        index is rebuilt: every list is checked and copied as it was saved.
+        The file is not needed after open() returns. Returns std::nullopt if the file cannot be read, was written
+        by another version or for another RecordSize, or is damaged. The file is checked for bounds, not for
+        consistency between the rows and the indices.
+    */
+    static std::optional<Collection> open(const std::string& path, MemoryResourcePtr memory = nullptr) {
+        MappedFile file;
+        if (!file.open(path)) {
+            return std::nullopt;
+        }
+
+        snapshot::Reader in(std::span<const std::byte>(file.data(), file.size()));
+        snapshot::Header header{};
+        bool headerOk = in.value(header) && std::equal(std::begin(header.magic), std::end(header.magic), snapshot::Magic) &&
+                        header.version == snapshot::Version && header.byteOrderMark == snapshot::ByteOrderMark &&
+                        header.columnsCount == RecordSize && header.slotCount < std::numeric_limits<SlotType>::max();
+        if (!headerOk) {
+            return std::nullopt;
+        }
+
+        ColumnNamesType names;
+        std::array<SnapshotColumn, RecordSize> columns;
+        for (size_t i = 0; i < RecordSize; i++) {
+            std::string_view name;
+            if (!in.string(name) || !in.value(columns[i])) {
+                return std::nullopt;
+            }
+            names[i] = std::string(name);
+        }
+
+        std::span<const uint8_t> live;
+        if (!in.array(live) || live.size() != header.slotCount) {
+            return std::nullopt;
+        }
+
+        std::optional<Collection> res(std::in_place, std::move(names), std::move(memory));
+        if (!res->restoreSnapshot(in, columns, live)) {
+            return std::nullopt;
+        }
+        return res;
+    }
+
+#ifdef _DEBUG
+
+    void debug_PrintCollection(bool printIndices = false) const {
+       std::cout << "Records: " << std::endl;
+        for (const auto& row : *this) {
+            std::cout << "\t{ " ;
+            for (size_t i = 0; i < RecordSize; i++) {
+                std::cout << m_columnNames[i] << ": " << cellToStr(i, row.slot) << ", ";
+            }
+            std::cout << "}" << std::endl;
+        }
+
+        if (printIndices) {
             std::cout << "String indices: " << std::endl;
             for (size_t i = 0; i < m_strIndices.size(); i++) {
                 std::cout << "\t{ ";
                 for (auto& idx : m_strIndices[i]) {
                     std::cout << idx.first << ": { ";
-                    for (auto& id : idx.second) {
-                        std::cout << id << ", ";
+                    for (SlotType slot : idx.second) {
+                        std::cout << idAt(slot) << ", ";
                     }
                     std::cout << "}, ";
                 }
@@ -448,8 +1182,8 @@ struct Collection {
                 std::cout << "\t{ ";
                 for (auto& idx : m_int64Indices[i]) {
                     std::cout << idx.first << ": { ";
-                    for (auto& id : idx.second) {
-                        std::cout << id << ", ";
+                    for (SlotType slot : idx.second) {
+                        std::cout << idAt(slot) << ", ";
                     }
                     std::cout << "}, ";
                 }
@@ -460,22 +1194,1610 @@ struct Collection {
             std::cout << "Int64 indices: " << m_int64Indices.size() << std::endl;
         }
 
+        std::cout << "NGram indices: " << m_ngramIndices.size() << std::endl;
+        std::cout << "Ordered indices: " << m_orderedIndices.size() << std::endl;
+        std::cout << "Dictionary code indices: " << m_codeIndices.size() << std::endl;
+        std::cout << "Dictionary size: " << (m_dictionary ? m_dictionary->size() : 0) << std::endl;
+
         std::cout << std::endl;
     }
 
 #endif
 
 private:
+    friend ResultSet;
+
+    IdType idAt(SlotType slot) const {
+        return IdType(std::get<Int32Column>(m_store.column(0)).get(slot));
+    }
+
+    // Calls fn with the storage of a String column, which is either plain or dictionary encoded.
+    template <typename Fn>
+    decltype(auto) visitStringColumn(size_t pos, Fn&& fn) const {
+        if (const auto* dict = std::get_if<DictStringColumn>(&m_store.column(pos))) {
+            return fn(*dict);
+        }
+        return fn(std::get<StringColumn>(m_store.column(pos)));
+    }
+
+    template <typename Fn>
+    decltype(auto) visitStringColumn(size_t pos, Fn&& fn) {
+        if (auto* dict = std::get_if<DictStringColumn>(&m_store.column(pos))) {
+            return fn(*dict);
+        }
+        return fn(std::get<StringColumn>(m_store.column(pos)));
+    }
+
+    std::string_view stringAt(size_t pos, SlotType slot) const {
+        return visitStringColumn(pos, [slot](const auto& col) { return col.get(slot); });
+    }
+
+    size_t columnPosition(const std::string& columnName) const {
+        auto it = std::find(m_columnNames.begin(), m_columnNames.end(), columnName);
+        return size_t(it - m_columnNames.begin());
+    }
+
+    bool setColumnType(size_t pos, Column& column, RecordValueType type) {
+        if (column.type == type) {
+            return true;
+        }
+        if (column.type != RecordValueType::None) {
+            return false;
+        }
+
+        switch (type) {
+            case RecordValueType::Int32:
+                m_store.template setColumnType<Int32Column>(pos);
+                break;
+            case RecordValueType::Int64:
+                m_store.template setColumnType<Int64Column>(pos);
+                break;
+            case RecordValueType::String:
+                m_store.template setColumnType<StringColumn>(pos);
+                break;
+            default:
+                return false;
+        }
+
+        column.type = type;
+        return true;
+    }
+
+    static bool canIndex(RecordValueType type, IndexKind kind) {
+        switch (kind) {
+            case IndexKind::Hash:
+                return type == RecordValueType::String || type == RecordValueType::Int64;
+            case IndexKind::NGram:
+                return type == RecordValueType::String;
+            case IndexKind::Ordered:
+                return type == RecordValueType::Int64;
+            default:
+                return false;
+        }
+    }
+
+    // Registers an empty index on the column.
+    bool addIndex(const std::string& columnName, RecordValueType type, IndexKind kind) {
+        auto it = m_columns.find(columnName);
+        if (it == m_columns.end()) {
+            return false;
+        }
+
+        auto& column = it->second;
+        if (column.index != -1) {
+            // Only one index per column.
+            return false;
+        }
+
+        bool isDictionary = column.encoding == ColumnEncoding::Dictionary;
+        int32_t index = 0;
+        if (kind == IndexKind::Hash && type == RecordValueType::String && isDictionary) {
+            index = static_cast<int32_t>(m_codeIndices.size());
+        }
+        else if (kind == IndexKind::Hash && type == RecordValueType::String) {
+            index = static_cast<int32_t>(m_strIndices.size());
+        }
+        else if (kind == IndexKind::Hash && type == RecordValueType::Int64) {
+            index = static_cast<int32_t>(m_int64Indices.size());
+        }
+        else if (kind == IndexKind::NGram && type == RecordValueType::String) {
+            index = static_cast<int32_t>(m_ngramIndices.size());
+        }
+        else if (kind == IndexKind::Ordered && type == RecordValueType::Int64) {
+            index = static_cast<int32_t>(m_orderedIndices.size());
+        }
+        else {
+            return false;
+        }
+
+        size_t pos = columnPosition(columnName);
+        if (!setColumnType(pos, column, type)) {
+            // The column already stores values of a different type.
+            return false;
+        }
+
+        if (kind == IndexKind::NGram) {
+            m_ngramIndices.push_back(NGramIndex(m_memory.get()));
+        }
+        else if (kind == IndexKind::Ordered) {
+            m_orderedIndices.push_back(OrderedIndex(m_memory.get()));
+        }
+        else if (isDictionary) {
+            m_codeIndices.push_back(CodeIndices(m_memory.get()));
+        }
+        else if (type == RecordValueType::String) {
+            m_strIndices.push_back(StrIndices(m_memory.get()));
+        }
+        else {
+            m_int64Indices.push_back(Int64Indices(m_memory.get()));
+        }
+
+        column.index = index;
+        column.indexKind = kind;
+        if (m_cache) {
+            // Matches on the column may turn from substring to exact ones.
+            m_cache->clear(pos);
+        }
+        return true;
+    }
+
+    void compactIfNeeded() {
+        if (double(m_store.deadCount()) > m_compactionThreshold * double(m_store.slotCount())) {
+            compact();
+        }
+    }
+
+    // The sorted keys of an index, see sortKeys(). Only the member the index takes is filled.
+    struct IndexKeys {
+        SortedPostings<std::string_view> strings;
+        SortedPostings<int64_t> int64s;
+        // Grams of NGram indices or codes of dictionary encoded columns.
+        SortedPostings<uint32_t> codes;
+    };
+
+    // The state shared with the background thread of an index build. The thread only reads column and slots.
+    struct IndexBuild {
+        typename StoreType::ColumnData column;
+        std::vector<SlotType> slots;
+        IndexKeys keys;
+    };
+
+    // Releases the log rather than deleting it, so another collection may take it.
+    struct LogDetacher {
+        void operator()(WriteAheadLog* log) const { log->detach(); }
+    };
+
+    struct PendingIndexBuild {
+        std::string columnName;
+        RecordValueType type;
+        IndexKind kind;
+        std::shared_ptr<IndexBuild> build;
+        // Ready once build->keys are sorted. Waits for the thread when destroyed.
+        std::future<void> sorted;
+    };
+
+    typename std::vector<PendingIndexBuild>::iterator findIndexBuild(const std::string& columnName) {
+        return std::find_if(m_indexBuilds.begin(), m_indexBuilds.end(), [&](const auto& b) { return b.columnName == columnName; });
+    }
+
+    typename std::vector<PendingIndexBuild>::const_iterator findIndexBuild(const std::string& columnName) const {
+        return std::find_if(m_indexBuilds.begin(), m_indexBuilds.end(), [&](const auto& b) { return b.columnName == columnName; });
+    }
+
+    std::array<RecordValueType, RecordSize> columnTypes() const {
+        std::array<RecordValueType, RecordSize> types;
+        for (size_t i = 0; i < RecordSize; i++) {
+            types[i] = m_columns.at(m_columnNames[i]).type;
+        }
+        return types;
+    }
+
+    // Makes a row of cells that reference the values of the record. Returns false if a value is missing.
+    static bool rowOf(const RecordType& record, RowType& row) {
+        for (size_t i = 0; i < RecordSize; i++) {
+            const RecordValue* value = record.columns[i].get();
+            if (!value) {
+                return false;
+            }
+
+            switch (value->type()) {
+                case RecordValueType::Int32:
+                    row[i] = CellView::int32(static_cast<const Int32RecordValue*>(value)->value);
+                    break;
+                case RecordValueType::Int64:
+                    row[i] = CellView::int64(static_cast<const Int64RecordValue*>(value)->value);
+                    break;
+                case RecordValueType::String:
+                    row[i] = CellView::string(static_cast<const StrRecordValue*>(value)->value);
+                    break;
+                default:
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+        Checks the cells of the row against types, one per column, and reads its id. Columns without a type
+        yet take the type of the cell, so the types of a batch must agree with its first row.
+    */
+    static bool validateRow(const RowType& row, std::array<RecordValueType, RecordSize>& types, IdType& id) {
+        if (row[0].type != RecordValueType::Int32) {
+            // The first column must be the recrod id!
+            return false;
+        }
+        id = IdType(int32_t(row[0].number));
+
+        for (size_t i = 0; i < RecordSize; i++) {
+            const CellView& cell = row[i];
+            if (cell.type == RecordValueType::Int32 &&
+                (cell.number < std::numeric_limits<int32_t>::min() || cell.number > std::numeric_limits<int32_t>::max())) {
+                return false;
+            }
+
+            if (types[i] == RecordValueType::None) {
+                types[i] = cell.type;
+            }
+            else if (types[i] != cell.type) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool applyColumnTypes(const std::array<RecordValueType, RecordSize>& types) {
+        for (size_t i = 0; i < RecordSize; i++) {
+            if (!setColumnType(i, m_columns.at(m_columnNames[i]), types[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Resets columns that had no type in types back to untyped, to undo applyColumnTypes() on an empty store.
+    void restoreColumnTypes(const std::array<RecordValueType, RecordSize>& types) {
+        if (!empty()) {
+            return;
+        }
+
+        for (size_t i = 0; i < RecordSize; i++) {
+            auto& column = m_columns.at(m_columnNames[i]);
+            if (types[i] == RecordValueType::None && column.encoding == ColumnEncoding::Plain) {
+                column.type = RecordValueType::None;
+                m_store.column(i) = std::monostate();
+            }
+        }
+    }
+
+    /**
+        Whether the string columns have room for every string of the rows, so writing them cannot fail. Strings
+        missing from the dictionary are all counted as new, duplicates included, so a batch just below the limit
+        may be rejected.
+    */
+    bool fitsRows(std::span<const RowType> rows) const {
+        std::array<size_t, RecordSize> bytes{};
+        size_t newStrings = 0;
+        size_t newBytes = 0;
+        for (const auto& row : rows) {
+            for (size_t i = 0; i < RecordSize; i++) {
+                if (row[i].type != RecordValueType::String) {
+                    continue;
+                }
+
+                const auto* dict = std::get_if<DictStringColumn>(&m_store.column(i));
+                if (!dict) {
+                    bytes[i] += row[i].text.size();
+                }
+                else if (dict->dictionary->find(row[i].text) == StringDictionary::NoCode) {
+                    newStrings++;
+                    newBytes += row[i].text.size();
+                }
+            }
+        }
+
+        for (size_t i = 0; i < RecordSize; i++) {
+            const auto* col = std::get_if<StringColumn>(&m_store.column(i));
+            if (col && !col->fits(bytes[i])) {
+                return false;
+            }
+        }
+        return !m_dictionary || m_dictionary->fits(newStrings, newBytes);
+    }
+
+    // Writes the cells of a row whose types are applied and whose strings fit, see fitsRows().
+    void writeRow(SlotType slot, const RowType& row) {
+        for (size_t i = 0; i < RecordSize; i++) {
+            [[maybe_unused]] bool written = writeCell(i, slot, row[i]);
+            assert(written);
+        }
+    }
+
+    bool writeCell(size_t pos, SlotType slot, const CellView& cell) {
+        switch (cell.type) {
+            case RecordValueType::Int32:
+                return std::get<Int32Column>(m_store.column(pos)).set(slot, int32_t(cell.number));
+            case RecordValueType::Int64:
+                return std::get<Int64Column>(m_store.column(pos)).set(slot, cell.number);
+            case RecordValueType::String:
+                return visitStringColumn(pos, [&](auto& col) { return col.set(slot, cell.text); });
+            default:
+                return false;
+        }
+    }
+
+    RecordType materialize(SlotType slot) const {
+        RecordType res;
+        for (size_t i = 0; i < RecordSize; i++) {
+            std::visit([&](const auto& col) {
+                using ColumnType = std::decay_t<decltype(col)>;
+                if constexpr (std::is_same_v<ColumnType, Int32Column>) {
+                    res.columns[i] = std::make_unique<Int32RecordValue>(col.get(slot));
+                }
+                else if constexpr (std::is_same_v<ColumnType, Int64Column>) {
+                    res.columns[i] = std::make_unique<Int64RecordValue>(col.get(slot));
+                }
+                else if constexpr (IsStringColumn<ColumnType>) {
+                    res.columns[i] = std::make_unique<StrRecordValue>(std::string(col.get(slot)));
+                }
+            }, m_store.column(i));
+        }
+        return res;
+    }
+
+    std::string cellToStr(size_t pos, SlotType slot) const {
+        return std::visit([&](const auto& col) -> std::string {
+            using ColumnType = std::decay_t<decltype(col)>;
+            if constexpr (IsStringColumn<ColumnType>) {
+                return std::string(col.get(slot));
+            }
+            else if constexpr (std::is_same_v<ColumnType, std::monostate>) {
+                return std::string();
+            }
+            else {
+                return std::to_string(col.get(slot));
+            }
+        }, m_store.column(pos));
+    }
+
+    // Creates an empty collection with the same column names and types, but without any indices. The copy
+    // allocates from the global heap, so it does not keep the memory resource of this collection alive.
+    Collection<RecordSize> emptyCopy() const {
+        ColumnNamesType namesCopy = m_columnNames;
+        Collection<RecordSize> res(std::move(namesCopy));
+        for (size_t i = 0; i < RecordSize; i++) {
+            const auto& name = m_columnNames[i];
+            const auto& column = m_columns.at(name);
+            res.setColumnType(i, res.m_columns.at(name), column.type);
+            res.setEncoding(name, column.encoding);
+        }
+        return res;
+    }
+
+    // Appends the rows of src in the slots, which must have the same column names and types. Columns of an empty
+    // collection that have no type yet take the type of src.
+    template <typename Slots>
+    void copyRowsFrom(const Collection<RecordSize>& src, const Slots& srcSlots) {
+        if (empty()) {
+            for (size_t i = 1; i < RecordSize; i++) {
+                const auto& name = m_columnNames[i];
+                const auto& srcColumn = src.m_columns.at(name);
+                if (m_columns.at(name).type == RecordValueType::None) {
+                    setEncoding(name, srcColumn.encoding);
+                    setColumnType(i, m_columns.at(name), srcColumn.type);
+                }
+            }
+        }
+
+        std::vector<SlotType> slots;
+        for (SlotType srcSlot : srcSlots) {
+            SlotType slot = m_store.allocate();
+            for (size_t i = 0; i < RecordSize; i++) {
+                std::visit([&](const auto& srcCol) {
+                    using ColumnType = std::decay_t<decltype(srcCol)>;
+                    if constexpr (!std::is_same_v<ColumnType, std::monostate>) {
+                        std::get<ColumnType>(m_store.column(i)).set(slot, srcCol.get(srcSlot));
+                    }
+                }, src.m_store.column(i));
+            }
+
+            indexSlot(slot);
+            m_slots.insert(idAt(slot), slot);
+            slots.push_back(slot);
+        }
+        invalidateCached(slots);
+    }
+
+    const OrderedIndex* findOrderedIndex(const std::string& columnName) const {
+        auto it = m_columns.find(columnName);
+        if (it == m_columns.end() || it->second.index == -1 || it->second.indexKind != IndexKind::Ordered) {
+            return nullptr;
+        }
+        return &m_orderedIndices[it->second.index];
+    }
+
+    // Answers match() from the indices or the column storage, without the result cache.
+    ResultSet matchUncached(const std::string& columnName, const std::string& matchString, bool& ok) const {
+        ResultSet res(this);
+
+        bool isTheIdColumn = columnName == m_columnNames[0];
+
+        if (isTheIdColumn) {
+            int32_t id = 0;
+            ok = core::toInt32(matchString.data(), id);
+            if (!ok) return res;
+
+            SlotType slot = m_slots.find(IdType(id));
+            if (slot != IdSlotTable::NoSlot) {
+                // When matching the id column there is only one record to return
+                res = ResultSet(this, std::vector<SlotType>{ slot });
+            }
+
+            ok = true;
+            return res;
+        }
+
+        auto columnIt = m_columns.find(columnName);
+        if (columnIt == m_columns.end()) {
+            ok = false;
+            return res;
+        }
+
+        auto& column = columnIt->second;
+        if (column.index == -1) {
+            // No index set for this column, fall back to scanning it.
+            return matchByScan(columnPosition(columnName), column, matchString, ok);
+        }
+
+        auto resultFromIndex = [&](const auto& indices, const auto& val) {
+            if (const auto* list = indices.find(val)) {
+                res = resultFromList(*list);
+            }
+        };
+
+        if (column.indexKind == IndexKind::NGram) {
+            if (column.index >= m_ngramIndices.size()) {
+                ok = false;
+                return res;
+            }
+
+            res = ResultSet(this, matchContains(columnPosition(columnName), m_ngramIndices[column.index], matchString));
+        }
+        else if (column.indexKind == IndexKind::Ordered) {
+            if (column.index >= m_orderedIndices.size()) {
+                ok = false;
+                return res;
+            }
+
+            int64_t v;
+            ok = core::toInt64(matchString.data(), v);
+            if (!ok) return res;
+
+            if (const PostingList* list = m_orderedIndices[column.index].find(v)) {
+                res = resultFromList(*list);
+            }
+        }
+        else if (column.type == RecordValueType::String && column.encoding == ColumnEncoding::Dictionary) {
+            if (column.index >= m_codeIndices.size()) {
+                ok = false;
+                return res;
+            }
+
+            // Matching a dictionary encoded column compares codes instead of strings.
+            auto code = m_dictionary->find(matchString);
+            if (code != StringDictionary::NoCode) {
+                resultFromIndex(m_codeIndices[column.index], code);
+            }
+        }
+        else if (column.type == RecordValueType::String) {
+            if (column.index >= m_strIndices.size()) {
+                ok = false;
+                return res;
+            }
+
+            const auto& strIndices = m_strIndices[column.index];
+            resultFromIndex(strIndices, matchString);
+        }
+        else if (column.type == RecordValueType::Int64) {
+            if (column.index >= m_int64Indices.size()) {
+                ok = false;
+                return res;
+            }
+
+            int64_t v;
+            ok = core::toInt64(matchString.data(), v);
+            if (!ok) return res;
+
+            const auto& int64Indices = m_int64Indices[column.index];
+            resultFromIndex(int64Indices, v);
+        }
+
+        ok = true;
+        return res;
+    }
+
+    // Sets pos to the position of the column if it stores Int32 or Int64 values.
+    bool findNumericColumn(const std::string& columnName, size_t& pos) const {
+        auto it = m_columns.find(columnName);
+        if (it == m_columns.end() ||
+            (it->second.type != RecordValueType::Int32 && it->second.type != RecordValueType::Int64)) {
+            return false;
+        }
+        pos = columnPosition(columnName);
+        return true;
+    }
+
+    /**
+        Adds the values of the numeric column in the slots to res, skipping removed rows if checkLive. slots is a
+        span or a CompressedPostingList.
+    */
+    template <typename TSlots>
+    void aggregateSlots(size_t pos, const TSlots& slots, bool checkLive, Aggregate& res) const {
+        std::visit([&](const auto& col) {
+            using ColumnType = std::decay_t<decltype(col)>;
+            if constexpr (std::is_same_v<ColumnType, Int32Column> || std::is_same_v<ColumnType, Int64Column>) {
+                const auto* values = col.values.data();
+                if constexpr (std::is_same_v<TSlots, std::span<const SlotType>>) {
+                    if (!checkLive) {
+                        // No branches and no dependency between the aggregates, so compilers can vectorize the
+                        // loop with gathers.
+                        uint64_t sum = 0;
+                        int64_t lo = std::numeric_limits<int64_t>::max();
+                        int64_t hi = std::numeric_limits<int64_t>::min();
+                        for (SlotType slot : slots) {
+                            int64_t v = values[slot];
+                            sum += uint64_t(v);
+                            lo = std::min(lo, v);
+                            hi = std::max(hi, v);
+                        }
+                        res.merge(Aggregate{ slots.size(), int64_t(sum), lo, hi });
+                        return;
+                    }
+                }
+
+                for (SlotType slot : slots) {
+                    if (!checkLive || m_store.isLive(slot)) {
+                        res.add(values[slot]);
+                    }
+                }
+            }
+        }, m_store.column(pos));
+    }
+
+    /**
+        Calls fn(key, slots) for every bucket of the Hash or Ordered index on the column, with the slots as a span
+        or a CompressedPostingList. The slots may include removed rows. Returns false if the column has no such
+        index.
+    */
+    template <typename Fn>
+    bool forEachGroup(const std::string& columnName, Fn&& fn) const {
+        auto it = m_columns.find(columnName);
+        if (it == m_columns.end() || it->second.index == -1) {
+            return false;
+        }
+
+        const auto& column = it->second;
+        if (column.indexKind == IndexKind::NGram) {
+            // Its buckets are grams, not values.
+            return false;
+        }
+        else if (column.indexKind == IndexKind::Ordered) {
+            m_orderedIndices[column.index].forEachInRange(KeyRange::all(), [&](int64_t key, const PostingList& list) {
+                fn(CellView::int64(key), std::span<const SlotType>(list));
+                return true;
+            });
+        }
+        else if (column.type == RecordValueType::String && column.encoding == ColumnEncoding::Dictionary) {
+            for (const auto& [code, list] : m_codeIndices[column.index]) {
+                fn(CellView::string(m_dictionary->at(code)), list);
+            }
+        }
+        else if (column.type == RecordValueType::String) {
+            for (const auto& [key, list] : m_strIndices[column.index]) {
+                fn(CellView::string(key), list);
+            }
+        }
+        else {
+            for (const auto& [key, list] : m_int64Indices[column.index]) {
+                fn(CellView::int64(key), list);
+            }
+        }
+        return true;
+    }
+
+    // Whether match() answers the column with a substring (contains) match rather than an exact one.
+    static bool matchesByContains(const Column& column) {
+        return column.type == RecordValueType::String && (column.index == -1 || column.indexKind == IndexKind::NGram);
+    }
+
+    /**
+        Sets the position of the column and the key its match on matchString is cached under. Numbers are
+        normalized, so "007" and "7" share an entry. Returns false if the match is not cached: on the id column,
+        which is answered in O(1) anyway, and on columns without a type or values that do not parse.
+    */
+    bool cacheKey(const std::string& columnName, const std::string& matchString, size_t& pos, std::string& key) const {
+        auto columnIt = m_columns.find(columnName);
+        if (columnIt == m_columns.end()) {
+            return false;
+        }
+
+        pos = columnPosition(columnName);
+        const auto& column = columnIt->second;
+        if (pos == 0 || column.type == RecordValueType::None) {
+            return false;
+        }
+
+        if (column.type == RecordValueType::String) {
+            key = matchString;
+            return true;
+        }
+
+        int64_t v = 0;
+        if (!core::toInt64(matchString.data(), v)) {
+            return false;
+        }
+        key = std::to_string(v);
+        return true;
+    }
+
+    /**
+        Drops the cached results the rows in the slots belong to, read from their values: for exact matches the
+        entries of their values, for substring matches every entry whose pattern one of their values contains.
+        Each column is handled in one pass over the cache for the whole batch, and its substring entries are
+        dropped wholesale once the batch has more distinct values than MaxContainsChecks. Must be called while
+        the values are in place, after inserting the rows or before removing them.
+    */
+    void invalidateCached(std::span<const SlotType> slots) {
+        if (!m_cache || m_cache->size() == 0 || slots.empty()) {
+            return;
+        }
+
+        for (size_t i = 1; i < RecordSize; i++) {
+            if (!m_cache->hasEntries(i)) {
+                continue;
+            }
+
+            const auto& column = m_columns.at(m_columnNames[i]);
+            std::vector<std::string> values;
+            values.reserve(slots.size());
+            for (SlotType slot : slots) {
+                values.push_back(cellToStr(i, slot));
+            }
+            std::sort(values.begin(), values.end());
+            values.erase(std::unique(values.begin(), values.end()), values.end());
+
+            if (!matchesByContains(column) && values.size() < m_cache->size()) {
+                for (const auto& value : values) {
+                    m_cache->erase(i, value);
+                }
+            }
+            else if (!matchesByContains(column)) {
+                m_cache->eraseIf(i, [&values](std::string_view key) {
+                    return std::binary_search(values.begin(), values.end(), key, std::less<>());
+                });
+            }
+            else if (values.size() > MaxContainsChecks) {
+                m_cache->clear(i);
+            }
+            else {
+                m_cache->eraseIf(i, [&values](std::string_view pattern) {
+                    return std::any_of(values.begin(), values.end(), [pattern](const std::string& value) {
+                        return value.find(pattern) != std::string::npos;
+                    });
+                });
+            }
+        }
+    }
+
+    /**
+        References the posting list of an index. While removed rows are not compacted away the list may hold
+        their slots, so the live ones are copied instead.
+    */
+    template <typename TList>
+    ResultSet resultFromList(const TList& list) const {
+        if (m_store.deadCount() == 0) {
+            if constexpr (std::is_same_v<TList, CompressedPostingList>) {
+                return ResultSet(this, list);
+            }
+            else {
+                return ResultSet(this, std::span<const SlotType>(list));
+            }
+        }
+
+        std::vector<SlotType> slots;
+        for (SlotType slot : list) {
+            if (m_store.isLive(slot)) {
+                slots.push_back(slot);
+            }
+        }
+        return ResultSet(this, std::move(slots));
+    }
+
+    std::vector<SlotType> liveSlots() const {
+        std::vector<SlotType> slots;
+        slots.reserve(size());
+        for (auto it = begin(); it != end(); ++it) {
+            slots.push_back(it.slot);
+        }
+        return slots;
+    }
+
+    // Returns the slots of all rows whose value in the string column contains the pattern.
+    std::vector<SlotType> matchContains(size_t pos, const NGramIndex& index, std::string_view pattern) const {
+        if (pattern.empty()) {
+            return liveSlots();
+        }
+
+        std::vector<SlotType> slots;
+        visitStringColumn(pos, [&](const auto& col) { index.matches(col, pattern, slots); });
+        if (m_store.deadCount() != 0) {
+            slots.erase(std::remove_if(slots.begin(), slots.end(), [this](SlotType slot) {
+                return !m_store.isLive(slot);
+            }), slots.end());
+        }
+        return slots;
+    }
+
+    // A predicate checked against single rows, see matchAll().
+    struct RowFilter {
+        size_t pos;
+        RecordValueType type;
+        std::string pattern;
+        int64_t value = 0;
+    };
+
+    RowFilter makeRowFilter(size_t pos, const Column& column, const std::string& matchString, bool& ok) const {
+        RowFilter f{ pos, column.type, matchString };
+        if (column.type == RecordValueType::Int32) {
+            int32_t v = 0;
+            ok = core::toInt32(matchString.data(), v);
+            f.value = v;
+        }
+        else if (column.type == RecordValueType::Int64) {
+            ok = core::toInt64(matchString.data(), f.value);
+        }
+        else {
+            ok = true;
+        }
+        return f;
+    }
+
+    // Same semantics as matchByScan: strings contain the pattern, numbers are equal.
+    bool rowMatches(const RowFilter& f, SlotType slot) const {
+        switch (f.type) {
+            case RecordValueType::String:
+                return f.pattern.empty() || scan::find(stringAt(f.pos, slot), f.pattern) != std::string_view::npos;
+            case RecordValueType::Int32:
+                return std::get<Int32Column>(m_store.column(f.pos)).get(slot) == f.value;
+            case RecordValueType::Int64:
+                return std::get<Int64Column>(m_store.column(f.pos)).get(slot) == f.value;
+            default:
+                return false;
+        }
+    }
+
+    /**
+        Calls scan(first, last, out) to collect the matching slots of [first, last) and returns them in slot order.
+        With a thread pool and enough slots, the slot range is split into chunks scanned concurrently.
+    */
+    template <typename Fn>
+    std::vector<SlotType> scanPartitioned(Fn&& scan) const {
+        SlotType count = SlotType(m_store.slotCount());
+        std::vector<SlotType> slots;
+        if (!m_threadPool || count < m_minParallelSlots || m_threadPool->threadsCount() == 1) {
+            scan(SlotType(0), count, slots);
+            return slots;
+        }
+
+        // A few chunks per thread, so threads that finish early pick up the rest.
+        size_t chunks = std::min(m_threadPool->threadsCount() * 4, std::max<size_t>(count / MinChunkSlots, 1));
+        std::vector<std::vector<SlotType>> parts(chunks);
+        m_threadPool->parallelFor(chunks, [&](size_t i) {
+            scan(SlotType(count * i / chunks), SlotType(count * (i + 1) / chunks), parts[i]);
+        });
+
+        size_t total = 0;
+        for (const auto& part : parts) {
+            total += part.size();
+        }
+        slots.reserve(total);
+        for (const auto& part : parts) {
+            slots.insert(slots.end(), part.begin(), part.end());
+        }
+        return slots;
+    }
+
+    /**
+        Calls run(scan) with a scan(first, last, out) that collects the live slots in [first, last) whose string
+        contains the non-empty pattern. Does not call run if no row can match.
+    */
+    template <typename Run>
+    void withContainsScan(size_t pos, std::string_view pattern, Run&& run) const {
+        // Free slots hold empty strings, so they never contain a non-empty pattern, but dead ones keep their
+        // values until compacted.
+        auto collect = [this](std::vector<SlotType>& out) {
+            return [this, &out](SlotType slot) {
+                if (m_store.isLive(slot)) {
+                    out.push_back(slot);
+                }
+            };
+        };
+
+        if (const auto* dict = std::get_if<DictStringColumn>(&m_store.column(pos))) {
+            std::vector<uint8_t> matching;
+            if (dict->matchingCodes(pattern, matching)) {
+                run([&](SlotType first, SlotType last, std::vector<SlotType>& out) {
+                    dict->forEachWithCode(matching, collect(out), first, last);
+                });
+            }
+            return;
+        }
+
+        const auto& col = std::get<StringColumn>(m_store.column(pos));
+        run([&](SlotType first, SlotType last, std::vector<SlotType>& out) {
+            col.forEachContaining(pattern, collect(out), first, last);
+        });
+    }
+
+    std::vector<SlotType> scanContains(size_t pos, std::string_view pattern) const {
+        if (pattern.empty()) {
+            return liveSlots();
+        }
+
+        std::vector<SlotType> slots;
+        withContainsScan(pos, pattern, [&](const auto& scan) { slots = scanPartitioned(scan); });
+        return slots;
+    }
+
+    // Returns a scan(first, last, out) that collects the live slots in [first, last) whose value equals v.
+    template <typename T>
+    auto equalsScan(size_t pos, T v) const {
+        const auto& values = std::get<NumericColumn<T>>(m_store.column(pos)).values;
+        return [this, &values, v](SlotType first, SlotType last, std::vector<SlotType>& out) {
+            for (SlotType slot = first; slot < last; slot++) {
+                if (values[slot] == v && m_store.isLive(slot)) {
+                    out.push_back(slot);
+                }
+            }
+        };
+    }
+
+    template <typename T>
+    std::vector<SlotType> scanEquals(size_t pos, T v) const {
+        return scanPartitioned(equalsScan(pos, v));
+    }
+
+    /**
+        Runs scan(first, last, out) over the slots MinChunkSlots at a time on the calling thread and calls fn(row)
+        for the matches of every chunk, until fn returns false.
+    */
+    template <typename Scan, typename Fn>
+    void scanChunked(const Scan& scan, Fn&& fn) const {
+        size_t count = m_store.slotCount();
+        std::vector<SlotType> chunk;
+        for (size_t first = 0; first < count; first += MinChunkSlots) {
+            chunk.clear();
+            scan(SlotType(first), SlotType(std::min(count, first + MinChunkSlots)), chunk);
+            for (SlotType slot : chunk) {
+                if (!fn(RowView{ this, slot })) {
+                    return;
+                }
+            }
+        }
+    }
+
+    /**
+        Calls visit(list) with the posting list the Hash or Ordered index of the column holds for the match string,
+        if it holds one. ok is false if the index is missing or the match string is not a number for an Int64
+        column.
+    */
+    template <typename Fn>
+    void visitIndexList(const Column& column, const std::string& matchString, bool& ok, Fn&& visit) const {
+        auto visitList = [&](const auto* list) {
+            if (list) {
+                visit(*list);
+            }
+        };
+
+        ok = true;
+        if (column.indexKind == IndexKind::Ordered) {
+            int64_t v;
+            ok = column.index < m_orderedIndices.size() && core::toInt64(matchString.data(), v);
+            if (ok) {
+                visitList(m_orderedIndices[column.index].find(v));
+            }
+        }
+        else if (column.type == RecordValueType::String && column.encoding == ColumnEncoding::Dictionary) {
+            ok = column.index < m_codeIndices.size();
+            auto code = m_dictionary->find(matchString);
+            if (ok && code != StringDictionary::NoCode) {
+                visitList(m_codeIndices[column.index].find(code));
+            }
+        }
+        else if (column.type == RecordValueType::String) {
+            ok = column.index < m_strIndices.size();
+            if (ok) {
+                visitList(m_strIndices[column.index].find(matchString));
+            }
+        }
+        else if (column.type == RecordValueType::Int64) {
+            int64_t v;
+            ok = column.index < m_int64Indices.size() && core::toInt64(matchString.data(), v);
+            if (ok) {
+                visitList(m_int64Indices[column.index].find(v));
+            }
+        }
+    }
+
+    // Calls fn(row) for every live slot of the posting list, until fn returns false.
+    template <typename TList, typename Fn>
+    void forEachLiveIn(const TList& list, Fn&& fn) const {
+        for (SlotType slot : list) {
+            if (m_store.isLive(slot) && !fn(RowView{ this, slot })) {
+                return;
+            }
+        }
+    }
+
+    template <typename Fn>
+    void forEachLiveRow(Fn&& fn) const {
+        for (auto it = begin(); it != end(); ++it) {
+            if (!fn(*it)) {
+                return;
+            }
+        }
+    }
+
+    // The streaming counterpart of matchContains().
+    template <typename Fn>
+    void forEachContaining(size_t pos, const NGramIndex& index, std::string_view pattern, Fn&& fn) const {
+        if (pattern.empty()) {
+            forEachLiveRow(fn);
+            return;
+        }
+        if (!NGramIndex::canAnswer(pattern)) {
+            withContainsScan(pos, pattern, [&](const auto& scan) { scanChunked(scan, fn); });
+            return;
+        }
+
+        // The candidates come from intersecting posting lists, only verifying them against the column is lazy.
+        std::vector<SlotType> candidates;
+        index.candidates(pattern, candidates);
+        visitStringColumn(pos, [&](const auto& col) {
+            for (SlotType slot : candidates) {
+                if (m_store.isLive(slot) && col.get(slot).find(pattern) != std::string_view::npos &&
+                    !fn(RowView{ this, slot })) {
+                    return;
+                }
+            }
+        });
+    }
+
+    // The streaming counterpart of matchByScan().
+    template <typename Fn>
+    void forEachByScan(size_t pos, const Column& column, const std::string& matchString, bool& ok, Fn&& fn) const {
+        switch (column.type) {
+            case RecordValueType::String:
+                ok = true;
+                if (matchString.empty()) {
+                    forEachLiveRow(fn);
+                }
+                else {
+                    withContainsScan(pos, matchString, [&](const auto& scan) { scanChunked(scan, fn); });
+                }
+                return;
+            case RecordValueType::Int32: {
+                int32_t v = 0;
+                ok = core::toInt32(matchString.data(), v);
+                if (ok) {
+                    scanChunked(equalsScan(pos, v), fn);
+                }
+                return;
+            }
+            case RecordValueType::Int64: {
+                int64_t v = 0;
+                ok = core::toInt64(matchString.data(), v);
+                if (ok) {
+                    scanChunked(equalsScan(pos, v), fn);
+                }
+                return;
+            }
+            default:
+                ok = true;
+                return;
+        }
+    }
+
+    // Answers a match on a column without an index with a full column scan.
+    ResultSet matchByScan(size_t pos, const Column& column, const std::string& matchString, bool& ok) const {
+        switch (column.type) {
+            case RecordValueType::String:
+                ok = true;
+                return ResultSet(this, scanContains(pos, matchString));
+            case RecordValueType::Int32: {
+                int32_t v = 0;
+                ok = core::toInt32(matchString.data(), v);
+                return ok ? ResultSet(this, scanEquals(pos, v)) : ResultSet(this);
+            }
+            case RecordValueType::Int64: {
+                int64_t v = 0;
+                ok = core::toInt64(matchString.data(), v);
+                return ok ? ResultSet(this, scanEquals(pos, v)) : ResultSet(this);
+            }
+            default:
+                // Nothing was inserted yet, so the column type is unknown.
+                ok = true;
+                return ResultSet(this);
+        }
+    }
+
+    // Reads the keys of the slots from the column storage, as the given kind of index takes them, and sorts them.
+    // Groups the keys of the slots by index key. The slots need not be sorted.
+    static IndexKeys sortKeys(const typename StoreType::ColumnData& data, IndexKind kind, std::span<const SlotType> slots) {
+        std::vector<SlotType> sortedSlots;
+        if (!std::is_sorted(slots.begin(), slots.end())) {
+            sortedSlots.assign(slots.begin(), slots.end());
+            std::sort(sortedSlots.begin(), sortedSlots.end());
+            slots = sortedSlots;
+        }
+
+        IndexKeys keys;
+        std::visit([&](const auto& col) {
+            using ColumnType = std::decay_t<decltype(col)>;
+            if constexpr (IsStringColumn<ColumnType>) {
+                if (kind == IndexKind::NGram) {
+                    keys.codes = SortedPostings<uint32_t>::group(slots, [&](SlotType slot, auto&& emit) {
+                        NGramIndex::forEachGram(col.get(slot), emit);
+                    });
+                    return;
+                }
+
+                if constexpr (std::is_same_v<ColumnType, DictStringColumn>) {
+                    keys.codes = groupKeys<uint32_t>(slots, [&](SlotType slot) { return col.code(slot); });
+                }
+                else {
+                    keys.strings = groupKeys<std::string_view>(slots, [&](SlotType slot) { return col.get(slot); });
+                }
+            }
+            else if constexpr (std::is_same_v<ColumnType, Int64Column>) {
+                keys.int64s = groupKeys<int64_t>(slots, [&](SlotType slot) { return col.get(slot); });
+            }
+        }, data);
+        return keys;
+    }
+
+    template <typename Key, typename Fn>
+    static SortedPostings<Key> groupKeys(std::span<const SlotType> slots, Fn&& keyOf) {
+        return SortedPostings<Key>::group(slots, [&](SlotType slot, auto&& emit) { emit(keyOf(slot)); });
+    }
+
+    void insertKeys(const Column& column, const IndexKeys& keys) {
+        if (column.indexKind == IndexKind::NGram) {
+            m_ngramIndices[column.index].insertGroups(keys.codes);
+        }
+        else if (column.indexKind == IndexKind::Ordered) {
+            m_orderedIndices[column.index].insertGroups(keys.int64s);
+        }
+        else if (column.type == RecordValueType::String && column.encoding == ColumnEncoding::Dictionary) {
+            m_codeIndices[column.index].insertGroups(keys.codes);
+        }
+        else if (column.type == RecordValueType::String) {
+            m_strIndices[column.index].insertGroups(keys.strings);
+        }
+        else if (column.type == RecordValueType::Int64) {
+            m_int64Indices[column.index].insertGroups(keys.int64s);
+        }
+    }
+
+    // Adds the slots to every index.
+    void indexSlots(std::span<const SlotType> slots) {
+        std::vector<size_t> indexed;
+        for (size_t i = 1; i < RecordSize; i++) {
+            if (m_columns.at(m_columnNames[i]).index != -1) {
+                indexed.push_back(i);
+            }
+        }
+        indexColumns(slots, indexed);
+    }
+
+    /**
+        Adds the slots to the indices of the columns at the positions. The keys of each index are sorted first, in
+        parallel on the thread pool if there is one, as that only reads the columns. The indices are then extended
+        one after the other, as they share the memory resource.
+    */
+    void indexColumns(std::span<const SlotType> slots, const std::vector<size_t>& positions) {
+        std::vector<IndexKeys> keys(positions.size());
+        auto sort = [&](size_t task) {
+            const auto& column = m_columns.at(m_columnNames[positions[task]]);
+            keys[task] = sortKeys(m_store.column(positions[task]), column.indexKind, slots);
+        };
+
+        if (m_threadPool && positions.size() > 1 && slots.size() >= MinChunkSlots) {
+            m_threadPool->parallelFor(positions.size(), sort);
+        }
+        else {
+            for (size_t task = 0; task < positions.size(); task++) {
+                sort(task);
+            }
+        }
+
+        for (size_t task = 0; task < positions.size(); task++) {
+            insertKeys(m_columns.at(m_columnNames[positions[task]]), keys[task]);
+        }
+    }
+
+    // Adds the slot to every index, reading the keys from the column storage.
+    void indexSlot(SlotType slot) {
+        for (size_t i = 1; i < RecordSize; i++) {
+            auto columnIt = m_columns.find(m_columnNames[i]);
+            if (columnIt == m_columns.end() || columnIt->second.index == -1) {
+                continue;
+            }
+
+            auto& column = columnIt->second;
+            if (column.indexKind == IndexKind::NGram) {
+                m_ngramIndices[column.index].insert(stringAt(i, slot), slot);
+            }
+            else if (column.indexKind == IndexKind::Ordered) {
+                m_orderedIndices[column.index].insert(std::get<Int64Column>(m_store.column(i)).get(slot), slot);
+            }
+            else if (column.type == RecordValueType::String && column.encoding == ColumnEncoding::Dictionary) {
+                m_codeIndices[column.index].insert(std::get<DictStringColumn>(m_store.column(i)).code(slot), slot);
+            }
+            else if (column.type == RecordValueType::String) {
+                m_strIndices[column.index].insert(stringAt(i, slot), slot);
+            }
+            else if (column.type == RecordValueType::Int64) {
+                m_int64Indices[column.index].insert(std::get<Int64Column>(m_store.column(i)).get(slot), slot);
+            }
+        }
+    }
+
+    // Appends the row to the write-ahead log, if there is one. Returns false if the log did not take it.
+    bool logInsert(const RowType& row) {
+        if (!m_log) {
+            return true;
+        }
+
+        std::vector<std::byte> payload;
+        encodeRow(row, payload);
+        return m_log->append(WriteAheadLog::EntryKind::Insert, payload);
+    }
+
+    // Writes the type and value of every cell. Strings are written as a 32-bit length and the characters.
+    static void encodeRow(const RowType& row, std::vector<std::byte>& out) {
+        auto put = [&out](const void* p, size_t n) {
+            const auto* bytes = static_cast<const std::byte*>(p);
+            out.insert(out.end(), bytes, bytes + n);
+        };
+
+        for (const CellView& cell : row) {
+            auto type = uint8_t(cell.type);
+            put(&type, 1);
+            if (cell.type == RecordValueType::Int32) {
+                auto v = int32_t(cell.number);
+                put(&v, sizeof(v));
+            }
+            else if (cell.type == RecordValueType::Int64) {
+                put(&cell.number, sizeof(cell.number));
+            }
+            else if (cell.type == RecordValueType::String) {
+                auto length = uint32_t(cell.text.size());
+                put(&length, sizeof(length));
+                put(cell.text.data(), cell.text.size());
+            }
+        }
+    }
+
+    // Reads what encodeRow() wrote. Returns false if the payload is malformed.
+    static bool decodeRecord(std::span<const std::byte> in, RecordType& record) {
+        size_t offset = 0;
+        auto get = [&](void* p, size_t n) {
+            if (in.size() - offset < n) {
+                return false;
+            }
+            std::memcpy(p, in.data() + offset, n);
+            offset += n;
+            return true;
+        };
+
+        for (auto& value : record.columns) {
+            uint8_t type = 0;
+            if (!get(&type, 1)) {
+                return false;
+            }
+
+            switch (RecordValueType(type)) {
+                case RecordValueType::Int32: {
+                    auto v = std::make_unique<Int32RecordValue>();
+                    if (!get(&v->value, sizeof(int32_t))) return false;
+                    value = std::move(v);
+                    break;
+                }
+                case RecordValueType::Int64: {
+                    auto v = std::make_unique<Int64RecordValue>();
+                    if (!get(&v->value, sizeof(int64_t))) return false;
+                    value = std::move(v);
+                    break;
+                }
+                case RecordValueType::String: {
+                    uint32_t length = 0;
+                    if (!get(&length, sizeof(length)) || in.size() - offset < length) return false;
+                    auto v = std::make_unique<StrRecordValue>();
+                    v->value.assign(reinterpret_cast<const char*>(in.data() + offset), length);
+                    offset += length;
+                    value = std::move(v);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return offset == in.size();
+    }
+
+    // How a column is stored and indexed, as written to snapshots.
+    struct SnapshotColumn {
+        uint8_t type;
+        uint8_t encoding;
+        uint8_t indexKind;
+    };
+
+    // Reads what save() wrote after the live flags into this collection, which must be fresh.
+    bool restoreSnapshot(snapshot::Reader& in, const std::array<SnapshotColumn, RecordSize>& columns,
+                         std::span<const uint8_t> live) {
+        for (size_t i = 0; i < RecordSize; i++) {
+            const auto& saved = columns[i];
+            if (saved.type >= uint8_t(RecordValueType::SENTINEL) || saved.encoding >= uint8_t(ColumnEncoding::SENTINEL) ||
+                saved.indexKind >= uint8_t(IndexKind::SENTINEL)) {
+                return false;
+            }
+
+            auto& column = m_columns.at(m_columnNames[i]);
+            auto type = RecordValueType(saved.type);
+            if (ColumnEncoding(saved.encoding) == ColumnEncoding::Dictionary) {
+                if (type != RecordValueType::String || !setEncoding(m_columnNames[i], ColumnEncoding::Dictionary)) {
+                    return false;
+                }
+            }
+            else if (type != RecordValueType::None && !setColumnType(i, column, type)) {
+                return false;
+            }
+        }
+
+        // The values of every column, each must hold one value per slot.
+        for (size_t i = 0; i < RecordSize; i++) {
+            bool ok = std::visit([&](auto& col) {
+                using ColumnType = std::decay_t<decltype(col)>;
+                if constexpr (std::is_same_v<ColumnType, StringColumn>) {
+                    return readStrings(in, col) && col.spans.size() == live.size();
+                }
+                else if constexpr (std::is_same_v<ColumnType, DictStringColumn>) {
+                    std::span<const StringDictionary::CodeType> codes;
+                    if (!in.array(codes) || codes.size() != live.size()) {
+                        return false;
+                    }
+                    col.codes.assign(codes.begin(), codes.end());
+                    return true;
+                }
+                else if constexpr (!std::is_same_v<ColumnType, std::monostate>) {
+                    std::span<const typename ColumnType::ValueType> values;
+                    if (!in.array(values) || values.size() != live.size()) {
+                        return false;
+                    }
+                    col.values.assign(values.begin(), values.end());
+                    return true;
+                }
+                else {
+                    return true;
+                }
+            }, m_store.column(i));
+
+            if (!ok) {
+                return false;
+            }
+        }
+
+        // The dictionary is interned in code order, so every string gets the code it was saved with.
+        uint8_t hasDictionary = 0;
+        if (!in.value(hasDictionary) || bool(hasDictionary) != (m_dictionary != nullptr)) {
+            return false;
+        }
+        if (m_dictionary) {
+            StringColumn values(m_memory.get());
+            if (!readStrings(in, values) || !m_dictionary->assign(std::move(values))) {
+                return false;
+            }
+
+            for (size_t i = 0; i < RecordSize; i++) {
+                const auto* dict = std::get_if<DictStringColumn>(&m_store.column(i));
+                auto isValid = [this](StringDictionary::CodeType code) { return code < m_dictionary->size(); };
+                if (dict && !std::all_of(dict->codes.begin(), dict->codes.end(), isValid)) {
+                    return false;
+                }
+            }
+        }
+
+        m_store.restoreSlots(live);
+        m_slots.reserve(live.size());
+        for (SlotType slot = 0; slot < live.size(); slot++) {
+            if (live[slot] && !m_slots.insert(idAt(slot), slot)) {
+                return false;
+            }
+        }
+
+        for (size_t i = 1; i < RecordSize; i++) {
+            auto kind = IndexKind(columns[i].indexKind);
+            if (kind == IndexKind::None) {
+                continue;
+            }
+
+            if (!addIndex(m_columnNames[i], RecordValueType(columns[i].type), kind) ||
+                !readIndex(in, m_columns.at(m_columnNames[i]), live.size())) {
+                return false;
+            }
+        }
+
+        return in.ok();
+    }
+
+    // Writes the values of the column. Removed rows are cleared in a copy of the column first.
+    bool writeColumn(snapshot::Writer& out, size_t pos) const {
+        auto write = [&out](const auto& col) {
+            using ColumnType = std::decay_t<decltype(col)>;
+            if constexpr (std::is_same_v<ColumnType, StringColumn>) {
+                return out.array(std::span<const StringColumn::Span>(col.spans)) && out.array(std::span<const char>(col.blob));
+            }
+            else if constexpr (std::is_same_v<ColumnType, DictStringColumn>) {
+                return out.array(std::span<const StringDictionary::CodeType>(col.codes));
+            }
+            else if constexpr (!std::is_same_v<ColumnType, std::monostate>) {
+                return out.array(std::span<const typename ColumnType::ValueType>(col.values));
+            }
+            else {
+                return true;
+            }
+        };
+
+        if (m_store.deadCount() == 0) {
+            return std::visit(write, m_store.column(pos));
+        }
+
+        auto data = m_store.column(pos);
+        std::visit([this](auto& col) {
+            using ColumnType = std::decay_t<decltype(col)>;
+            if constexpr (!std::is_same_v<ColumnType, std::monostate>) {
+                for (SlotType slot : m_store.slots().deadSlots()) {
+                    col.clear(slot);
+                }
+            }
+            if constexpr (std::is_same_v<ColumnType, StringColumn>) {
+                col.compact();
+            }
+        }, data);
+        return std::visit(write, data);
+    }
+
+    // Writes the posting lists of the column's index as they are built, see writeLists().
+    bool writeIndex(snapshot::Writer& out, const Column& column) const {
+        // Compressed lists are written as their chunks, a copy without the removed rows if there are any.
+        auto forEachHashList = [this](const auto& index) {
+            return [this, &index](auto&& fn) {
+                for (const auto& [key, list] : index) {
+                    if (m_store.deadCount() == 0) {
+                        fn(key, list.words());
+                        continue;
+                    }
+                    CompressedPostingList live = list;
+                    live.eraseIf([this](SlotType slot) { return !m_store.isLive(slot); });
+                    fn(key, live.words());
+                }
+            };
+        };
+
+        if (column.indexKind == IndexKind::NGram) {
+            return writeLists<uint32_t, SlotType>(out, [&](auto&& fn) {
+                for (const auto& [gram, list] : m_ngramIndices[column.index]) {
+                    fn(gram, std::span<const SlotType>(list));
+                }
+            });
+        }
+        if (column.indexKind == IndexKind::Ordered) {
+            return writeLists<int64_t, SlotType>(out, [&](auto&& fn) {
+                m_orderedIndices[column.index].forEachInRange(KeyRange::all(), [&](int64_t key, const PostingList& list) {
+                    fn(key, std::span<const SlotType>(list));
+                    return true;
+                });
+            });
+        }
+        if (column.type == RecordValueType::String && column.encoding == ColumnEncoding::Dictionary) {
+            return writeLists<StringDictionary::CodeType, uint16_t>(out, forEachHashList(m_codeIndices[column.index]));
+        }
+        if (column.type == RecordValueType::String) {
+            return writeLists<std::string_view, uint16_t>(out, forEachHashList(m_strIndices[column.index]));
+        }
+        return writeLists<int64_t, uint16_t>(out, forEachHashList(m_int64Indices[column.index]));
+    }
+
+    /**
+        Writes the keys of an index, the offset of every key's list and the lists back to back, as forEach(fn)
+        hands them over with fn(key, list). The lists are slots or compressed chunks. Removed rows are dropped
+        from slot lists, keys left without slots are left out.
+    */
+    template <typename Key, typename Word, typename ForEach>
+    bool writeLists(snapshot::Writer& out, ForEach&& forEach) const {
+        std::vector<Key> keys;
+        std::vector<uint64_t> offsets(1, 0);
+        std::vector<Word> words;
+        forEach([&](const auto& key, std::span<const Word> list) {
+            size_t start = words.size();
+            if constexpr (std::is_same_v<Word, SlotType>) {
+                if (m_store.deadCount() > 0) {
+                    std::copy_if(list.begin(), list.end(), std::back_inserter(words), [this](SlotType slot) { return m_store.isLive(slot); });
+                }
+                else {
+                    words.insert(words.end(), list.begin(), list.end());
+                }
+            }
+            else {
+                words.insert(words.end(), list.begin(), list.end());
+            }
+
+            if (words.size() > start) {
+                keys.emplace_back(key);
+                offsets.push_back(words.size());
+            }
+        });
+
+        return writeKeys(out, keys) && out.array(std::span<const uint64_t>(offsets)) && out.array(std::span<const Word>(words));
+    }
+
+    // String keys are written as a string column.
+    template <typename Key>
+    static bool writeKeys(snapshot::Writer& out, const std::vector<Key>& keys) {
+        if constexpr (std::is_same_v<Key, std::string_view>) {
+            StringColumn col;
+            col.resize(keys.size());
+            for (size_t i = 0; i < keys.size(); i++) {
+                if (!col.set(SlotType(i), keys[i])) {
+                    return false;
+                }
+            }
+            return out.array(std::span<const StringColumn::Span>(col.spans)) && out.array(std::span<const char>(col.blob));
+        }
+        else {
+            return out.array(std::span<const Key>(keys));
+        }
+    }
+
+    // Fills the column's new, empty index with the posting lists writeIndex() wrote. Every list is checked.
+    bool readIndex(snapshot::Reader& in, const Column& column, size_t slotCount) {
+        auto readHashIndex = [&](auto& index, auto key) {
+            using Key = decltype(key);
+            return readLists<Key, uint16_t>(in, index, [&](const Key& k, std::span<const uint16_t> words) {
+                auto* list = index.add(k);
+                return list && list->assign(words, slotCount);
+            });
+        };
+
+        if (column.indexKind == IndexKind::NGram) {
+            auto& index = m_ngramIndices[column.index];
+            return readLists<uint32_t, SlotType>(in, index, [&](uint32_t gram, std::span<const SlotType> slots) {
+                auto* list = index.add(gram);
+                return list && assignSlots(*list, slots, slotCount);
+            });
+        }
+        if (column.indexKind == IndexKind::Ordered) {
+            auto& index = m_orderedIndices[column.index];
+            return readLists<int64_t, SlotType>(in, index, [&](int64_t key, std::span<const SlotType> slots) {
+                auto* list = index.append(key);
+                return list && assignSlots(*list, slots, slotCount);
+            });
+        }
+        if (column.type == RecordValueType::String && column.encoding == ColumnEncoding::Dictionary) {
+            return readHashIndex(m_codeIndices[column.index], StringDictionary::CodeType());
+        }
+        if (column.type == RecordValueType::String) {
+            return readHashIndex(m_strIndices[column.index], std::string_view());
+        }
+        return readHashIndex(m_int64Indices[column.index], int64_t());
+    }
+
+    /**
+        Reads what writeLists() wrote and hands every key and its list to add(key, list), which returns false if
+        it rejects them. Fails unless the offsets split the lists into one non-empty list per key. String keys
+        and the lists point into the mapped file.
+    */
+    template <typename Key, typename Word, typename Index, typename Add>
+    static bool readLists(snapshot::Reader& in, Index& index, Add&& add) {
+        std::vector<Key> keys;
+        std::span<const uint64_t> offsets;
+        std::span<const Word> words;
+        if (!readKeys(in, keys) || !in.array(offsets) || !in.array(words) || offsets.size() != keys.size() + 1 ||
+            offsets.front() != 0 || offsets.back() != words.size()) {
+            return false;
+        }
+
+        index.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (offsets[i] >= offsets[i + 1] || !add(keys[i], words.subspan(offsets[i], offsets[i + 1] - offsets[i]))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename Key>
+    static bool readKeys(snapshot::Reader& in, std::vector<Key>& keys) {
+        if constexpr (std::is_same_v<Key, std::string_view>) {
+            std::span<const StringColumn::Span> spans;
+            std::span<const char> blob;
+            if (!in.array(spans) || !in.array(blob)) {
+                return false;
+            }
+            keys.reserve(spans.size());
+            for (const auto& span : spans) {
+                if (span.offset > blob.size() || span.length > blob.size() - span.offset) {
+                    return false;
+                }
+                keys.emplace_back(blob.data() + span.offset, span.length);
+            }
+            return true;
+        }
+        else {
+            std::span<const Key> values;
+            if (!in.array(values)) {
+                return false;
+            }
+            keys.assign(values.begin(), values.end());
+            return true;
+        }
+    }
+
+    // Reads a string column written as spans and blob, checking every span lies within the blob.
+    static bool readStrings(snapshot::Reader& in, StringColumn& col) {
+        std::span<const StringColumn::Span> spans;
+        std::span<const char> blob;
+        if (!in.array(spans) || !in.array(blob) || blob.size() > std::numeric_limits<uint32_t>::max()) {
+            return false;
+        }
+
+        for (const auto& span : spans) {
+            if (span.offset > blob.size() || span.length > blob.size() - span.offset) {
+                return false;
+            }
+        }
+
+        col.spans.assign(spans.begin(), spans.end());
+        col.blob.assign(blob.begin(), blob.end());
+        col.garbageBytes = 0;
+        return true;
+    }
+
+    // Declared first, so it outlives everything allocated from it.
+    MemoryResourcePtr m_memory;
     ColumnsType m_columns;
     ColumnNamesType m_columnNames;
-    RecordsMapType m_records;
+    StoreType m_store;
+    IdSlotTable m_slots;
     std::vector<StrIndices> m_strIndices;
     std::vector<Int64Indices> m_int64Indices;
+    std::vector<NGramIndex> m_ngramIndices;
+    std::vector<OrderedIndex> m_orderedIndices;
+    std::vector<CodeIndices> m_codeIndices;
+    std::shared_ptr<StringDictionary> m_dictionary;
+    ThreadPool* m_threadPool = nullptr;
+    std::unique_ptr<WriteAheadLog, LogDetacher> m_log;
+    std::unique_ptr<ResultCache> m_cache;
+    size_t m_minParallelSlots = DefaultMinParallelSlots;
+    double m_compactionThreshold = DefaultCompactionThreshold;
+    // Declared last, so pending builds are waited for before anything else is destroyed.
+    std::vector<PendingIndexBuild> m_indexBuilds;
 };
 
 using QBRecordCollection = qb::Collection<4>;
+using QBRecordResultSet = QBRecordCollection::ResultSet;
 
-QBRecordCollection QBFindMatchingRecords(const QBRecordCollection& records, const std::string& columnName, const std::string& matchString);
+QBRecordResultSet QBFindMatchingRecords(const QBRecordCollection& records, const std::string& columnName, const std::string& matchString);
 void DeleteRecordByID(QBRecordCollection& records, uint32_t id);
 
 } // qb
@@ -0,0 +1,532 @@
+#pragma once
+
+#include <assert.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "QBFlatHashMap.h"
+#include "QBStringScan.h"
+
+namespace qb {
+
+using SlotType = uint32_t;
+
+/**
+    A column of fixed size values stored contiguously, one value per row slot.
+*/
+template <typename T>
+struct NumericColumn {
+    using ValueType = T;
+
+    std::pmr::vector<T> values;
+
+    explicit NumericColumn(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) : values(memory) {}
+
+    void resize(size_t n) { values.resize(n); }
+    void reserve(size_t n) { values.reserve(n); }
+
+    T get(SlotType slot) const { return values[slot]; }
+
+    bool set(SlotType slot, T v) {
+        values[slot] = v;
+        return true;
+    }
+
+    void clear(SlotType slot) { values[slot] = T{}; }
+};
+
+using Int32Column = NumericColumn<int32_t>;
+using Int64Column = NumericColumn<int64_t>;
+
+/**
+    A column of strings stored back to back in a single blob. Every row slot keeps an offset and a length into
+    the blob. Cleared or overwritten strings leave garbage behind, which is reclaimed by compacting the blob
+    once the garbage outgrows the live data.
+
+    NOTE: Views returned by get() are invalidated by any call to set() or clear().
+*/
+struct StringColumn {
+    using ValueType = std::string_view;
+
+    static constexpr size_t MinCompactBytes = 4096;
+
+    struct Span {
+        uint32_t offset = 0;
+        uint32_t length = 0;
+    };
+
+    std::pmr::vector<char> blob;
+    std::pmr::vector<Span> spans;
+    size_t garbageBytes = 0;
+
+    explicit StringColumn(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) :
+        blob(memory), spans(memory) {}
+
+    void resize(size_t n) { spans.resize(n); }
+    void reserve(size_t n) { spans.reserve(n); }
+
+    std::string_view get(SlotType slot) const {
+        const Span& s = spans[slot];
+        return std::string_view(blob.data() + s.offset, s.length);
+    }
+
+    // Whether strings of this many bytes in total can still be set. Offsets are 32-bit.
+    bool fits(size_t bytes) const { return blob.size() + bytes <= std::numeric_limits<uint32_t>::max(); }
+
+    // The value must not point into this column's blob.
+    bool set(SlotType slot, std::string_view v) {
+        clear(slot);
+
+        if (!fits(v.size())) {
+            return false;
+        }
+
+        Span& s = spans[slot];
+        s.offset = uint32_t(blob.size());
+        s.length = uint32_t(v.size());
+        blob.insert(blob.end(), v.begin(), v.end());
+        return true;
+    }
+
+    void clear(SlotType slot) {
+        Span& s = spans[slot];
+        garbageBytes += s.length;
+        s = Span{};
+
+        if (garbageBytes > MinCompactBytes && garbageBytes * 2 > blob.size()) {
+            compact();
+        }
+    }
+
+    /**
+        Calls fn(slot) for every slot in [first, last) whose string contains the non-empty pattern. Runs of slots
+        whose strings are adjacent in the blob are searched as one region, so the vectorized kernel filters many
+        strings at once. Matches that cross a string boundary are rejected.
+    */
+    template <typename Fn>
+    void forEachContaining(std::string_view pattern, Fn&& fn, SlotType first = 0,
+                           SlotType last = std::numeric_limits<SlotType>::max()) const {
+        assert(!pattern.empty());
+
+        auto spanEnd = [this](SlotType slot) { return size_t(spans[slot].offset) + spans[slot].length; };
+
+        SlotType count = std::min(last, SlotType(spans.size()));
+        SlotType slot = first;
+        while (slot < count) {
+            SlotType runEnd = slot + 1;
+            while (runEnd < count && spans[runEnd].offset == spanEnd(runEnd - 1)) {
+                runEnd++;
+            }
+
+            size_t regionEnd = spanEnd(runEnd - 1);
+            size_t from = spans[slot].offset;
+            SlotType cur = slot;
+            while (regionEnd - from >= pattern.size()) {
+                size_t p = scan::find(std::string_view(blob.data() + from, regionEnd - from), pattern);
+                if (p == std::string_view::npos) {
+                    break;
+                }
+
+                p += from;
+                while (p >= spanEnd(cur)) {
+                    cur++;
+                }
+
+                if (p + pattern.size() <= spanEnd(cur)) {
+                    fn(cur);
+                    if (++cur == runEnd) {
+                        break;
+                    }
+                    from = spans[cur].offset;
+                }
+                else {
+                    from = p + 1;
+                }
+            }
+
+            slot = runEnd;
+        }
+    }
+
+    void compact() {
+        std::pmr::vector<char> compacted(blob.get_allocator());
+        compacted.reserve(blob.size() - garbageBytes);
+        for (auto& s : spans) {
+            uint32_t offset = uint32_t(compacted.size());
+            compacted.insert(compacted.end(), blob.begin() + s.offset, blob.begin() + s.offset + s.length);
+            s.offset = offset;
+        }
+        blob = std::move(compacted);
+        garbageBytes = 0;
+    }
+};
+
+/**
+    Maps distinct strings to dense 32-bit codes. The strings are kept back to back in a blob indexed by code, so
+    the whole dictionary can be scanned like a string column. Codes are never reused, so strings that are no
+    longer referenced stay in the dictionary. Code 0 is always the empty string.
+*/
+struct StringDictionary {
+    using CodeType = uint32_t;
+
+    static constexpr CodeType EmptyCode = 0;
+    static constexpr CodeType NoCode = std::numeric_limits<CodeType>::max();
+
+    explicit StringDictionary(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) :
+        m_values(memory), m_codes(memory) {
+        intern(std::string_view());
+    }
+
+    // Returns the code of s, adding it to the dictionary if needed. Returns NoCode if the dictionary is full.
+    CodeType intern(std::string_view s) {
+        auto it = m_codes.find(s);
+        if (it != m_codes.end()) {
+            return it->second;
+        }
+
+        CodeType code = CodeType(m_values.spans.size());
+        m_values.resize(size_t(code) + 1);
+        if (!m_values.set(code, s)) {
+            m_values.resize(code);
+            return NoCode;
+        }
+
+        m_codes.emplace(std::pmr::string(s, m_codes.get_allocator()), code);
+        return code;
+    }
+
+    /**
+        Replaces the strings with values, where the slot is the code, e.g. read back from a snapshot. The strings
+        are moved in rather than interned one by one. Returns false and leaves the dictionary holding the empty
+        string only if code 0 is not the empty string or a string repeats.
+    */
+    bool assign(StringColumn&& values) {
+        m_codes.clear();
+        m_codes.reserve(values.spans.size());
+        m_values = std::move(values);
+        bool ok = !m_values.spans.empty() && m_values.get(EmptyCode).empty() && m_values.spans.size() < NoCode;
+        for (size_t code = 0; ok && code < m_values.spans.size(); code++) {
+            ok = m_codes.emplace(std::pmr::string(m_values.get(CodeType(code)), m_codes.get_allocator()), CodeType(code)).second;
+        }
+
+        if (!ok) {
+            m_codes.clear();
+            m_values = StringColumn(m_values.blob.get_allocator().resource());
+            intern(std::string_view());
+        }
+        return ok;
+    }
+
+    // Returns the code of s or NoCode if s is not in the dictionary.
+    CodeType find(std::string_view s) const {
+        auto it = m_codes.find(s);
+        return it != m_codes.end() ? it->second : NoCode;
+    }
+
+    std::string_view at(CodeType code) const { return m_values.get(code); }
+
+    // Whether this many new strings of this many bytes in total can still be interned.
+    bool fits(size_t strings, size_t bytes) const { return size() + strings < NoCode && m_values.fits(bytes); }
+
+    size_t size() const { return m_values.spans.size(); }
+
+    // The strings as a column where the slot is the code.
+    const StringColumn& values() const { return m_values; }
+
+private:
+    StringColumn m_values;
+    HashMap<std::pmr::string, CodeType, StringHash, StringEqual> m_codes;
+};
+
+/**
+    A string column that stores a dictionary code per row slot instead of the string itself. Suited for columns
+    with few distinct values. The dictionary may be shared with other columns.
+*/
+struct DictStringColumn {
+    using ValueType = std::string_view;
+    using CodeType = StringDictionary::CodeType;
+
+    std::shared_ptr<StringDictionary> dictionary;
+    std::pmr::vector<CodeType> codes;
+
+    explicit DictStringColumn(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) :
+        dictionary(std::make_shared<StringDictionary>(memory)), codes(memory) {}
+
+    DictStringColumn(std::shared_ptr<StringDictionary> d, std::pmr::memory_resource* memory) :
+        dictionary(std::move(d)), codes(memory) {}
+
+    void resize(size_t n) { codes.resize(n, StringDictionary::EmptyCode); }
+    void reserve(size_t n) { codes.reserve(n); }
+
+    std::string_view get(SlotType slot) const { return dictionary->at(codes[slot]); }
+    CodeType code(SlotType slot) const { return codes[slot]; }
+
+    bool set(SlotType slot, std::string_view v) {
+        CodeType code = dictionary->intern(v);
+        if (code == StringDictionary::NoCode) {
+            return false;
+        }
+
+        codes[slot] = code;
+        return true;
+    }
+
+    void clear(SlotType slot) { codes[slot] = StringDictionary::EmptyCode; }
+
+    /**
+        Calls fn(slot) for every slot whose string contains the non-empty pattern. The pattern is searched once
+        per distinct string in the dictionary, the rows are then filtered by code.
+    */
+    template <typename Fn>
+    void forEachContaining(std::string_view pattern, Fn&& fn) const {
+        std::vector<uint8_t> matching;
+        if (matchingCodes(pattern, matching)) {
+            forEachWithCode(matching, fn);
+        }
+    }
+
+    // Sets matching[code] for every code whose string contains the non-empty pattern. Returns false if none does.
+    bool matchingCodes(std::string_view pattern, std::vector<uint8_t>& matching) const {
+        assert(!pattern.empty());
+
+        matching.assign(dictionary->size(), 0);
+        bool any = false;
+        dictionary->values().forEachContaining(pattern, [&](SlotType code) {
+            matching[code] = 1;
+            any = true;
+        });
+        return any;
+    }
+
+    // Calls fn(slot) for every slot in [first, last) whose code is set in matching.
+    template <typename Fn>
+    void forEachWithCode(const std::vector<uint8_t>& matching, Fn&& fn, SlotType first = 0,
+                         SlotType last = std::numeric_limits<SlotType>::max()) const {
+        // Free slots hold the empty string, which never contains a non-empty pattern.
+        SlotType count = std::min(last, SlotType(codes.size()));
+        for (SlotType slot = first; slot < count; slot++) {
+            if (matching[codes[slot]]) {
+                fn(slot);
+            }
+        }
+    }
+};
+
+template <typename T>
+inline constexpr bool IsStringColumn = std::is_same_v<T, StringColumn> || std::is_same_v<T, DictStringColumn>;
+
+template <typename T> struct ColumnFor;
+template <> struct ColumnFor<int32_t> { using Type = Int32Column; };
+template <> struct ColumnFor<int64_t> { using Type = Int64Column; };
+template <> struct ColumnFor<std::string_view> { using Type = StringColumn; };
+
+/**
+    Hands out row slots. Slots of removed rows are put on a free list and reused by later allocations.
+
+    A slot can also be marked dead instead of released. It is then no longer live, but it is not reused until
+    reclaimDead() is called, so references to it, e.g. from index posting lists, can be dropped lazily.
+*/
+struct SlotAllocator {
+    explicit SlotAllocator(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) :
+        m_live(memory), m_freeSlots(memory), m_deadSlots(memory) {}
+
+    size_t size() const { return m_liveCount; }
+    bool empty() const { return m_liveCount == 0; }
+
+    // Number of allocated slots, both live and free.
+    size_t slotCount() const { return m_live.size(); }
+
+    bool isLive(SlotType slot) const { return slot < m_live.size() && m_live[slot]; }
+
+    // Returns the first live slot at or after slot, or slotCount() if there is none.
+    SlotType nextLive(SlotType slot) const {
+        while (slot < m_live.size() && !m_live[slot]) {
+            slot++;
+        }
+        return slot;
+    }
+
+    void reserve(size_t n) { m_live.reserve(n); }
+
+    // Returns the new slot. grown is set when the slot count increased, so columns must be resized.
+    SlotType allocate(bool& grown) {
+        SlotType slot;
+        grown = m_freeSlots.empty();
+        if (!grown) {
+            slot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        }
+        else {
+            slot = SlotType(m_live.size());
+            m_live.push_back(false);
+        }
+
+        m_live[slot] = true;
+        m_liveCount++;
+        return slot;
+    }
+
+    void release(SlotType slot) {
+        assert(isLive(slot));
+        m_live[slot] = false;
+        m_liveCount--;
+        m_freeSlots.push_back(slot);
+    }
+
+    void markDead(SlotType slot) {
+        assert(isLive(slot));
+        m_live[slot] = false;
+        m_liveCount--;
+        m_deadSlots.push_back(slot);
+    }
+
+    // Slots marked dead since the last reclaimDead().
+    const std::pmr::vector<SlotType>& deadSlots() const { return m_deadSlots; }
+
+    // Puts all dead slots on the free list.
+    void reclaimDead() {
+        m_freeSlots.insert(m_freeSlots.end(), m_deadSlots.begin(), m_deadSlots.end());
+        m_deadSlots.clear();
+    }
+
+    // Replaces the state with live.size() slots, where slot i is live if live[i] is not 0 and free otherwise.
+    void restore(std::span<const uint8_t> live) {
+        m_live.assign(live.size(), false);
+        m_freeSlots.clear();
+        m_deadSlots.clear();
+        m_liveCount = 0;
+
+        // Free slots are handed out from the back, so the lowest ones are reused first.
+        for (size_t slot = live.size(); slot-- > 0;) {
+            if (live[slot]) {
+                m_live[slot] = true;
+                m_liveCount++;
+            }
+            else {
+                m_freeSlots.push_back(SlotType(slot));
+            }
+        }
+    }
+
+private:
+    std::pmr::vector<bool> m_live;
+    std::pmr::vector<SlotType> m_freeSlots;
+    std::pmr::vector<SlotType> m_deadSlots;
+    size_t m_liveCount = 0;
+};
+
+/**
+    Struct-of-arrays storage for a fixed number of columns. Rows are addressed by slot. Every column keeps one
+    entry per slot, so a single column can be scanned as one contiguous array. All columns allocate from the
+    memory resource given at construction.
+*/
+template <size_t ColumnCount>
+struct ColumnStore {
+    using ColumnData = std::variant<std::monostate, Int32Column, Int64Column, StringColumn, DictStringColumn>;
+
+    explicit ColumnStore(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) :
+        m_memory(memory), m_slots(memory) {}
+
+    std::pmr::memory_resource* memory() const { return m_memory; }
+
+    size_t size() const { return m_slots.size(); }
+    bool empty() const { return m_slots.empty(); }
+    size_t slotCount() const { return m_slots.slotCount(); }
+    bool isLive(SlotType slot) const { return m_slots.isLive(slot); }
+    const SlotAllocator& slots() const { return m_slots; }
+
+    void reserve(size_t n) {
+        m_slots.reserve(n);
+        forEachTypedColumn([n](auto& col) { col.reserve(n); });
+    }
+
+    ColumnData& column(size_t i) { return m_columns[i]; }
+    const ColumnData& column(size_t i) const { return m_columns[i]; }
+
+    // Sets the storage of column i. Any values already stored in the column are lost.
+    template <typename TColumn>
+    TColumn& setColumnType(size_t i) {
+        return setColumnType(i, TColumn(m_memory));
+    }
+
+    // Same as above, for a column constructed by the caller. It should allocate from memory().
+    template <typename TColumn>
+    TColumn& setColumnType(size_t i, TColumn&& col) {
+        TColumn& res = m_columns[i].template emplace<TColumn>(std::move(col));
+        res.resize(m_slots.slotCount());
+        return res;
+    }
+
+    SlotType allocate() {
+        bool grown = false;
+        SlotType slot = m_slots.allocate(grown);
+        if (grown) {
+            forEachTypedColumn([n = m_slots.slotCount()](auto& col) { col.resize(n); });
+        }
+        return slot;
+    }
+
+    void release(SlotType slot) {
+        forEachTypedColumn([slot](auto& col) { col.clear(slot); });
+        m_slots.release(slot);
+    }
+
+    // Removes the row but keeps its values until reclaimDead(), see SlotAllocator::markDead().
+    void markDead(SlotType slot) { m_slots.markDead(slot); }
+
+    size_t deadCount() const { return m_slots.deadSlots().size(); }
+
+    // Clears the values of all dead rows and makes their slots available again.
+    void reclaimDead() {
+        for (SlotType slot : m_slots.deadSlots()) {
+            forEachTypedColumn([slot](auto& col) { col.clear(slot); });
+        }
+        m_slots.reclaimDead();
+    }
+
+    /**
+        Sets the slots after the columns have been filled with live.size() values each, see
+        SlotAllocator::restore(). The values of the free slots are cleared.
+    */
+    void restoreSlots(std::span<const uint8_t> live) {
+        m_slots.restore(live);
+        forEachTypedColumn([&live](auto& col) {
+            col.resize(live.size());
+            for (size_t slot = 0; slot < live.size(); slot++) {
+                if (!live[slot]) {
+                    col.clear(SlotType(slot));
+                }
+            }
+        });
+    }
+
+private:
+    // Calls fn for every column whose type has been set.
+    template <typename Fn>
+    void forEachTypedColumn(Fn&& fn) {
+        for (auto& c : m_columns) {
+            std::visit([&fn](auto& col) {
+                if constexpr (!std::is_same_v<std::decay_t<decltype(col)>, std::monostate>) fn(col);
+            }, c);
+        }
+    }
+
+    std::pmr::memory_resource* m_memory;
+    std::array<ColumnData, ColumnCount> m_columns;
+    SlotAllocator m_slots;
+};
+
+} // namespace qb
@@ -0,0 +1,467 @@
+#pragma once
+
+#include <assert.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory_resource>
+#include <span>
+#include <vector>
+
+#include "QBColumnStore.h"
+
+namespace qb {
+
+/**
+    A sorted set of row slots stored as Roaring style chunks. Slots are grouped by their high 16 bits, every chunk
+    stores the low 16 bits of its slots either as a sorted array (2 bytes per slot) or, once it holds more than
+    MaxArraySize slots, as a 65536 bit bitmap (8KB). Lists of clustered slots therefore take at most half the
+    memory of a plain PostingList, dense lists far less.
+
+    All chunks live in one buffer of 16-bit words. Every chunk starts with a header of its high bits and its
+    cardinality minus one, followed by the payload. Walking the chunks is linear, but there are at most 65536 of
+    them and few in practice, as slots are allocated densely.
+*/
+struct CompressedPostingList {
+    using allocator_type = std::pmr::polymorphic_allocator<uint16_t>;
+
+    static constexpr uint32_t ChunkBits = 16;
+    static constexpr uint32_t HeaderSize = 2;
+    static constexpr uint32_t BitmapSize = (1u << ChunkBits) / 16;
+    // An array of this many slots takes exactly as many words as a bitmap, so chunks convert in place.
+    static constexpr uint32_t MaxArraySize = BitmapSize;
+
+    struct ConstIterator {
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = SlotType;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = SlotType;
+
+        const uint16_t* chunk = nullptr;
+        const uint16_t* end = nullptr;
+        // The position in an array payload or the bit in a bitmap payload.
+        uint32_t index = 0;
+
+        SlotType operator*() const {
+            uint32_t low = isBitmap(chunk) ? index : chunk[HeaderSize + index];
+            return (SlotType(chunk[0]) << ChunkBits) | low;
+        }
+
+        ConstIterator& operator++() {
+            if (isBitmap(chunk)) {
+                index = nextBit(chunk + HeaderSize, index + 1);
+                if (index == BitmapSize * 16) {
+                    enterChunk(chunk + chunkWords(chunk));
+                }
+            }
+            else if (++index == cardinality(chunk)) {
+                enterChunk(chunk + chunkWords(chunk));
+            }
+            return *this;
+        }
+
+        ConstIterator operator++(int) {
+            ConstIterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        bool operator==(const ConstIterator& other) const { return chunk == other.chunk && index == other.index; }
+        bool operator!=(const ConstIterator& other) const { return !(*this == other); }
+
+        void enterChunk(const uint16_t* c) {
+            chunk = c;
+            index = c != end && isBitmap(c) ? nextBit(c + HeaderSize, 0) : 0;
+        }
+    };
+
+    CompressedPostingList() = default;
+    explicit CompressedPostingList(const allocator_type& alloc) : m_data(alloc) {}
+    CompressedPostingList(const CompressedPostingList& other) = default;
+    CompressedPostingList(CompressedPostingList&& other) = default;
+    CompressedPostingList(const CompressedPostingList& other, const allocator_type& alloc) : m_data(other.m_data, alloc) {}
+    CompressedPostingList(CompressedPostingList&& other, const allocator_type& alloc) : m_data(std::move(other.m_data), alloc) {}
+    CompressedPostingList& operator=(const CompressedPostingList& other) = default;
+    CompressedPostingList& operator=(CompressedPostingList&& other) = default;
+
+    bool empty() const { return m_data.empty(); }
+
+    size_t size() const {
+        size_t n = 0;
+        for (size_t pos = 0; pos < m_data.size(); pos += chunkWords(&m_data[pos])) {
+            n += cardinality(&m_data[pos]);
+        }
+        return n;
+    }
+
+    bool contains(SlotType slot) const {
+        uint16_t high = uint16_t(slot >> ChunkBits);
+        uint16_t low = uint16_t(slot);
+
+        size_t pos = findChunk(high);
+        if (pos == m_data.size() || m_data[pos] != high) {
+            return false;
+        }
+
+        const uint16_t* c = &m_data[pos];
+        if (isBitmap(c)) {
+            return (loadWord(c + HeaderSize, low / 64) >> (low % 64)) & 1;
+        }
+
+        const uint16_t* payload = c + HeaderSize;
+        return std::binary_search(payload, payload + cardinality(c), low);
+    }
+
+    // Bytes used by the chunks.
+    size_t bytes() const { return m_data.size() * sizeof(uint16_t); }
+
+    // The chunks as stored, e.g. to write them to a snapshot.
+    std::span<const uint16_t> words() const { return m_data; }
+
+    /**
+        Replaces the list with chunks read back from words(). Returns false and leaves the list unchanged unless
+        the words are well formed chunks in increasing order that hold slots below slotCount only.
+    */
+    bool assign(std::span<const uint16_t> words, size_t slotCount) {
+        size_t pos = 0;
+        int32_t prevHigh = -1;
+        while (pos < words.size()) {
+            if (words.size() - pos < HeaderSize || int32_t(words[pos]) <= prevHigh) {
+                return false;
+            }
+
+            const uint16_t* c = &words[pos];
+            if (words.size() - pos < chunkWords(c)) {
+                return false;
+            }
+
+            uint32_t card = cardinality(c);
+            const uint16_t* payload = c + HeaderSize;
+            uint32_t lastLow = 0;
+            if (isBitmap(c)) {
+                uint32_t bits = 0;
+                for (uint32_t w = 0; w < BitmapSize / 4; w++) {
+                    uint64_t word = loadWord(payload, w);
+                    bits += uint32_t(std::popcount(word));
+                    if (word) {
+                        lastLow = w * 64 + 63 - uint32_t(std::countl_zero(word));
+                    }
+                }
+                if (bits != card) {
+                    return false;
+                }
+            }
+            else {
+                if (!std::is_sorted(payload, payload + card) || std::adjacent_find(payload, payload + card) != payload + card) {
+                    return false;
+                }
+                lastLow = payload[card - 1];
+            }
+
+            if (((size_t(c[0]) << ChunkBits) | lastLow) >= slotCount) {
+                return false;
+            }
+            prevHigh = c[0];
+            pos += chunkWords(c);
+        }
+
+        m_data.assign(words.begin(), words.end());
+        return true;
+    }
+
+    ConstIterator begin() const {
+        ConstIterator it{ nullptr, m_data.data() + m_data.size(), 0 };
+        it.enterChunk(m_data.data());
+        return it;
+    }
+
+    ConstIterator end() const { return ConstIterator{ m_data.data() + m_data.size(), m_data.data() + m_data.size(), 0 }; }
+
+    void insert(SlotType slot) {
+        uint16_t high = uint16_t(slot >> ChunkBits);
+        uint16_t low = uint16_t(slot);
+
+        size_t pos = findChunk(high);
+        if (pos == m_data.size() || m_data[pos] != high) {
+            const uint16_t chunk[] = { high, 0, low };
+            m_data.insert(m_data.begin() + pos, std::begin(chunk), std::end(chunk));
+            return;
+        }
+
+        uint16_t* c = &m_data[pos];
+        uint32_t card = cardinality(c);
+        if (isBitmap(c)) {
+            if (setBit(c + HeaderSize, low)) {
+                c[1]++;
+            }
+            return;
+        }
+
+        // Slots are mostly appended in increasing order, so check the back first.
+        uint16_t* payload = c + HeaderSize;
+        uint16_t* it = payload + card;
+        if (payload[card - 1] >= low) {
+            it = std::lower_bound(payload, payload + card, low);
+        }
+        if (it != payload + card && *it == low) {
+            return;
+        }
+
+        if (card == MaxArraySize) {
+            toBitmap(c);
+            setBit(c + HeaderSize, low);
+            c[1]++;
+            return;
+        }
+
+        m_data.insert(m_data.begin() + (it - m_data.data()), low);
+        m_data[pos + 1]++;
+    }
+
+    /**
+        Adds increasing slots. The chunks from the first one the slots reach to the end are decoded, merged with
+        the slots and written anew, so slots past the end of the list, the common case, cost O(slots) instead of
+        a chunk search and an insert each.
+    */
+    void append(std::span<const SlotType> slots) {
+        if (slots.empty()) {
+            return;
+        }
+
+        size_t pos = findChunk(uint16_t(slots.front() >> ChunkBits));
+        if (pos == m_data.size()) {
+            writeChunks(slots);
+            return;
+        }
+
+        std::vector<SlotType> tail;
+        ConstIterator it{ nullptr, m_data.data() + m_data.size(), 0 };
+        it.enterChunk(m_data.data() + pos);
+        for (; it != end(); ++it) {
+            tail.push_back(*it);
+        }
+
+        std::vector<SlotType> merged;
+        merged.reserve(tail.size() + slots.size());
+        std::set_union(tail.begin(), tail.end(), slots.begin(), slots.end(), std::back_inserter(merged));
+        m_data.resize(pos);
+        writeChunks(merged);
+    }
+
+    void erase(SlotType slot) {
+        uint16_t high = uint16_t(slot >> ChunkBits);
+        uint16_t low = uint16_t(slot);
+
+        size_t pos = findChunk(high);
+        if (pos == m_data.size() || m_data[pos] != high) {
+            return;
+        }
+
+        uint16_t* c = &m_data[pos];
+        uint32_t card = cardinality(c);
+        if (isBitmap(c)) {
+            if (clearBit(c + HeaderSize, low)) {
+                c[1]--;
+                if (card - 1 == MaxArraySize) {
+                    toArray(c);
+                }
+            }
+            return;
+        }
+
+        uint16_t* payload = c + HeaderSize;
+        uint16_t* it = std::lower_bound(payload, payload + card, low);
+        if (it == payload + card || *it != low) {
+            return;
+        }
+
+        if (card == 1) {
+            m_data.erase(m_data.begin() + pos, m_data.begin() + pos + HeaderSize + 1);
+            return;
+        }
+
+        m_data.erase(m_data.begin() + (it - m_data.data()));
+        m_data[pos + 1]--;
+    }
+
+    // Removes all slots for which pred(slot) returns true. Rewrites the list in one pass over its chunks.
+    template <typename Pred>
+    void eraseIf(Pred&& pred) {
+        std::pmr::vector<uint16_t> out(m_data.get_allocator());
+        out.reserve(m_data.size());
+
+        for (size_t pos = 0; pos < m_data.size(); pos += chunkWords(&m_data[pos])) {
+            const uint16_t* c = &m_data[pos];
+            SlotType high = SlotType(c[0]) << ChunkBits;
+            size_t start = out.size();
+            out.push_back(c[0]);
+            out.push_back(0);
+
+            uint32_t card = 0;
+            if (isBitmap(c)) {
+                uint16_t bitmap[BitmapSize];
+                std::copy_n(c + HeaderSize, BitmapSize, bitmap);
+                for (uint32_t bit = nextBit(c + HeaderSize, 0); bit < BitmapSize * 16; bit = nextBit(c + HeaderSize, bit + 1)) {
+                    if (pred(high | bit)) {
+                        clearBit(bitmap, uint16_t(bit));
+                    }
+                    else {
+                        card++;
+                    }
+                }
+
+                if (card > MaxArraySize) {
+                    out.insert(out.end(), bitmap, bitmap + BitmapSize);
+                }
+                else {
+                    for (uint32_t bit = nextBit(bitmap, 0); bit < BitmapSize * 16; bit = nextBit(bitmap, bit + 1)) {
+                        out.push_back(uint16_t(bit));
+                    }
+                }
+            }
+            else {
+                for (uint32_t i = 0; i < cardinality(c); i++) {
+                    if (!pred(high | c[HeaderSize + i])) {
+                        out.push_back(c[HeaderSize + i]);
+                        card++;
+                    }
+                }
+            }
+
+            if (card == 0) {
+                out.resize(start);
+            }
+            else {
+                out[start + 1] = uint16_t(card - 1);
+            }
+        }
+
+        m_data = std::move(out);
+    }
+
+private:
+    static uint32_t cardinality(const uint16_t* chunk) { return uint32_t(chunk[1]) + 1; }
+    static bool isBitmap(const uint16_t* chunk) { return cardinality(chunk) > MaxArraySize; }
+
+    static uint32_t chunkWords(const uint16_t* chunk) {
+        return HeaderSize + (isBitmap(chunk) ? BitmapSize : cardinality(chunk));
+    }
+
+    // Bitmap payloads are read and written 64 bits at a time. Chunks are not aligned, hence the memcpy.
+    static uint64_t loadWord(const uint16_t* bitmap, uint32_t w) {
+        uint64_t word;
+        std::memcpy(&word, bitmap + w * 4, sizeof(word));
+        return word;
+    }
+
+    static void storeWord(uint16_t* bitmap, uint32_t w, uint64_t word) { std::memcpy(bitmap + w * 4, &word, sizeof(word)); }
+
+    // Returns the first set bit at or after from, or the bitmap size in bits if there is none.
+    static uint32_t nextBit(const uint16_t* bitmap, uint32_t from) {
+        constexpr uint32_t Words = BitmapSize / 4;
+        uint32_t w = from / 64;
+        if (w >= Words) {
+            return BitmapSize * 16;
+        }
+
+        uint64_t word = loadWord(bitmap, w) & (~uint64_t(0) << (from % 64));
+        while (word == 0) {
+            if (++w == Words) {
+                return BitmapSize * 16;
+            }
+            word = loadWord(bitmap, w);
+        }
+        return w * 64 + uint32_t(std::countr_zero(word));
+    }
+
+    // Returns true if the bit was not set before.
+    static bool setBit(uint16_t* bitmap, uint16_t bit) {
+        uint64_t word = loadWord(bitmap, bit / 64);
+        uint64_t mask = uint64_t(1) << (bit % 64);
+        storeWord(bitmap, bit / 64, word | mask);
+        return (word & mask) == 0;
+    }
+
+    // Returns true if the bit was set before.
+    static bool clearBit(uint16_t* bitmap, uint16_t bit) {
+        uint64_t word = loadWord(bitmap, bit / 64);
+        uint64_t mask = uint64_t(1) << (bit % 64);
+        storeWord(bitmap, bit / 64, word & ~mask);
+        return (word & mask) != 0;
+    }
+
+    // Converts a full array chunk to a bitmap chunk. The cardinality is left to the caller.
+    static void toBitmap(uint16_t* chunk) {
+        uint16_t bitmap[BitmapSize] = {};
+        for (uint32_t i = 0; i < MaxArraySize; i++) {
+            setBit(bitmap, chunk[HeaderSize + i]);
+        }
+        std::copy_n(bitmap, BitmapSize, chunk + HeaderSize);
+    }
+
+    // Converts a bitmap chunk holding MaxArraySize slots to an array chunk.
+    static void toArray(uint16_t* chunk) {
+        uint16_t values[MaxArraySize];
+        uint32_t n = 0;
+        for (uint32_t bit = nextBit(chunk + HeaderSize, 0); bit < BitmapSize * 16; bit = nextBit(chunk + HeaderSize, bit + 1)) {
+            values[n++] = uint16_t(bit);
+        }
+        assert(n == MaxArraySize);
+        std::copy_n(values, MaxArraySize, chunk + HeaderSize);
+    }
+
+    // Appends chunks holding the increasing slots, which must all be above the slots of the list.
+    void writeChunks(std::span<const SlotType> slots) {
+        for (size_t first = 0; first < slots.size();) {
+            uint16_t high = uint16_t(slots[first] >> ChunkBits);
+            size_t last = first + 1;
+            while (last < slots.size() && uint16_t(slots[last] >> ChunkBits) == high) {
+                last++;
+            }
+
+            uint32_t card = uint32_t(last - first);
+            size_t start = m_data.size();
+            m_data.push_back(high);
+            m_data.push_back(uint16_t(card - 1));
+            if (card > MaxArraySize) {
+                m_data.resize(start + HeaderSize + BitmapSize);
+                for (size_t i = first; i < last; i++) {
+                    setBit(&m_data[start + HeaderSize], uint16_t(slots[i]));
+                }
+            }
+            else {
+                for (size_t i = first; i < last; i++) {
+                    m_data.push_back(uint16_t(slots[i]));
+                }
+            }
+            first = last;
+        }
+    }
+
+    // Returns the position of the first chunk whose high bits are not below high.
+    size_t findChunk(uint16_t high) const {
+        size_t pos = 0;
+        while (pos < m_data.size() && m_data[pos] < high) {
+            pos += chunkWords(&m_data[pos]);
+        }
+        return pos;
+    }
+
+    std::pmr::vector<uint16_t> m_data;
+};
+
+inline void insertSorted(CompressedPostingList& list, SlotType slot) { list.insert(slot); }
+inline void eraseSorted(CompressedPostingList& list, SlotType slot) { list.erase(slot); }
+
+inline void appendSorted(CompressedPostingList& list, std::span<const SlotType> slots) { list.append(slots); }
+
+template <typename Pred>
+void eraseSlotsIf(CompressedPostingList& list, Pred&& pred) {
+    list.eraseIf(pred);
+}
+
+} // namespace qb
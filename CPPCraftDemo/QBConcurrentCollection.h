@@ -0,0 +1,221 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "QBWriteAheadLog.h"
+
+namespace qb {
+
+/**
+    Counts the readers inside a read section. The count is striped over cache lines, so readers on different
+    threads mostly touch different lines.
+*/
+struct ReadIndicator {
+    static constexpr size_t StripesCount = 16;
+
+    void arrive() { stripe().fetch_add(1, std::memory_order_seq_cst); }
+    void depart() { stripe().fetch_sub(1, std::memory_order_release); }
+
+    bool empty() const {
+        for (const auto& s : m_stripes) {
+            if (s.count.load(std::memory_order_seq_cst) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    struct alignas(64) Stripe {
+        std::atomic<int64_t> count = 0;
+    };
+
+    std::atomic<int64_t>& stripe() {
+        static thread_local size_t index = std::hash<std::thread::id>{}(std::this_thread::get_id()) % StripesCount;
+        return m_stripes[index].count;
+    }
+
+    std::array<Stripe, StripesCount> m_stripes;
+};
+
+// A collection that can be lent a write-ahead log, see Collection::adoptWriteAheadLog().
+template <typename TCollection>
+concept LoggableCollection = requires(TCollection& c, WriteAheadLog* log) {
+    c.adoptWriteAheadLog(log);
+    c.releaseWriteAheadLog();
+};
+
+/**
+    Lets any number of threads read a collection while one thread at a time writes to it, using the Left-Right
+    technique. Two copies of the collection are kept. Readers always use the copy that is not being written, so
+    they never wait, never take a lock and always see the state after a complete write. A writer applies its
+    change to the idle copy, switches readers over to it, waits for the readers still on the old copy to leave
+    and then applies the same change to the old copy.
+
+    Writes therefore cost twice as much and the rows are stored twice. Writers are serialized with a mutex.
+
+    Readers take no lock of their own. A copy given a thread pool with setThreadPool() scans on the pool though,
+    and ThreadPool::parallelFor() serializes its callers, so readers then wait for each other's scans. Leave
+    the pool unset when readers must never wait.
+*/
+template <typename TCollection>
+struct ConcurrentCollection {
+    // Both copies are constructed from copies of args.
+    template <typename... Args>
+    explicit ConcurrentCollection(const Args&... args) : m_collections{ TCollection(Args(args)...), TCollection(Args(args)...) } {}
+
+    ~ConcurrentCollection() {
+        if (m_log) {
+            m_log->detach();
+        }
+    }
+
+    ConcurrentCollection(const ConcurrentCollection&) = delete;
+    ConcurrentCollection& operator=(const ConcurrentCollection&) = delete;
+
+    /**
+        Calls fn(const TCollection&) and returns its result. Anything referencing the collection, such as a
+        ResultSet, must not be used after fn returns, as the copy may then be modified. Use materialize() to keep
+        rows.
+    */
+    template <typename Fn>
+    decltype(auto) read(Fn&& fn) const {
+        size_t version = m_versionIndex.load(std::memory_order_seq_cst);
+        m_readIndicators[version].arrive();
+
+        struct Departure {
+            ReadIndicator& indicator;
+            ~Departure() { indicator.depart(); }
+        } departure{ m_readIndicators[version] };
+
+        return fn(static_cast<const TCollection&>(m_collections[m_readIndex.load(std::memory_order_seq_cst)]));
+    }
+
+    /**
+        Calls fn(TCollection&) on both copies, one after the other, and returns the result of the second call.
+        fn must change both copies the same way, so it must not depend on anything but its arguments.
+    */
+    template <typename Fn>
+    decltype(auto) write(Fn&& fn) {
+        std::lock_guard<std::mutex> lock(m_writerMutex);
+
+        size_t readIndex = m_readIndex.load(std::memory_order_relaxed);
+        TCollection& first = m_collections[1 - readIndex];
+        TCollection& second = m_collections[readIndex];
+        if constexpr (LoggableCollection<TCollection>) {
+            if (m_log) {
+                // Only the first copy logs. A change the log rejected left the first copy unchanged, so the
+                // second copy is not written and readers stay on it.
+                first.adoptWriteAheadLog(m_log);
+                if constexpr (std::is_void_v<decltype(fn(first))>) {
+                    fn(first);
+                    if (!releaseLog(first)) {
+                        return;
+                    }
+                    publish(readIndex);
+                    return fn(second);
+                }
+                else {
+                    decltype(auto) res = fn(first);
+                    if (!releaseLog(first)) {
+                        return res;
+                    }
+                    publish(readIndex);
+                    return fn(second);
+                }
+            }
+        }
+        fn(first);
+        publish(readIndex);
+        return fn(second);
+    }
+
+    /**
+        Logs the changes made through write() to the log, once rather than once per copy, see
+        Collection::setWriteAheadLog(). The log is lent to the copy written first only. Should it reject a
+        change, the second copy is not written, so fn must make at most one logged change, as insertRecord() and
+        remove() do: the first copy would otherwise keep the changes made before the rejected one. The copies
+        must not be given a log of their own. Returns false if another collection uses the log.
+    */
+    bool setWriteAheadLog(WriteAheadLog* log) requires LoggableCollection<TCollection> {
+        std::lock_guard<std::mutex> lock(m_writerMutex);
+        if (log == m_log) {
+            return true;
+        }
+        if (log && !log->attach()) {
+            return false;
+        }
+        if (m_log) {
+            m_log->detach();
+        }
+        m_log = log;
+        return true;
+    }
+
+    template <typename TRecord>
+    bool insertRecord(const TRecord& record) {
+        return write([&](TCollection& c) { return c.insertRecord(record.copy()); });
+    }
+
+    template <typename... Values>
+    bool insert(const Values&... values) {
+        return write([&](TCollection& c) { return c.insert(values...); });
+    }
+
+    template <typename TId>
+    void remove(TId id) {
+        write([&](TCollection& c) { c.remove(id); });
+    }
+
+    size_t size() const {
+        return read([](const TCollection& c) { return c.size(); });
+    }
+
+private:
+    // Switches readers over to the copy just written and waits for them to leave the other one.
+    void publish(size_t readIndex) {
+        m_readIndex.store(1 - readIndex, std::memory_order_seq_cst);
+        waitForReaders();
+    }
+
+    // Takes the log back from the copy. Returns false if the log rejected a change, see setWriteAheadLog().
+    bool releaseLog(TCollection& c) {
+        c.releaseWriteAheadLog();
+        return m_log->isOpen() && !m_log->failed();
+    }
+
+    /**
+        Waits until no reader can still be on the copy readers just left. Readers register with the indicator
+        of the current version, so toggling the version splits them into those that may have seen the old
+        read index and those that certainly see the new one.
+    */
+    void waitForReaders() {
+        size_t prev = m_versionIndex.load(std::memory_order_relaxed);
+        size_t next = 1 - prev;
+
+        while (!m_readIndicators[next].empty()) {
+            std::this_thread::yield();
+        }
+        m_versionIndex.store(next, std::memory_order_seq_cst);
+        while (!m_readIndicators[prev].empty()) {
+            std::this_thread::yield();
+        }
+    }
+
+    std::array<TCollection, 2> m_collections;
+    std::atomic<size_t> m_readIndex = 0;
+    std::atomic<size_t> m_versionIndex = 0;
+    mutable std::array<ReadIndicator, 2> m_readIndicators;
+    std::mutex m_writerMutex;
+    WriteAheadLog* m_log = nullptr;
+};
+
+} // namespace qb
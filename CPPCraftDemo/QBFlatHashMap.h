@@ -0,0 +1,502 @@
+#pragma once
+
+#include <assert.h>
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <stdexcept>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define QB_FLAT_HASH_SSE2 1
+    #include <emmintrin.h>
+#endif
+
+namespace qb {
+
+// Hashes std::string, std::pmr::string and std::string_view alike, so string keyed maps can be searched with any.
+struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+};
+
+struct StringEqual {
+    using is_transparent = void;
+    bool operator()(std::string_view a, std::string_view b) const { return a == b; }
+};
+
+namespace flat_hash {
+
+// Every slot has a control byte. Full slots store the low 7 bits of their key's hash, so they are never negative.
+using Ctrl = int8_t;
+inline constexpr Ctrl Empty = -128;
+inline constexpr Ctrl Deleted = -2;
+
+/**
+    A group of consecutive control bytes that is matched at once. Matches are returned as bit masks, the bit of
+    byte i is at position i << Shift.
+*/
+#ifdef QB_FLAT_HASH_SSE2
+
+struct Group {
+    static constexpr size_t Width = 16;
+    static constexpr uint32_t Shift = 0;
+
+    explicit Group(const Ctrl* pos) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos))) {}
+
+    uint64_t match(Ctrl h2) const { return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl))); }
+    uint64_t matchEmpty() const { return match(Empty); }
+    // Empty and Deleted are the only control bytes with the sign bit set.
+    uint64_t matchFree() const { return uint32_t(_mm_movemask_epi8(ctrl)); }
+
+    __m128i ctrl;
+};
+
+#else
+
+// Matches 8 bytes at a time in a 64-bit word. match() may report a byte right after a real match, callers compare
+// the keys anyway.
+struct Group {
+    static constexpr size_t Width = 8;
+    static constexpr uint32_t Shift = 3;
+    static constexpr uint64_t Lsbs = 0x0101010101010101ull;
+    static constexpr uint64_t Msbs = 0x8080808080808080ull;
+
+    explicit Group(const Ctrl* pos) { std::memcpy(&ctrl, pos, sizeof(ctrl)); }
+
+    uint64_t match(Ctrl h2) const {
+        uint64_t x = ctrl ^ (Lsbs * uint8_t(h2));
+        return (x - Lsbs) & ~x & Msbs;
+    }
+
+    // Empty is the only control byte with the sign bit set and bit 1 clear.
+    uint64_t matchEmpty() const { return ctrl & (~ctrl << 6) & Msbs; }
+    uint64_t matchFree() const { return ctrl & Msbs; }
+
+    uint64_t ctrl;
+};
+
+#endif
+
+} // namespace flat_hash
+
+/**
+    An open addressing hash map in the style of SwissTable. Entries live in one flat array of slots and every
+    slot has a control byte that is either empty, deleted or holds 7 bits of the hash of its key. Lookups probe
+    whole groups of control bytes at once (16 with SSE2, 8 otherwise) and only compare keys whose 7 bits match,
+    so most lookups touch one group of control bytes and one slot, without chasing pointers.
+
+    The subset of the std::unordered_map interface used by the collections is provided. Unlike there, inserting
+    or erasing invalidates all iterators and references. Lookups with other key types, e.g. std::string_view
+    for string keys, are enabled when Hash and KeyEqual define is_transparent.
+*/
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+struct FlatHashMap {
+    using key_type = Key;
+    using mapped_type = Value;
+    using value_type = std::pair<const Key, Value>;
+    using size_type = size_t;
+    using hasher = Hash;
+    using key_equal = KeyEqual;
+    using allocator_type = std::pmr::polymorphic_allocator<value_type>;
+
+    // Whether lookups take keys of type K as they are, instead of converting them to Key first.
+    template <typename K>
+    static constexpr bool IsTransparent = requires { typename Hash::is_transparent; typename KeyEqual::is_transparent; };
+
+    template <bool IsConst>
+    struct Iterator {
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = FlatHashMap::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<IsConst, const value_type*, value_type*>;
+        using reference = std::conditional_t<IsConst, const value_type&, value_type&>;
+
+        const flat_hash::Ctrl* ctrl = nullptr;
+        pointer slot = nullptr;
+        const flat_hash::Ctrl* end = nullptr;
+
+        Iterator() = default;
+        Iterator(const flat_hash::Ctrl* c, pointer s, const flat_hash::Ctrl* e) : ctrl(c), slot(s), end(e) { skipFree(); }
+
+        // Iterators convert to const iterators.
+        template <bool OtherConst, typename = std::enable_if_t<IsConst && !OtherConst>>
+        Iterator(const Iterator<OtherConst>& other) : ctrl(other.ctrl), slot(other.slot), end(other.end) {}
+
+        reference operator*() const { return *slot; }
+        pointer operator->() const { return slot; }
+
+        Iterator& operator++() {
+            ++ctrl;
+            ++slot;
+            skipFree();
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        bool operator==(const Iterator& other) const { return ctrl == other.ctrl; }
+        bool operator!=(const Iterator& other) const { return ctrl != other.ctrl; }
+
+    private:
+        void skipFree() {
+            while (ctrl != end && *ctrl < 0) {
+                ++ctrl;
+                ++slot;
+            }
+        }
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    FlatHashMap() = default;
+    explicit FlatHashMap(const allocator_type& alloc) : m_alloc(alloc) {}
+
+    FlatHashMap(const FlatHashMap& other) : FlatHashMap(other, allocator_type()) {}
+
+    FlatHashMap(const FlatHashMap& other, const allocator_type& alloc) : m_alloc(alloc) {
+        reserve(other.size());
+        for (const auto& entry : other) {
+            emplace(entry.first, entry.second);
+        }
+    }
+
+    FlatHashMap(FlatHashMap&& other) noexcept : m_alloc(other.m_alloc) { steal(other); }
+
+    FlatHashMap& operator=(const FlatHashMap& other) {
+        if (this != &other) {
+            clear();
+            reserve(other.size());
+            for (const auto& entry : other) {
+                emplace(entry.first, entry.second);
+            }
+        }
+        return *this;
+    }
+
+    // Memory resources do not propagate. Entries are moved one by one if the resources differ.
+    FlatHashMap& operator=(FlatHashMap&& other) {
+        if (this == &other) {
+            return *this;
+        }
+
+        release();
+        if (m_alloc == other.m_alloc) {
+            steal(other);
+        }
+        else {
+            reserve(other.size());
+            for (auto& entry : other) {
+                emplace(entry.first, std::move(entry.second));
+            }
+            other.clear();
+        }
+        return *this;
+    }
+
+    ~FlatHashMap() { release(); }
+
+    allocator_type get_allocator() const { return m_alloc; }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    iterator begin() { return iterator(m_ctrl, m_slots, m_ctrl + m_capacity); }
+    iterator end() { return iterator(m_ctrl + m_capacity, m_slots + m_capacity, m_ctrl + m_capacity); }
+    const_iterator begin() const { return const_iterator(m_ctrl, m_slots, m_ctrl + m_capacity); }
+    const_iterator end() const { return const_iterator(m_ctrl + m_capacity, m_slots + m_capacity, m_ctrl + m_capacity); }
+
+    // Makes room for n entries without rehashing.
+    void reserve(size_t n) {
+        size_t capacity = std::bit_ceil(std::max(MinCapacity, n + n / 7 + 1));
+        if (capacity > m_capacity) {
+            rehash(capacity);
+        }
+    }
+
+    void clear() {
+        for (size_t i = 0; i < m_capacity; i++) {
+            if (m_ctrl[i] >= 0) {
+                std::destroy_at(m_slots + i);
+            }
+        }
+        if (m_capacity) {
+            std::memset(m_ctrl, uint8_t(flat_hash::Empty), m_capacity + Group::Width);
+        }
+        m_size = 0;
+        m_growthLeft = maxLoad(m_capacity);
+    }
+
+    iterator find(const Key& key) { return findImpl(key); }
+    const_iterator find(const Key& key) const { return const_cast<FlatHashMap*>(this)->findImpl(key); }
+
+    template <typename K, typename = std::enable_if_t<IsTransparent<K>>>
+    iterator find(const K& key) { return findImpl(key); }
+
+    template <typename K, typename = std::enable_if_t<IsTransparent<K>>>
+    const_iterator find(const K& key) const { return const_cast<FlatHashMap*>(this)->findImpl(key); }
+
+    template <typename K>
+    bool contains(const K& key) const { return find(key) != end(); }
+
+    template <typename K>
+    size_t count(const K& key) const { return contains(key) ? 1 : 0; }
+
+    template <typename K>
+    Value& at(const K& key) {
+        auto it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("FlatHashMap::at");
+        }
+        return it->second;
+    }
+
+    template <typename K>
+    const Value& at(const K& key) const { return const_cast<FlatHashMap*>(this)->at(key); }
+
+    Value& operator[](const Key& key) { return try_emplace(key).first->second; }
+    Value& operator[](Key&& key) { return try_emplace(std::move(key)).first->second; }
+
+    template <typename K, typename = std::enable_if_t<IsTransparent<K>>>
+    Value& operator[](const K& key) { return try_emplace(key).first->second; }
+
+    template <typename K, typename... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+        size_t hash = hashOf(key);
+        size_t i = findIndex(key, hash);
+        if (i != NotFound) {
+            return { iteratorAt(i), false };
+        }
+
+        i = prepareInsert(hash);
+        std::allocator_traits<allocator_type>::construct(m_alloc, m_slots + i, std::piecewise_construct,
+            std::forward_as_tuple(std::forward<K>(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+        m_size++;
+        return { iteratorAt(i), true };
+    }
+
+    template <typename K, typename V>
+    std::pair<iterator, bool> emplace(K&& key, V&& value) {
+        return try_emplace(std::forward<K>(key), std::forward<V>(value));
+    }
+
+    template <typename P>
+    std::pair<iterator, bool> insert(P&& entry) {
+        return try_emplace(std::forward<P>(entry).first, std::forward<P>(entry).second);
+    }
+
+    // Returns the iterator following the erased entry.
+    iterator erase(const_iterator it) {
+        size_t i = size_t(it.ctrl - m_ctrl);
+        std::destroy_at(m_slots + i);
+        setCtrl(i, flat_hash::Deleted);
+        m_size--;
+        return iterator(m_ctrl + i + 1, m_slots + i + 1, m_ctrl + m_capacity);
+    }
+
+    iterator erase(iterator it) { return erase(const_iterator(it)); }
+
+    template <typename K>
+    size_t erase(const K& key) {
+        auto it = find(key);
+        if (it == end()) {
+            return 0;
+        }
+        erase(it);
+        return 1;
+    }
+
+private:
+    using Group = flat_hash::Group;
+
+    static constexpr size_t MinCapacity = 16;
+    static constexpr size_t NotFound = ~size_t(0);
+    static_assert(MinCapacity >= Group::Width);
+
+    // At most 7/8 of the slots are used, so every probe sequence ends at an empty slot.
+    static size_t maxLoad(size_t capacity) { return capacity - capacity / 8; }
+
+    /**
+        Mixes the hash, as std::hash of integers is often the identity. The high bits pick the first group to
+        probe, the low 7 bits are stored in the control byte.
+    */
+    template <typename K>
+    size_t hashOf(const K& key) const {
+        uint64_t h = uint64_t(m_hash(key)) * 0x9E3779B97F4A7C15ull;
+        return size_t(h ^ (h >> 32));
+    }
+
+    static flat_hash::Ctrl h2(size_t hash) { return flat_hash::Ctrl(hash & 0x7F); }
+    size_t h1(size_t hash) const { return (hash >> 7) & (m_capacity - 1); }
+
+    static size_t bitIndex(uint64_t mask) { return size_t(std::countr_zero(mask)) >> Group::Shift; }
+
+    iterator iteratorAt(size_t i) { return iterator(m_ctrl + i, m_slots + i, m_ctrl + m_capacity); }
+
+    // The control bytes of the first group are cloned past the end, so groups can be loaded at any slot.
+    void setCtrl(size_t i, flat_hash::Ctrl c) {
+        m_ctrl[i] = c;
+        if (i < Group::Width) {
+            m_ctrl[m_capacity + i] = c;
+        }
+    }
+
+    // Probes group after group, stepping 1, 2, 3... groups further, which visits every group of a power of two.
+    template <typename K>
+    size_t findIndex(const K& key, size_t hash) const {
+        if (m_capacity == 0) {
+            return NotFound;
+        }
+
+        size_t mask = m_capacity - 1;
+        size_t pos = h1(hash);
+        for (size_t step = Group::Width;; step += Group::Width) {
+            Group g(m_ctrl + pos);
+            for (uint64_t m = g.match(h2(hash)); m != 0; m &= m - 1) {
+                size_t i = (pos + bitIndex(m)) & mask;
+                if (m_equal(m_slots[i].first, key)) {
+                    return i;
+                }
+            }
+            if (g.matchEmpty() != 0) {
+                return NotFound;
+            }
+            pos = (pos + step) & mask;
+        }
+    }
+
+    template <typename K>
+    iterator findImpl(const K& key) {
+        size_t i = findIndex(key, hashOf(key));
+        return i == NotFound ? end() : iteratorAt(i);
+    }
+
+    // Returns the first empty or deleted slot of the probe sequence.
+    size_t findFree(size_t hash) const {
+        size_t mask = m_capacity - 1;
+        size_t pos = h1(hash);
+        for (size_t step = Group::Width;; step += Group::Width) {
+            uint64_t m = Group(m_ctrl + pos).matchFree();
+            if (m != 0) {
+                return (pos + bitIndex(m)) & mask;
+            }
+            pos = (pos + step) & mask;
+        }
+    }
+
+    // Claims a slot for a new entry with the hash, growing the table or dropping deleted slots if it is full.
+    size_t prepareInsert(size_t hash) {
+        size_t i = m_capacity ? findFree(hash) : 0;
+        if (m_growthLeft == 0 && (m_capacity == 0 || m_ctrl[i] != flat_hash::Deleted)) {
+            // Double only if live entries fill more than 7/16, otherwise rehashing in place frees enough slots.
+            bool grow = m_capacity == 0 || m_size + 1 > maxLoad(m_capacity) / 2;
+            rehash(grow ? std::max(MinCapacity, m_capacity * 2) : m_capacity);
+            i = findFree(hash);
+        }
+
+        if (m_ctrl[i] == flat_hash::Empty) {
+            m_growthLeft--;
+        }
+        setCtrl(i, h2(hash));
+        return i;
+    }
+
+    void rehash(size_t capacity) {
+        assert(std::has_single_bit(capacity) && maxLoad(capacity) > m_size);
+
+        flat_hash::Ctrl* oldCtrl = m_ctrl;
+        value_type* oldSlots = m_slots;
+        size_t oldCapacity = m_capacity;
+
+        m_capacity = capacity;
+        m_ctrl = CtrlAllocator(m_alloc).allocate(capacity + Group::Width);
+        m_slots = m_alloc.allocate(capacity);
+        std::memset(m_ctrl, uint8_t(flat_hash::Empty), capacity + Group::Width);
+        m_growthLeft = maxLoad(capacity) - m_size;
+
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (oldCtrl[i] < 0) {
+                continue;
+            }
+
+            size_t hash = hashOf(oldSlots[i].first);
+            size_t j = findFree(hash);
+            setCtrl(j, h2(hash));
+            std::allocator_traits<allocator_type>::construct(m_alloc, m_slots + j, std::move(oldSlots[i]));
+            std::destroy_at(oldSlots + i);
+        }
+
+        if (oldCapacity) {
+            CtrlAllocator(m_alloc).deallocate(oldCtrl, oldCapacity + Group::Width);
+            m_alloc.deallocate(oldSlots, oldCapacity);
+        }
+    }
+
+    void release() {
+        clear();
+        if (m_capacity) {
+            CtrlAllocator(m_alloc).deallocate(m_ctrl, m_capacity + Group::Width);
+            m_alloc.deallocate(m_slots, m_capacity);
+        }
+        m_ctrl = nullptr;
+        m_slots = nullptr;
+        m_capacity = 0;
+        m_growthLeft = 0;
+    }
+
+    void steal(FlatHashMap& other) {
+        m_ctrl = std::exchange(other.m_ctrl, nullptr);
+        m_slots = std::exchange(other.m_slots, nullptr);
+        m_capacity = std::exchange(other.m_capacity, 0);
+        m_size = std::exchange(other.m_size, 0);
+        m_growthLeft = std::exchange(other.m_growthLeft, 0);
+    }
+
+    using CtrlAllocator = std::pmr::polymorphic_allocator<flat_hash::Ctrl>;
+
+    flat_hash::Ctrl* m_ctrl = nullptr;
+    value_type* m_slots = nullptr;
+    size_t m_capacity = 0;
+    size_t m_size = 0;
+    // Empty slots that can still be used before the table must be rehashed.
+    size_t m_growthLeft = 0;
+    allocator_type m_alloc;
+    [[no_unique_address]] Hash m_hash;
+    [[no_unique_address]] KeyEqual m_equal;
+};
+
+/**
+    The hash map used by the collections and their indices. Define QB_STD_HASH_MAP to use std::unordered_map
+    instead, e.g. to compare the two.
+*/
+#ifdef QB_STD_HASH_MAP
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+using HashMap = std::pmr::unordered_map<Key, Value, Hash, KeyEqual>;
+#else
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+using HashMap = FlatHashMap<Key, Value, Hash, KeyEqual>;
+#endif
+
+// Transparent hashing for string keys, the standard one for anything else.
+template <typename Key>
+using HashFor = std::conditional_t<std::is_convertible_v<const Key&, std::string_view>, StringHash, std::hash<Key>>;
+
+template <typename Key>
+using EqualFor = std::conditional_t<std::is_convertible_v<const Key&, std::string_view>, StringEqual, std::equal_to<Key>>;
+
+} // namespace qb
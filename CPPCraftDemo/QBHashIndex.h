@@ -0,0 +1,93 @@
+#pragma once
+
+#include <iterator>
+#include <memory_resource>
+#include <span>
+
+#include "QBCompressedPostingList.h"
+#include "QBFlatHashMap.h"
+#include "QBPostingList.h"
+
+namespace qb {
+
+/**
+    An index from exact key values to the slots of the rows that hold them. Few distinct keys mean long posting
+    lists, so the lists are compressed.
+*/
+template <typename Key>
+struct HashIndex {
+    using KeyType = Key;
+    using ListType = CompressedPostingList;
+    using MapType = HashMap<Key, ListType, HashFor<Key>, EqualFor<Key>>;
+
+    explicit HashIndex(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) : m_map(memory) {}
+
+    // A Key is only built for a key the index does not hold yet.
+    template <typename K>
+    void insert(const K& key, SlotType slot) {
+        auto it = m_map.find(key);
+        if (it == m_map.end()) {
+            it = m_map.try_emplace(Key(key)).first;
+        }
+        insertSorted(it->second, slot);
+    }
+
+    template <typename K>
+    void erase(const K& key, SlotType slot) {
+        auto it = m_map.find(key);
+        if (it != m_map.end()) {
+            eraseSorted(it->second, slot);
+            if (it->second.empty()) {
+                m_map.erase(it);
+            }
+        }
+    }
+
+    // Adds the slots of many keys at once, see SortedPostings.
+    template <typename K>
+    void insertGroups(const SortedPostings<K>& postings) {
+        m_map.reserve(m_map.size() + postings.keysCount());
+        postings.forEachGroup([&](const K& key, std::span<const SlotType> slots) {
+            auto it = m_map.find(key);
+            if (it == m_map.end()) {
+                it = m_map.try_emplace(Key(key)).first;
+            }
+            appendSorted(it->second, slots);
+        });
+    }
+
+    // Adds an empty list for the key, e.g. to fill from a snapshot. Returns nullptr if the key has a list.
+    template <typename K>
+    ListType* add(const K& key) {
+        auto [it, added] = m_map.try_emplace(Key(key));
+        return added ? &it->second : nullptr;
+    }
+
+    void reserve(size_t n) { m_map.reserve(n); }
+
+    // Removes all slots for which pred(slot) returns true and the keys left without slots.
+    template <typename Pred>
+    void eraseSlotsIf(Pred&& pred) {
+        for (auto it = m_map.begin(); it != m_map.end();) {
+            qb::eraseSlotsIf(it->second, pred);
+            it = it->second.empty() ? m_map.erase(it) : std::next(it);
+        }
+    }
+
+    // String keys are looked up as they are, without building a Key.
+    template <typename K>
+    const ListType* find(const K& key) const {
+        auto it = m_map.find(key);
+        return it != m_map.end() ? &it->second : nullptr;
+    }
+
+    size_t keysCount() const { return m_map.size(); }
+
+    typename MapType::const_iterator begin() const { return m_map.begin(); }
+    typename MapType::const_iterator end() const { return m_map.end(); }
+
+private:
+    MapType m_map;
+};
+
+} // namespace qb
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <assert.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "QBColumnStore.h"
+
+namespace qb {
+
+/**
+    Maps record ids to row slots by direct addressing. The id space is split into pages of PageSize ids, a
+    directory indexed by the high bits of the id points to the pages and the low bits index into the page, so a
+    lookup is two array reads and never compares keys.
+
+    Pages are allocated when the first id in them is inserted and freed when their last id is erased, so dense ids
+    cost one slot per id and sparse ids cost at most one page each. The directory grows to cover the largest id
+    inserted, 8 bytes per PageSize ids.
+*/
+struct IdSlotTable {
+    using IdType = uint32_t;
+
+    static constexpr size_t PageBits = 12;
+    static constexpr size_t PageSize = size_t(1) << PageBits;
+
+    // Returned by find() for ids that are not in the table.
+    static constexpr SlotType NoSlot = std::numeric_limits<SlotType>::max();
+
+    explicit IdSlotTable(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) : m_pages(memory) {}
+
+    IdSlotTable(IdSlotTable&& other) noexcept : m_pages(std::move(other.m_pages)), m_size(std::exchange(other.m_size, 0)) {}
+
+    IdSlotTable(const IdSlotTable&) = delete;
+    IdSlotTable& operator=(const IdSlotTable&) = delete;
+
+    ~IdSlotTable() { clear(); }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    // Makes room in the directory for ids below n.
+    void reserve(size_t n) { m_pages.reserve((n + PageSize - 1) >> PageBits); }
+
+    SlotType find(IdType id) const {
+        size_t page = id >> PageBits;
+        return page < m_pages.size() && m_pages[page] ? m_pages[page]->slots[id & (PageSize - 1)] : NoSlot;
+    }
+
+    bool contains(IdType id) const { return find(id) != NoSlot; }
+
+    // Returns false without changing the table if the id is already mapped.
+    bool insert(IdType id, SlotType slot) {
+        assert(slot != NoSlot);
+        size_t page = id >> PageBits;
+        if (page >= m_pages.size()) {
+            m_pages.resize(page + 1, nullptr);
+        }
+        if (!m_pages[page]) {
+            m_pages[page] = allocatePage();
+        }
+
+        SlotType& entry = m_pages[page]->slots[id & (PageSize - 1)];
+        if (entry != NoSlot) {
+            return false;
+        }
+        entry = slot;
+        m_pages[page]->count++;
+        m_size++;
+        return true;
+    }
+
+    // Returns the slot the id was mapped to, or NoSlot if it was not mapped.
+    SlotType erase(IdType id) {
+        size_t page = id >> PageBits;
+        if (page >= m_pages.size() || !m_pages[page]) {
+            return NoSlot;
+        }
+
+        SlotType& entry = m_pages[page]->slots[id & (PageSize - 1)];
+        SlotType slot = std::exchange(entry, NoSlot);
+        if (slot == NoSlot) {
+            return NoSlot;
+        }
+
+        m_size--;
+        if (--m_pages[page]->count == 0) {
+            freePage(m_pages[page]);
+            m_pages[page] = nullptr;
+        }
+        return slot;
+    }
+
+    void clear() {
+        for (Page*& page : m_pages) {
+            if (page) {
+                freePage(page);
+                page = nullptr;
+            }
+        }
+        m_pages.clear();
+        m_size = 0;
+    }
+
+private:
+    struct Page {
+        SlotType slots[PageSize];
+        size_t count = 0;
+    };
+
+    Page* allocatePage() {
+        Page* page = ::new (m_pages.get_allocator().resource()->allocate(sizeof(Page), alignof(Page))) Page;
+        std::fill(std::begin(page->slots), std::end(page->slots), NoSlot);
+        return page;
+    }
+
+    void freePage(Page* page) { m_pages.get_allocator().resource()->deallocate(page, sizeof(Page), alignof(Page)); }
+
+    std::pmr::vector<Page*> m_pages;
+    size_t m_size = 0;
+};
+
+} // namespace qb
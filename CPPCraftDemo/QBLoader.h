@@ -0,0 +1,480 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "QBCollection.h"
+#include "QBSnapshot.h"
+
+namespace qb {
+
+struct LoadStats {
+    // Rows inserted into the collection.
+    size_t inserted = 0;
+    // Rows that could not be parsed or that the collection rejected, e.g. because of a duplicate id.
+    size_t rejected = 0;
+};
+
+struct DelimitedFormat {
+    char delimiter = ',';
+    // Skip the first line.
+    bool hasHeader = false;
+    // Rows parsed and inserted at once.
+    size_t batchRows = 1 << 16;
+};
+
+namespace load {
+
+// Parses a whole field as a cell of the type. Numbers are parsed in place, strings are referenced.
+inline bool parseCell(std::string_view field, RecordValueType type, CellView& cell) {
+    const char* end = field.data() + field.size();
+    switch (type) {
+        case RecordValueType::Int32: {
+            int32_t v = 0;
+            auto res = std::from_chars(field.data(), end, v);
+            cell = CellView::int32(v);
+            return !field.empty() && res.ec == std::errc() && res.ptr == end;
+        }
+        case RecordValueType::Int64: {
+            int64_t v = 0;
+            auto res = std::from_chars(field.data(), end, v);
+            cell = CellView::int64(v);
+            return !field.empty() && res.ec == std::errc() && res.ptr == end;
+        }
+        case RecordValueType::String:
+            cell = CellView::string(field);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+    Parsed rows. Cells reference the input where possible. Values that had to be unescaped live in strings,
+    which a deque never moves, so cells may reference them too.
+*/
+template <size_t RecordSize>
+struct Batch {
+    std::vector<std::array<CellView, RecordSize>> rows;
+    std::deque<std::string> strings;
+    size_t rejected = 0;
+};
+
+/**
+    Reads rows of delimited text, one row per line. Fields may be quoted with '"', a quote inside a quoted field
+    is written twice. Quoted fields may span lines. Empty lines are skipped.
+*/
+template <size_t RecordSize>
+struct DelimitedParser {
+    DelimitedParser(std::string_view data, const std::array<RecordValueType, RecordSize>& types, const DelimitedFormat& format) :
+        m_data(data), m_types(types), m_format(format) {
+        if (m_format.hasHeader) {
+            skipLine();
+        }
+    }
+
+    bool done() const { return m_pos >= m_data.size(); }
+
+    Batch<RecordSize> next() {
+        Batch<RecordSize> batch;
+        batch.rows.reserve(m_format.batchRows);
+        while (!done() && batch.rows.size() < m_format.batchRows) {
+            if (m_data[m_pos] == '\n' || m_data[m_pos] == '\r') {
+                m_pos++;
+                continue;
+            }
+
+            auto& row = batch.rows.emplace_back();
+            if (!parseRow(row, batch.strings)) {
+                batch.rows.pop_back();
+                batch.rejected++;
+                skipLine();
+            }
+        }
+        return batch;
+    }
+
+private:
+    bool parseRow(std::array<CellView, RecordSize>& row, std::deque<std::string>& strings) {
+        for (size_t i = 0; i < RecordSize; i++) {
+            std::string_view field;
+            if (!parseField(field, strings) || !parseCell(field, m_types[i], row[i])) {
+                return false;
+            }
+
+            bool last = i + 1 == RecordSize;
+            if (!last && (done() || m_data[m_pos] != m_format.delimiter)) {
+                return false;
+            }
+            if (!last) {
+                m_pos++;
+            }
+        }
+
+        // The row must end with the line.
+        if (!done() && m_data[m_pos] == '\r') {
+            m_pos++;
+        }
+        if (!done() && m_data[m_pos] != '\n') {
+            return false;
+        }
+        m_pos++;
+        return true;
+    }
+
+    bool parseField(std::string_view& field, std::deque<std::string>& strings) {
+        if (done() || m_data[m_pos] != '"') {
+            size_t end = m_pos;
+            while (end < m_data.size() && m_data[end] != m_format.delimiter && m_data[end] != '\n' && m_data[end] != '\r') {
+                end++;
+            }
+            field = m_data.substr(m_pos, end - m_pos);
+            m_pos = end;
+            return true;
+        }
+
+        // A quoted field is referenced unless it contains doubled quotes, which are unescaped into a string.
+        size_t begin = ++m_pos;
+        std::string* unescaped = nullptr;
+        while (true) {
+            size_t quote = m_data.find('"', m_pos);
+            if (quote == std::string_view::npos) {
+                return false;
+            }
+
+            bool doubled = quote + 1 < m_data.size() && m_data[quote + 1] == '"';
+            if (doubled && !unescaped) {
+                unescaped = &strings.emplace_back(m_data.substr(begin, quote + 1 - begin));
+            }
+            else if (unescaped) {
+                unescaped->append(m_data.substr(m_pos, quote + doubled - m_pos));
+            }
+
+            m_pos = quote + 1 + doubled;
+            if (!doubled) {
+                field = unescaped ? std::string_view(*unescaped) : m_data.substr(begin, quote - begin);
+                return true;
+            }
+        }
+    }
+
+    void skipLine() {
+        size_t end = m_data.find('\n', m_pos);
+        m_pos = end == std::string_view::npos ? m_data.size() : end + 1;
+    }
+
+    std::string_view m_data;
+    std::array<RecordValueType, RecordSize> m_types;
+    DelimitedFormat m_format;
+    size_t m_pos = 0;
+};
+
+/**
+    Reads rows of newline delimited JSON, one object per line. The members are matched to the columns by name,
+    members of other names are ignored. Strings with escapes are unescaped, others are referenced. Lines with
+    nested objects or arrays, missing columns or values of the wrong type are rejected.
+*/
+template <size_t RecordSize>
+struct NdjsonParser {
+    NdjsonParser(std::string_view data, const std::array<std::string, RecordSize>& columnNames,
+                 const std::array<RecordValueType, RecordSize>& types, size_t batchRows) :
+        m_data(data), m_columnNames(columnNames), m_types(types), m_batchRows(std::max<size_t>(batchRows, 1)) {}
+
+    bool done() const { return m_pos >= m_data.size(); }
+
+    Batch<RecordSize> next() {
+        Batch<RecordSize> batch;
+        batch.rows.reserve(m_batchRows);
+        while (!done() && batch.rows.size() < m_batchRows) {
+            size_t end = m_data.find('\n', m_pos);
+            end = end == std::string_view::npos ? m_data.size() : end;
+            std::string_view line = m_data.substr(m_pos, end - m_pos);
+            m_pos = end + 1;
+
+            if (line.find_first_not_of(" \t\r") == std::string_view::npos) {
+                continue;
+            }
+
+            auto& row = batch.rows.emplace_back();
+            if (!parseObject(line, row, batch.strings)) {
+                batch.rows.pop_back();
+                batch.rejected++;
+            }
+        }
+        return batch;
+    }
+
+private:
+    bool parseObject(std::string_view s, std::array<CellView, RecordSize>& row, std::deque<std::string>& strings) {
+        std::array<bool, RecordSize> seen{};
+        size_t pos = 0;
+        if (!expect(s, pos, '{')) {
+            return false;
+        }
+
+        skipSpace(s, pos);
+        bool empty = pos < s.size() && s[pos] == '}';
+        while (!empty) {
+            std::string_view key;
+            if (!expect(s, pos, '"') || !parseString(s, pos, key, strings) || !expect(s, pos, ':')) {
+                return false;
+            }
+
+            skipSpace(s, pos);
+            auto name = std::find(m_columnNames.begin(), m_columnNames.end(), key);
+            size_t i = size_t(name - m_columnNames.begin());
+            CellView cell;
+            if (!parseValue(s, pos, i < RecordSize ? m_types[i] : RecordValueType::None, cell, strings)) {
+                return false;
+            }
+            if (i < RecordSize) {
+                row[i] = cell;
+                seen[i] = true;
+            }
+
+            skipSpace(s, pos);
+            if (pos < s.size() && s[pos] == ',') {
+                pos++;
+                continue;
+            }
+            break;
+        }
+
+        if (!expect(s, pos, '}')) {
+            return false;
+        }
+        skipSpace(s, pos);
+        return pos == s.size() && std::all_of(seen.begin(), seen.end(), [](bool b) { return b; });
+    }
+
+    // Parses a string or number value. Values of ignored members (type None) are checked and dropped.
+    bool parseValue(std::string_view s, size_t& pos, RecordValueType type, CellView& cell, std::deque<std::string>& strings) {
+        if (pos < s.size() && s[pos] == '"') {
+            std::string_view text;
+            pos++;
+            if (!parseString(s, pos, text, strings)) {
+                return false;
+            }
+            cell = CellView::string(text);
+            return type == RecordValueType::String || type == RecordValueType::None;
+        }
+
+        size_t end = pos;
+        while (end < s.size() && s[end] != ',' && s[end] != '}' && s[end] != ' ' && s[end] != '\t' && s[end] != '\r') {
+            end++;
+        }
+        std::string_view token = s.substr(pos, end - pos);
+        pos = end;
+        if (type == RecordValueType::None) {
+            return !token.empty() && token.find_first_of("{[") == std::string_view::npos;
+        }
+        return type != RecordValueType::String && parseCell(token, type, cell);
+    }
+
+    // Parses the rest of a string after its opening quote.
+    bool parseString(std::string_view s, size_t& pos, std::string_view& out, std::deque<std::string>& strings) {
+        size_t begin = pos;
+        size_t end = s.find_first_of("\"\\", pos);
+        if (end == std::string_view::npos) {
+            return false;
+        }
+        if (s[end] == '"') {
+            out = s.substr(begin, end - begin);
+            pos = end + 1;
+            return true;
+        }
+
+        std::string& unescaped = strings.emplace_back(s.substr(begin, end - begin));
+        pos = end;
+        while (pos < s.size() && s[pos] != '"') {
+            if (s[pos] != '\\') {
+                unescaped += s[pos++];
+                continue;
+            }
+            if (++pos == s.size()) {
+                return false;
+            }
+
+            char c = s[pos++];
+            switch (c) {
+                case '"': case '\\': case '/': unescaped += c; break;
+                case 'b': unescaped += '\b'; break;
+                case 'f': unescaped += '\f'; break;
+                case 'n': unescaped += '\n'; break;
+                case 'r': unescaped += '\r'; break;
+                case 't': unescaped += '\t'; break;
+                case 'u': {
+                    uint32_t cp = 0;
+                    if (!parseHex4(s, pos, cp)) {
+                        return false;
+                    }
+                    // A high surrogate must be followed by an escaped low one.
+                    if (cp >= 0xD800 && cp < 0xDC00) {
+                        uint32_t low = 0;
+                        if (s.substr(pos, 2) != "\\u" || (pos += 2, !parseHex4(s, pos, low)) || low < 0xDC00 || low >= 0xE000) {
+                            return false;
+                        }
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    else if (cp >= 0xDC00 && cp < 0xE000) {
+                        return false;
+                    }
+                    appendUtf8(unescaped, cp);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+
+        if (pos == s.size()) {
+            return false;
+        }
+        pos++;
+        out = unescaped;
+        return true;
+    }
+
+    static bool parseHex4(std::string_view s, size_t& pos, uint32_t& cp) {
+        if (s.size() - pos < 4) {
+            return false;
+        }
+        auto res = std::from_chars(s.data() + pos, s.data() + pos + 4, cp, 16);
+        if (res.ec != std::errc() || res.ptr != s.data() + pos + 4) {
+            return false;
+        }
+        pos += 4;
+        return true;
+    }
+
+    static void appendUtf8(std::string& out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += char(cp);
+        }
+        else if (cp < 0x800) {
+            out += char(0xC0 | (cp >> 6));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000) {
+            out += char(0xE0 | (cp >> 12));
+            out += char(0x80 | ((cp >> 6) & 0x3F));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        else {
+            out += char(0xF0 | (cp >> 18));
+            out += char(0x80 | ((cp >> 12) & 0x3F));
+            out += char(0x80 | ((cp >> 6) & 0x3F));
+            out += char(0x80 | (cp & 0x3F));
+        }
+    }
+
+    static void skipSpace(std::string_view s, size_t& pos) {
+        while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\r')) {
+            pos++;
+        }
+    }
+
+    static bool expect(std::string_view s, size_t& pos, char c) {
+        skipSpace(s, pos);
+        if (pos < s.size() && s[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    std::string_view m_data;
+    const std::array<std::string, RecordSize>& m_columnNames;
+    std::array<RecordValueType, RecordSize> m_types;
+    size_t m_batchRows;
+    size_t m_pos = 0;
+};
+
+/**
+    Maps the file and feeds the parsed batches to the collection. The next batch is parsed on a background
+    thread while the current one is inserted and indexed, so parsing and index building overlap. Batches the
+    collection rejects as a whole, e.g. for one duplicate id, are inserted row by row to keep the valid rows.
+*/
+template <size_t RecordSize, typename Parser, typename MakeParser>
+bool run(Collection<RecordSize>& collection, const std::string& path, LoadStats& stats, MakeParser&& makeParser) {
+    stats = LoadStats();
+
+    std::error_code error;
+    auto size = std::filesystem::file_size(path, error);
+    if (error) {
+        return false;
+    }
+    if (size == 0) {
+        return true;
+    }
+
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+
+    Parser parser = makeParser(std::string_view(reinterpret_cast<const char*>(file.data()), file.size()));
+    auto parse = [&parser]() { return parser.next(); };
+    std::future<Batch<RecordSize>> next = std::async(std::launch::async, parse);
+    while (next.valid()) {
+        Batch<RecordSize> batch = next.get();
+        if (!parser.done()) {
+            next = std::async(std::launch::async, parse);
+        }
+
+        stats.rejected += batch.rejected;
+        if (collection.bulkInsertRows(batch.rows)) {
+            stats.inserted += batch.rows.size();
+            continue;
+        }
+        for (const auto& row : batch.rows) {
+            bool inserted = collection.insertRow(row);
+            stats.inserted += inserted;
+            stats.rejected += !inserted;
+        }
+    }
+    return true;
+}
+
+} // namespace load
+
+/**
+    Loads the rows of a delimited text file (CSV by default) into the collection, field i into column i. The
+    fields are parsed as the given column types. The file is memory mapped and parsed in place, see load::run().
+    Returns false if the file cannot be read.
+*/
+template <size_t RecordSize>
+bool loadDelimited(Collection<RecordSize>& collection, const std::string& path,
+                   const std::array<RecordValueType, RecordSize>& types, LoadStats& stats,
+                   const DelimitedFormat& format = DelimitedFormat()) {
+    DelimitedFormat f = format;
+    f.batchRows = std::max<size_t>(f.batchRows, 1);
+    return load::run<RecordSize, load::DelimitedParser<RecordSize>>(collection, path, stats, [&](std::string_view data) {
+        return load::DelimitedParser<RecordSize>(data, types, f);
+    });
+}
+
+/**
+    Loads the objects of a newline delimited JSON file into the collection, matching members to columns by
+    name. The values are parsed as the given column types, see load::NdjsonParser. Returns false if the file
+    cannot be read.
+*/
+template <size_t RecordSize>
+bool loadNdjson(Collection<RecordSize>& collection, const std::string& path,
+                const std::array<RecordValueType, RecordSize>& types, LoadStats& stats, size_t batchRows = 1 << 16) {
+    return load::run<RecordSize, load::NdjsonParser<RecordSize>>(collection, path, stats, [&](std::string_view data) {
+        return load::NdjsonParser<RecordSize>(data, collection.columnNames(), types, batchRows);
+    });
+}
+
+} // namespace qb
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+
+namespace qb {
+
+enum struct AllocatorKind {
+    // The global heap.
+    Default,
+    // A bump allocator that releases its memory only when it is destroyed. Best for bulk loads without removes.
+    Arena,
+    // Size class pools carved from large chunks. Freed blocks are reused, so it suits collections with churn.
+    Pool,
+
+    SENTINEL
+};
+
+using MemoryResourcePtr = std::shared_ptr<std::pmr::memory_resource>;
+
+/**
+    Creates one of the built-in memory resources. Neither is thread safe, a resource must be used by a single
+    collection or be externally synchronized.
+*/
+inline MemoryResourcePtr makeMemoryResource(AllocatorKind kind, size_t arenaInitialBytes = 1 << 20) {
+    switch (kind) {
+        case AllocatorKind::Arena:
+            return std::make_shared<std::pmr::monotonic_buffer_resource>(arenaInitialBytes);
+        case AllocatorKind::Pool:
+            return std::make_shared<std::pmr::unsynchronized_pool_resource>();
+        default:
+            // Not owned, the global heap outlives everything.
+            return MemoryResourcePtr(MemoryResourcePtr(), std::pmr::new_delete_resource());
+    }
+}
+
+} // namespace qb
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <assert.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <memory_resource>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "QBFlatHashMap.h"
+#include "QBPostingList.h"
+
+namespace qb {
+
+/**
+    An inverted index from every trigram (three consecutive bytes) of a string column to the slots of the rows
+    that contain it. A row contains a pattern only if it contains all of the pattern's trigrams, so intersecting
+    their posting lists gives a small candidate set, which the caller must still verify against the actual
+    values.
+*/
+struct NGramIndex {
+    static constexpr size_t GramSize = 3;
+
+    using GramType = uint32_t;
+    using GramsMapType = HashMap<GramType, PostingList>;
+
+    explicit NGramIndex(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) : m_grams(memory) {}
+
+    void insert(std::string_view value, SlotType slot) {
+        forEachGram(value, [&](GramType g) { insertSorted(m_grams[g], slot); });
+    }
+
+    void erase(std::string_view value, SlotType slot) {
+        forEachGram(value, [&](GramType g) {
+            auto it = m_grams.find(g);
+            if (it != m_grams.end()) {
+                eraseSorted(it->second, slot);
+                if (it->second.empty()) {
+                    m_grams.erase(it);
+                }
+            }
+        });
+    }
+
+    // Adds the slots of many grams at once, see SortedPostings and forEachGram().
+    void insertGroups(const SortedPostings<GramType>& postings) {
+        m_grams.reserve(m_grams.size() + postings.keysCount());
+        postings.forEachGroup([&](GramType g, std::span<const SlotType> slots) { appendSorted(m_grams[g], slots); });
+    }
+
+    // Adds an empty list for the gram, e.g. to fill from a snapshot. Returns nullptr if the gram has a list.
+    PostingList* add(GramType g) {
+        auto [it, added] = m_grams.try_emplace(g);
+        return added ? &it->second : nullptr;
+    }
+
+    void reserve(size_t n) { m_grams.reserve(n); }
+
+    // Removes all slots for which pred(slot) returns true and the grams left without slots.
+    template <typename Pred>
+    void eraseSlotsIf(Pred&& pred) {
+        for (auto it = m_grams.begin(); it != m_grams.end();) {
+            qb::eraseSlotsIf(it->second, pred);
+            it = it->second.empty() ? m_grams.erase(it) : std::next(it);
+        }
+    }
+
+    // Patterns shorter than a gram can not be answered from the index.
+    static bool canAnswer(std::string_view pattern) { return pattern.size() >= GramSize; }
+
+    /**
+        Writes the slots of all rows that may contain the pattern to out. The pattern must satisfy canAnswer().
+    */
+    void candidates(std::string_view pattern, std::vector<SlotType>& out) const {
+        assert(canAnswer(pattern));
+
+        out.clear();
+        std::vector<const PostingList*> lists;
+        bool missing = false;
+        forEachGram(pattern, [&](GramType g) {
+            auto it = m_grams.find(g);
+            if (it == m_grams.end()) {
+                missing = true;
+            }
+            else {
+                lists.push_back(&it->second);
+            }
+        });
+
+        if (!missing) {
+            intersectSorted(std::move(lists), out);
+        }
+    }
+
+    /**
+        Writes the slots of all rows whose value in col contains the non-empty pattern to out. The candidates
+        from the index are verified against col. Patterns too short for the index are answered by scanning col.
+    */
+    template <typename TColumn>
+    void matches(const TColumn& col, std::string_view pattern, std::vector<SlotType>& out) const {
+        assert(!pattern.empty());
+
+        out.clear();
+        if (!canAnswer(pattern)) {
+            col.forEachContaining(pattern, [&](SlotType slot) { out.push_back(slot); });
+            return;
+        }
+
+        candidates(pattern, out);
+        out.erase(std::remove_if(out.begin(), out.end(), [&](SlotType slot) {
+            return col.get(slot).find(pattern) == std::string_view::npos;
+        }), out.end());
+    }
+
+    size_t gramsCount() const { return m_grams.size(); }
+
+    GramsMapType::const_iterator begin() const { return m_grams.begin(); }
+    GramsMapType::const_iterator end() const { return m_grams.end(); }
+
+    // Calls fn once for every distinct gram of s.
+    template <typename Fn>
+    static void forEachGram(std::string_view s, Fn&& fn) {
+        if (s.size() < GramSize) {
+            return;
+        }
+
+        std::vector<GramType> grams;
+        grams.reserve(s.size() - GramSize + 1);
+        for (size_t i = 0; i + GramSize <= s.size(); i++) {
+            grams.push_back(GramType(uint8_t(s[i])) << 16 | GramType(uint8_t(s[i + 1])) << 8 | GramType(uint8_t(s[i + 2])));
+        }
+
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+        for (GramType g : grams) {
+            fn(g);
+        }
+    }
+
+private:
+    GramsMapType m_grams;
+};
+
+} // namespace qb
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <span>
+#include <vector>
+
+#include "QBPostingList.h"
+
+namespace qb {
+
+/**
+    An inclusive range of int64 keys. A range with low > high is empty.
+*/
+struct KeyRange {
+    int64_t low = std::numeric_limits<int64_t>::min();
+    int64_t high = std::numeric_limits<int64_t>::max();
+
+    bool empty() const { return low > high; }
+
+    static KeyRange all() { return KeyRange{}; }
+    static KeyRange equal(int64_t v) { return KeyRange{ v, v }; }
+    static KeyRange between(int64_t lo, int64_t hi) { return KeyRange{ lo, hi }; }
+    static KeyRange atMost(int64_t v) { return KeyRange{ std::numeric_limits<int64_t>::min(), v }; }
+    static KeyRange atLeast(int64_t v) { return KeyRange{ v, std::numeric_limits<int64_t>::max() }; }
+
+    static KeyRange lessThan(int64_t v) {
+        if (v == std::numeric_limits<int64_t>::min()) return KeyRange{ 1, 0 };
+        return KeyRange{ std::numeric_limits<int64_t>::min(), v - 1 };
+    }
+
+    static KeyRange greaterThan(int64_t v) {
+        if (v == std::numeric_limits<int64_t>::max()) return KeyRange{ 1, 0 };
+        return KeyRange{ v + 1, std::numeric_limits<int64_t>::max() };
+    }
+};
+
+/**
+    An index over an int64 column that keeps its keys in order, so it can answer range queries and iterate the
+    rows in key order.
+
+    Distinct keys live in sorted arrays with one posting list per key, which keeps binary searches and range
+    scans on contiguous memory. New keys are first added to a small pending run and merged into the main run
+    once the pending run grows past sqrt(main run), so inserting many distinct keys does not shift the whole
+    main run every time. Keys whose posting lists become empty are dropped on the next merge.
+*/
+struct OrderedIndex {
+    static constexpr size_t MinPendingSize = 256;
+
+    explicit OrderedIndex(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) :
+        m_main(memory), m_pending(memory) {}
+
+    void insert(int64_t key, SlotType slot) {
+        if (PostingList* list = m_main.find(key)) {
+            insertSorted(*list, slot);
+            return;
+        }
+
+        m_pending.insert(key, slot);
+        if (m_pending.keys.size() > std::max(MinPendingSize, size_t(std::sqrt(double(m_main.keys.size()))))) {
+            merge();
+        }
+    }
+
+    void erase(int64_t key, SlotType slot) {
+        PostingList* list = m_main.find(key);
+        if (!list) {
+            list = m_pending.find(key);
+        }
+
+        if (list) {
+            eraseSorted(*list, slot);
+        }
+    }
+
+    /**
+        Adds the slots of many keys at once, see SortedPostings. Keys not in the index yet are merged into the
+        main run in a single pass, instead of going through the pending run one by one.
+    */
+    void insertGroups(const SortedPostings<int64_t>& postings) {
+        Run added(m_main.keys.get_allocator().resource());
+        postings.forEachGroup([&](int64_t key, std::span<const SlotType> slots) {
+            PostingList* list = m_main.find(key);
+            if (!list) {
+                list = m_pending.find(key);
+            }
+            if (!list) {
+                added.keys.push_back(key);
+                list = &added.postings.emplace_back();
+            }
+            appendSorted(*list, slots);
+        });
+
+        merge();
+        m_main = mergeRuns(m_main, added);
+    }
+
+    void reserve(size_t n) {
+        m_main.keys.reserve(n);
+        m_main.postings.reserve(n);
+    }
+
+    /**
+        Adds an empty list for a key above every key of the index, e.g. to fill from a snapshot in key order.
+        Returns nullptr if the key is not above them.
+    */
+    PostingList* append(int64_t key) {
+        if (!m_pending.keys.empty()) {
+            merge();
+        }
+        if (!m_main.keys.empty() && m_main.keys.back() >= key) {
+            return nullptr;
+        }
+        m_main.keys.push_back(key);
+        return &m_main.postings.emplace_back();
+    }
+
+    // Removes all slots for which pred(slot) returns true. Keys left without slots are dropped right away.
+    template <typename Pred>
+    void eraseSlotsIf(Pred&& pred) {
+        for (Run* run : { &m_main, &m_pending }) {
+            for (auto& list : run->postings) {
+                qb::eraseSlotsIf(list, pred);
+            }
+        }
+        merge();
+    }
+
+    const PostingList* find(int64_t key) const {
+        const PostingList* list = m_main.find(key);
+        return list ? list : m_pending.find(key);
+    }
+
+    /**
+        Calls fn(key, postingList) for every key in the range that has rows, in increasing key order.
+        Stops early if fn returns false.
+    */
+    template <typename Fn>
+    void forEachInRange(const KeyRange& range, Fn&& fn) const {
+        if (range.empty()) {
+            return;
+        }
+
+        size_t i = m_main.lowerBound(range.low);
+        size_t j = m_pending.lowerBound(range.low);
+        while (true) {
+            bool hasMain = i < m_main.keys.size() && m_main.keys[i] <= range.high;
+            bool hasPending = j < m_pending.keys.size() && m_pending.keys[j] <= range.high;
+            if (!hasMain && !hasPending) {
+                break;
+            }
+
+            const Run* run;
+            size_t* idx;
+            if (hasMain && (!hasPending || m_main.keys[i] < m_pending.keys[j])) {
+                run = &m_main;
+                idx = &i;
+            }
+            else {
+                run = &m_pending;
+                idx = &j;
+            }
+
+            const PostingList& list = run->postings[*idx];
+            int64_t key = run->keys[*idx];
+            (*idx)++;
+
+            if (!list.empty() && !fn(key, list)) {
+                break;
+            }
+        }
+    }
+
+private:
+    struct Run {
+        std::pmr::vector<int64_t> keys;
+        std::pmr::vector<PostingList> postings;
+
+        explicit Run(std::pmr::memory_resource* memory) : keys(memory), postings(memory) {}
+
+        size_t lowerBound(int64_t key) const {
+            return size_t(std::lower_bound(keys.begin(), keys.end(), key) - keys.begin());
+        }
+
+        PostingList* find(int64_t key) {
+            size_t i = lowerBound(key);
+            return i < keys.size() && keys[i] == key ? &postings[i] : nullptr;
+        }
+
+        const PostingList* find(int64_t key) const {
+            size_t i = lowerBound(key);
+            return i < keys.size() && keys[i] == key ? &postings[i] : nullptr;
+        }
+
+        void insert(int64_t key, SlotType slot) {
+            size_t i = lowerBound(key);
+            if (i == keys.size() || keys[i] != key) {
+                keys.insert(keys.begin() + i, key);
+                postings.insert(postings.begin() + i, PostingList());
+            }
+            insertSorted(postings[i], slot);
+        }
+    };
+
+    // Merges the pending run into the main run and drops keys without rows.
+    void merge() {
+        m_main = mergeRuns(m_main, m_pending);
+        m_pending = Run(m_main.keys.get_allocator().resource());
+    }
+
+    // Merges two runs with disjoint keys, moving their posting lists, and drops keys without rows.
+    static Run mergeRuns(Run& a, Run& b) {
+        Run merged(a.keys.get_allocator().resource());
+        merged.keys.reserve(a.keys.size() + b.keys.size());
+        merged.postings.reserve(a.keys.size() + b.keys.size());
+
+        size_t i = 0, j = 0;
+        while (i < a.keys.size() || j < b.keys.size()) {
+            Run* run;
+            size_t* idx;
+            if (j == b.keys.size() || (i < a.keys.size() && a.keys[i] < b.keys[j])) {
+                run = &a;
+                idx = &i;
+            }
+            else {
+                run = &b;
+                idx = &j;
+            }
+
+            if (!run->postings[*idx].empty()) {
+                merged.keys.push_back(run->keys[*idx]);
+                merged.postings.push_back(std::move(run->postings[*idx]));
+            }
+            (*idx)++;
+        }
+        return merged;
+    }
+
+    Run m_main;
+    Run m_pending;
+};
+
+} // namespace qb
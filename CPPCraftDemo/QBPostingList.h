@@ -0,0 +1,241 @@
+#pragma once
+
+#include <assert.h>
+
+#include <algorithm>
+#include <iterator>
+#include <memory_resource>
+#include <numeric>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "QBColumnStore.h"
+#include "QBCompressedPostingList.h"
+#include "QBFlatHashMap.h"
+
+namespace qb {
+
+/**
+    A sorted list of the row slots that share an index key. Lists held by an index allocate from the index's
+    memory resource.
+*/
+using PostingList = std::pmr::vector<SlotType>;
+
+inline void insertSorted(PostingList& list, SlotType slot) {
+    // Slots are mostly appended in increasing order, so check the back first.
+    if (list.empty() || list.back() < slot) {
+        list.push_back(slot);
+    }
+    else {
+        auto it = std::lower_bound(list.begin(), list.end(), slot);
+        if (it == list.end() || *it != slot) {
+            list.insert(it, slot);
+        }
+    }
+}
+
+inline void eraseSorted(PostingList& list, SlotType slot) {
+    auto it = std::lower_bound(list.begin(), list.end(), slot);
+    if (it != list.end() && *it == slot) {
+        list.erase(it);
+    }
+}
+
+// Adds sorted slots to the list. Slots past the end of the list, the common case, are appended in one go.
+inline void appendSorted(PostingList& list, std::span<const SlotType> slots) {
+    if (slots.empty()) {
+        return;
+    }
+
+    if (list.empty() || list.back() < slots.front()) {
+        list.insert(list.end(), slots.begin(), slots.end());
+        return;
+    }
+
+    for (SlotType slot : slots) {
+        insertSorted(list, slot);
+    }
+}
+
+/**
+    Replaces the list with slots read back from a snapshot. Returns false and leaves the list unchanged unless
+    the slots are increasing and below slotCount.
+*/
+inline bool assignSlots(PostingList& list, std::span<const SlotType> slots, size_t slotCount) {
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i] >= slotCount || (i > 0 && slots[i - 1] >= slots[i])) {
+            return false;
+        }
+    }
+    list.assign(slots.begin(), slots.end());
+    return true;
+}
+
+// Removes all slots for which pred(slot) returns true in one pass.
+template <typename Pred>
+void eraseSlotsIf(PostingList& list, Pred&& pred) {
+    list.erase(std::remove_if(list.begin(), list.end(), pred), list.end());
+}
+
+/**
+    Removes the slots of the sorted candidates that are not in the sorted list. When the list is much longer than
+    the candidates, every candidate is looked up with a galloping (exponential) search that resumes where the
+    previous one ended, which costs O(candidates * log(list / candidates)) instead of O(candidates + list).
+*/
+inline void intersectWith(std::vector<SlotType>& candidates, std::span<const SlotType> list) {
+    static constexpr size_t GallopRatio = 8;
+
+    size_t n = 0;
+    if (list.size() < candidates.size() * GallopRatio) {
+        size_t j = 0;
+        for (size_t i = 0; i < candidates.size() && j < list.size(); i++) {
+            while (j < list.size() && list[j] < candidates[i]) {
+                j++;
+            }
+            if (j < list.size() && list[j] == candidates[i]) {
+                candidates[n++] = candidates[i];
+            }
+        }
+    }
+    else {
+        size_t lo = 0;
+        for (size_t i = 0; i < candidates.size() && lo < list.size(); i++) {
+            SlotType slot = candidates[i];
+            size_t bound = 1;
+            while (lo + bound < list.size() && list[lo + bound] < slot) {
+                bound *= 2;
+            }
+
+            auto first = list.begin() + (lo + bound / 2);
+            auto last = list.begin() + std::min(lo + bound + 1, list.size());
+            lo = size_t(std::lower_bound(first, last, slot) - list.begin());
+            if (lo < list.size() && list[lo] == slot) {
+                candidates[n++] = slot;
+            }
+        }
+    }
+    candidates.resize(n);
+}
+
+// Same as above for a compressed list, which answers membership directly.
+inline void intersectWith(std::vector<SlotType>& candidates, const CompressedPostingList& list) {
+    auto it = std::remove_if(candidates.begin(), candidates.end(), [&](SlotType slot) { return !list.contains(slot); });
+    candidates.erase(it, candidates.end());
+}
+
+/**
+    Intersects sorted posting lists into out. The lists are processed from the shortest to the longest, so the
+    intermediate result never grows beyond the shortest list.
+*/
+inline void intersectSorted(std::vector<const PostingList*> lists, std::vector<SlotType>& out) {
+    out.clear();
+    if (lists.empty()) {
+        return;
+    }
+
+    std::sort(lists.begin(), lists.end(), [](const PostingList* a, const PostingList* b) {
+        return a->size() < b->size();
+    });
+
+    out.assign(lists[0]->begin(), lists[0]->end());
+    for (size_t i = 1; i < lists.size() && !out.empty(); i++) {
+        intersectWith(out, std::span<const SlotType>(*lists[i]));
+    }
+}
+
+/**
+    The (key, slot) pairs of many rows, sorted and grouped by key, so an index can take every key's slots at once
+    instead of one row at a time. Keys are sorted and distinct, and the slots of every key are sorted.
+*/
+template <typename Key>
+struct SortedPostings {
+    std::vector<Key> keys;
+    // The slots of keys[i] are slots[offsets[i], offsets[i + 1]).
+    std::vector<size_t> offsets;
+    std::vector<SlotType> slots;
+
+    SortedPostings() = default;
+
+    /**
+        Groups the slots by key. keysOf(slot, emit) calls emit(key) once for every distinct key of the slot. The
+        slots must be increasing. Keys get a group number from a hash map as they are met and only the distinct
+        keys are sorted, the slots are then counted into their groups in order. This is linear in the pairs,
+        where sorting all (key, slot) pairs is not.
+    */
+    template <typename Fn>
+    static SortedPostings group(std::span<const SlotType> slots, Fn&& keysOf) {
+        assert(std::is_sorted(slots.begin(), slots.end()));
+
+        HashMap<Key, uint32_t, HashFor<Key>, EqualFor<Key>> groups;
+        std::vector<Key> distinct;
+        std::vector<size_t> counts;
+        std::vector<uint32_t> pairGroups;
+        std::vector<SlotType> pairSlots;
+        pairGroups.reserve(slots.size());
+        pairSlots.reserve(slots.size());
+        for (SlotType slot : slots) {
+            keysOf(slot, [&](const Key& key) {
+                auto [it, added] = groups.try_emplace(key, uint32_t(distinct.size()));
+                if (added) {
+                    distinct.push_back(key);
+                    counts.push_back(0);
+                }
+                counts[it->second]++;
+                pairGroups.push_back(it->second);
+                pairSlots.push_back(slot);
+            });
+        }
+
+        std::vector<uint32_t> order(distinct.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return distinct[a] < distinct[b]; });
+
+        // counts becomes the next free position of every group.
+        SortedPostings res;
+        res.keys.reserve(distinct.size());
+        res.offsets.reserve(distinct.size() + 1);
+        size_t offset = 0;
+        for (uint32_t g : order) {
+            res.keys.push_back(distinct[g]);
+            res.offsets.push_back(offset);
+            offset += std::exchange(counts[g], offset);
+        }
+        res.offsets.push_back(offset);
+
+        res.slots.resize(offset);
+        for (size_t i = 0; i < pairGroups.size(); i++) {
+            res.slots[counts[pairGroups[i]]++] = pairSlots[i];
+        }
+        return res;
+    }
+
+    size_t keysCount() const { return keys.size(); }
+
+    // Calls fn(key, std::span<const SlotType>) for every key in increasing order.
+    template <typename Fn>
+    void forEachGroup(Fn&& fn) const {
+        for (size_t i = 0; i < keys.size(); i++) {
+            fn(keys[i], std::span<const SlotType>(slots.data() + offsets[i], offsets[i + 1] - offsets[i]));
+        }
+    }
+};
+
+/**
+    Merges sorted slot lists into out without duplicates. The lists are merged from the shortest to the longest,
+    so long lists are copied as few times as possible.
+*/
+inline void uniteSorted(std::vector<std::vector<SlotType>> lists, std::vector<SlotType>& out) {
+    out.clear();
+    std::sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) { return a.size() < b.size(); });
+
+    std::vector<SlotType> tmp;
+    for (auto& list : lists) {
+        tmp.clear();
+        tmp.reserve(out.size() + list.size());
+        std::set_union(out.begin(), out.end(), list.begin(), list.end(), std::back_inserter(tmp));
+        out.swap(tmp);
+    }
+}
+
+} // namespace qb
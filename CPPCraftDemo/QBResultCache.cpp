@@ -0,0 +1,117 @@
+#include "stdafx.h"
+
+#include "QBResultCache.h"
+
+#include <algorithm>
+
+namespace qb {
+
+ResultCache::ResultCache(size_t columnsCount, size_t capacity)
+    : m_capacity(std::max<size_t>(capacity, 1))
+    , m_positions(columnsCount) {}
+
+ResultCache::Slots ResultCache::find(size_t column, std::string_view key) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto& positions = m_positions[column];
+    auto it = positions.find(key);
+    if (it == positions.end()) {
+        m_misses++;
+        return nullptr;
+    }
+
+    m_hits++;
+    Entry& entry = m_entries[it->second];
+    entry.referenced = true;
+    return entry.slots;
+}
+
+void ResultCache::insert(size_t column, std::string_view key, Slots slots) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto& positions = m_positions[column];
+    auto it = positions.find(key);
+    if (it != positions.end()) {
+        m_entries[it->second].slots = std::move(slots);
+        return;
+    }
+
+    uint32_t i = 0;
+    if (!m_freeEntries.empty()) {
+        i = m_freeEntries.back();
+        m_freeEntries.pop_back();
+    }
+    else if (m_entries.size() < m_capacity) {
+        i = uint32_t(m_entries.size());
+        m_entries.emplace_back();
+    }
+    else {
+        // Every entry is in use here, so the sweep ends within two rounds.
+        while (m_entries[m_hand].referenced) {
+            m_entries[m_hand].referenced = false;
+            m_hand = (m_hand + 1) % m_entries.size();
+        }
+        i = uint32_t(m_hand);
+        m_hand = (m_hand + 1) % m_entries.size();
+        m_positions[m_entries[i].column].erase(m_entries[i].key);
+    }
+
+    Entry& entry = m_entries[i];
+    entry.column = uint32_t(column);
+    entry.key = key;
+    entry.slots = std::move(slots);
+    entry.referenced = false;
+    positions.emplace(entry.key, i);
+}
+
+void ResultCache::erase(size_t column, std::string_view key) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto& positions = m_positions[column];
+    auto it = positions.find(key);
+    if (it != positions.end()) {
+        eraseLocked(it->second);
+    }
+}
+
+void ResultCache::clear(size_t column) {
+    eraseIf(column, [](std::string_view) { return true; });
+}
+
+void ResultCache::clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_freeEntries.clear();
+    for (auto& positions : m_positions) {
+        positions.clear();
+    }
+    m_hand = 0;
+}
+
+bool ResultCache::hasEntries(size_t column) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return !m_positions[column].empty();
+}
+
+size_t ResultCache::size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size() - m_freeEntries.size();
+}
+
+size_t ResultCache::hits() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_hits;
+}
+
+size_t ResultCache::misses() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_misses;
+}
+
+void ResultCache::eraseLocked(uint32_t i) {
+    Entry& entry = m_entries[i];
+    m_positions[entry.column].erase(entry.key);
+    entry.key.clear();
+    entry.slots = nullptr;
+    entry.referenced = false;
+    m_freeEntries.push_back(i);
+}
+
+} // namespace qb
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "QBColumnStore.h"
+#include "QBFlatHashMap.h"
+
+namespace qb {
+
+/**
+    A bounded cache of query results, keyed on the column and the normalized match value. Results are immutable
+    and shared, a hit hands out another reference to the same slots.
+
+    Once full, an entry is evicted with the CLOCK algorithm: a hand sweeps the entries in a ring, clearing the
+    referenced bit hits set, and evicts the first entry whose bit is already clear. Entries hit since the last
+    sweep thus survive it, close to LRU without reordering a list on every hit.
+
+    Every member locks a mutex, so queries running concurrently under a shared lock may share the cache.
+*/
+struct ResultCache {
+    using Slots = std::shared_ptr<const std::vector<SlotType>>;
+
+    ResultCache(size_t columnsCount, size_t capacity);
+
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    // Returns the cached result, or nullptr on a miss.
+    Slots find(size_t column, std::string_view key);
+
+    // Caches the result, evicting an entry if the cache is full.
+    void insert(size_t column, std::string_view key, Slots slots);
+
+    void erase(size_t column, std::string_view key);
+
+    // Erases the entries of the column whose key satisfies pred(key).
+    template <typename Pred>
+    void eraseIf(size_t column, Pred&& pred) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (uint32_t i = 0; i < m_entries.size(); i++) {
+            const Entry& entry = m_entries[i];
+            if (entry.slots && entry.column == column && pred(std::string_view(entry.key))) {
+                eraseLocked(i);
+            }
+        }
+    }
+
+    // Erases the entries of the column.
+    void clear(size_t column);
+    void clear();
+
+    // Whether any entry of the column is cached. Lets writers skip columns nobody queried.
+    bool hasEntries(size_t column) const;
+
+    size_t size() const;
+    size_t capacity() const { return m_capacity; }
+
+    size_t hits() const;
+    size_t misses() const;
+
+private:
+    struct Entry {
+        uint32_t column = 0;
+        std::string key;
+        // nullptr for free entries.
+        Slots slots;
+        bool referenced = false;
+    };
+
+    using PositionsType = HashMap<std::string, uint32_t, HashFor<std::string>, EqualFor<std::string>>;
+
+    void eraseLocked(uint32_t i);
+
+    const size_t m_capacity;
+
+    mutable std::mutex m_mutex;
+    // The ring the CLOCK hand sweeps. Grows up to m_capacity, erased entries are reused first.
+    std::vector<Entry> m_entries;
+    std::vector<uint32_t> m_freeEntries;
+    // Per column, the entry of every cached key.
+    std::vector<PositionsType> m_positions;
+    size_t m_hand = 0;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+};
+
+} // namespace qb
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <iterator>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "QBColumnStore.h"
+#include "QBCompressedPostingList.h"
+
+namespace qb {
+
+/**
+    Iterates the live rows of a collection in slot order. TCollection must provide a RowView constructible
+    from { collection, slot }.
+*/
+template <typename TCollection>
+struct LiveRowIterator {
+    using RowView = typename TCollection::RowView;
+
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = RowView;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = RowView;
+
+    const TCollection* collection = nullptr;
+    const SlotAllocator* slots = nullptr;
+    SlotType slot = 0;
+
+    RowView operator*() const { return RowView{ collection, slot }; }
+
+    LiveRowIterator& operator++() {
+        slot = slots->nextLive(slot + 1);
+        return *this;
+    }
+
+    LiveRowIterator operator++(int) {
+        LiveRowIterator tmp = *this;
+        ++(*this);
+        return tmp;
+    }
+
+    bool operator==(const LiveRowIterator& other) const { return slot == other.slot; }
+    bool operator!=(const LiveRowIterator& other) const { return slot != other.slot; }
+};
+
+/**
+    The result of a query. It references the matching rows of the source collection without copying them,
+    either as a span of slots or as a compressed posting list of an index, so it is only valid until the source
+    collection is modified. Use materialize() to get an independent
+    copy of the rows.
+
+    TCollection must provide a RowView constructible from { collection, slot }, and emptyCopy() and
+    copyRowsFrom(src, slots) for materialization.
+*/
+template <typename TCollection>
+struct BasicResultSet {
+    using RowView = typename TCollection::RowView;
+
+    struct ConstIterator {
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = RowView;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = RowView;
+
+        const TCollection* collection = nullptr;
+        const SlotType* it = nullptr;
+        // Used instead of it when the result references a compressed posting list.
+        CompressedPostingList::ConstIterator listIt;
+
+        RowView operator*() const { return RowView{ collection, it ? *it : *listIt }; }
+
+        ConstIterator& operator++() {
+            if (it) {
+                it++;
+            }
+            else {
+                ++listIt;
+            }
+            return *this;
+        }
+
+        ConstIterator operator++(int) {
+            ConstIterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        bool operator==(const ConstIterator& other) const { return it == other.it && listIt == other.listIt; }
+        bool operator!=(const ConstIterator& other) const { return !(*this == other); }
+    };
+
+    BasicResultSet(const TCollection* c) : m_collection(c) {}
+
+    // References slots owned by the source collection, e.g. a posting list of an index.
+    BasicResultSet(const TCollection* c, std::span<const SlotType> slots) : m_collection(c), m_slots(slots) {}
+
+    // References a compressed posting list owned by the source collection. The list is decoded while iterating.
+    BasicResultSet(const TCollection* c, const CompressedPostingList& list) : m_collection(c), m_list(&list) {}
+
+    // Takes ownership of slots computed by the query.
+    BasicResultSet(const TCollection* c, std::vector<SlotType>&& slots)
+        : BasicResultSet(c, std::make_shared<const std::vector<SlotType>>(std::move(slots))) {}
+
+    // Shares slots computed by an earlier query, e.g. a cached result.
+    BasicResultSet(const TCollection* c, std::shared_ptr<const std::vector<SlotType>> slots)
+        : m_collection(c)
+        , m_owner(std::move(slots)) {
+        m_slots = std::span<const SlotType>(*m_owner);
+    }
+
+    bool empty() const { return m_list ? m_list->empty() : m_slots.empty(); }
+    size_t size() const { return m_list ? m_list->size() : m_slots.size(); }
+
+    ConstIterator begin() const {
+        return m_list ? ConstIterator{ m_collection, nullptr, m_list->begin() }
+                      : ConstIterator{ m_collection, m_slots.data(), {} };
+    }
+
+    ConstIterator end() const {
+        return m_list ? ConstIterator{ m_collection, nullptr, m_list->end() }
+                      : ConstIterator{ m_collection, m_slots.data() + m_slots.size(), {} };
+    }
+
+    // The slots if the result owns them rather than referencing a posting list of the collection, else nullptr.
+    const std::shared_ptr<const std::vector<SlotType>>& sharedSlots() const { return m_owner; }
+
+    // Calls fn with the matching slots in increasing order, either as a span or as a CompressedPostingList.
+    template <typename Fn>
+    decltype(auto) visitSlots(Fn&& fn) const {
+        return m_list ? fn(*m_list) : fn(m_slots);
+    }
+
+    // Copies the matching rows into a new collection.
+    TCollection materialize() const {
+        TCollection res = m_collection->emptyCopy();
+        materializeInto(res);
+        return res;
+    }
+
+    // Appends copies of the matching rows to target, which must have the same schema and none of their ids.
+    void materializeInto(TCollection& target) const {
+        target.reserve(target.size() + size());
+        visitSlots([&](const auto& slots) { target.copyRowsFrom(*m_collection, slots); });
+    }
+
+private:
+    const TCollection* m_collection;
+    std::shared_ptr<const std::vector<SlotType>> m_owner;
+    std::span<const SlotType> m_slots;
+    const CompressedPostingList* m_list = nullptr;
+};
+
+} // namespace qb
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "QBCollection.h"
+#include "QBMemory.h"
+
+namespace qb {
+
+/**
+    A collection split into shards by the hash of the record id. Every shard is a Collection with its own rows,
+    indices, memory resource and reader-writer lock, so writers to different shards never contend.
+
+    The column types are kept by the sharded collection and fixed on every shard at once, by the first row that
+    sets them, so the shards always agree on them. Rows that conflict with them are rejected.
+
+    Lookups by id go to a single shard. Other queries fan out to all shards, each under its shared lock, and the
+    matching rows are merged into one materialized Collection.
+*/
+template <size_t RecordSize>
+struct ShardedCollection {
+    using CollectionType = Collection<RecordSize>;
+    using RecordType = typename CollectionType::RecordType;
+    using IdType = typename CollectionType::IdType;
+    using ColumnNamesType = typename CollectionType::ColumnNamesType;
+    using RowView = typename CollectionType::RowView;
+
+    /**
+        Every shard allocates from its own resource of the given kind, as the built-in resources are not thread
+        safe.
+    */
+    explicit ShardedCollection(const ColumnNamesType& columnNames,
+                               size_t shardsCount = std::max<size_t>(std::thread::hardware_concurrency(), 1),
+                               AllocatorKind allocator = AllocatorKind::Default) :
+        m_columnNames(columnNames) {
+        m_columnTypes.fill(RecordValueType::None);
+        m_columnTypes[0] = RecordValueType::Int32;
+        m_shards.reserve(std::max<size_t>(shardsCount, 1));
+        for (size_t i = 0; i < std::max<size_t>(shardsCount, 1); i++) {
+            m_shards.push_back(std::make_unique<Shard>(ColumnNamesType(columnNames), makeMemoryResource(allocator)));
+        }
+    }
+
+    size_t shardsCount() const { return m_shards.size(); }
+
+    // Same as Collection::createIndex, applied to every shard.
+    bool createIndex(const std::string& columnName, RecordValueType type, IndexKind kind = IndexKind::Hash) {
+        std::unique_lock<std::shared_mutex> lock(m_schemaMutex);
+        bool ok = forAllShards([&](CollectionType& c) { return c.createIndex(columnName, type, kind); });
+        if (ok) {
+            m_columnTypes[columnPosition(columnName)] = type;
+        }
+        return ok;
+    }
+
+    // Same as Collection::setEncoding, applied to every shard.
+    bool setEncoding(const std::string& columnName, ColumnEncoding encoding) {
+        std::unique_lock<std::shared_mutex> lock(m_schemaMutex);
+        bool ok = forAllShards([&](CollectionType& c) { return c.setEncoding(columnName, encoding); });
+        if (ok && encoding == ColumnEncoding::Dictionary) {
+            m_columnTypes[columnPosition(columnName)] = RecordValueType::String;
+        }
+        return ok;
+    }
+
+    // Same as Collection::setColumnType, applied to every shard.
+    bool setColumnType(const std::string& columnName, RecordValueType type) {
+        std::unique_lock<std::shared_mutex> lock(m_schemaMutex);
+        bool ok = forAllShards([&](CollectionType& c) { return c.setColumnType(columnName, type); });
+        if (ok) {
+            m_columnTypes[columnPosition(columnName)] = type;
+        }
+        return ok;
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        forEachShard([&](const CollectionType& c) { n += c.size(); });
+        return n;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    bool insertRecord(RecordType&& record) {
+        IdType id = 0;
+        if (!recordId(record, id) || !fixColumnTypes(record)) {
+            return false;
+        }
+
+        Shard& shard = shardOf(id);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        return shard.collection.insertRecord(std::move(record));
+    }
+
+    /**
+        Inserts the records, taking every shard's lock only once. Returns the number of records inserted, records
+        with invalid or duplicate ids or conflicting types are skipped.
+    */
+    size_t insertRecords(std::vector<RecordType>&& records) {
+        std::vector<std::vector<RecordType*>> byShard(m_shards.size());
+        for (auto& record : records) {
+            IdType id = 0;
+            if (recordId(record, id) && fixColumnTypes(record)) {
+                byShard[shardIndex(id)].push_back(&record);
+            }
+        }
+
+        size_t inserted = 0;
+        for (size_t i = 0; i < m_shards.size(); i++) {
+            if (byShard[i].empty()) {
+                continue;
+            }
+
+            std::unique_lock<std::shared_mutex> lock(m_shards[i]->mutex);
+            for (RecordType* record : byShard[i]) {
+                inserted += m_shards[i]->collection.insertRecord(std::move(*record));
+            }
+        }
+        return inserted;
+    }
+
+    void remove(IdType id) {
+        Shard& shard = shardOf(id);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.collection.remove(id);
+    }
+
+    /**
+        Calls fn(row) for every row matching the column, with the same semantics as Collection::match. Each shard
+        is read under its shared lock, so the rows must not be used after fn returns.
+    */
+    template <typename Fn>
+    void forEachMatch(const std::string& columnName, const std::string& matchString, bool& ok, Fn&& fn) const {
+        fanOut(columnName, matchString, ok, [&](const CollectionType& c, bool& shardOk) {
+            c.forEachMatch(columnName, matchString, shardOk, [&](const auto& row) {
+                fn(row);
+                return true;
+            });
+        });
+    }
+
+    // Returns copies of the rows matching the column, merged from all shards.
+    CollectionType match(const std::string& columnName, const std::string& matchString, bool& ok) const {
+        CollectionType res{ ColumnNamesType(m_columnNames) };
+        fanOut(columnName, matchString, ok, [&](const CollectionType& c, bool& shardOk) {
+            c.match(columnName, matchString, shardOk).materializeInto(res);
+        });
+        return res;
+    }
+
+    // Calls fn(const Collection&) for every shard under its shared lock.
+    template <typename Fn>
+    void forEachShard(Fn&& fn) const {
+        for (const auto& shard : m_shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            fn(static_cast<const CollectionType&>(shard->collection));
+        }
+    }
+
+private:
+    struct Shard {
+        Shard(ColumnNamesType&& columnNames, MemoryResourcePtr memory) : collection(std::move(columnNames), std::move(memory)) {}
+
+        mutable std::shared_mutex mutex;
+        CollectionType collection;
+    };
+
+    // Mixes the id bits, so ids that differ only in high bits still spread over the shards.
+    size_t shardIndex(IdType id) const {
+        return size_t((uint64_t(id) * 0x9E3779B97F4A7C15ull) >> 32) % m_shards.size();
+    }
+
+    Shard& shardOf(IdType id) { return *m_shards[shardIndex(id)]; }
+    const Shard& shardOf(IdType id) const { return *m_shards[shardIndex(id)]; }
+
+    /**
+        Calls visit(collection, ok) for the shard holding the id when matching the id column, for every shard
+        otherwise. ok is set to false if any call sets it to false.
+    */
+    template <typename Fn>
+    void fanOut(const std::string& columnName, const std::string& matchString, bool& ok, Fn&& visit) const {
+        ok = true;
+        auto visitShard = [&](const CollectionType& c) {
+            bool shardOk = false;
+            visit(c, shardOk);
+            ok = ok && shardOk;
+        };
+
+        if (columnName == m_columnNames[0]) {
+            int32_t id = 0;
+            ok = core::toInt32(matchString.data(), id);
+            if (ok) {
+                const Shard& shard = shardOf(IdType(id));
+                std::shared_lock<std::shared_mutex> lock(shard.mutex);
+                visitShard(shard.collection);
+            }
+            return;
+        }
+
+        forEachShard(visitShard);
+    }
+
+    static bool recordId(const RecordType& record, IdType& id) {
+        const auto* value = dynamic_cast<const Int32RecordValue*>(record.columns[0].get());
+        if (!value) {
+            return false;
+        }
+        id = IdType(value->value);
+        return true;
+    }
+
+    size_t columnPosition(const std::string& columnName) const {
+        return size_t(std::find(m_columnNames.begin(), m_columnNames.end(), columnName) - m_columnNames.begin());
+    }
+
+    /**
+        Fixes the types of the record's values on every shard for the columns that have no type yet. Returns
+        false if a value is missing or a column already has another type. Types once fixed never change, so a
+        record checked here still agrees with its shard when it is inserted later.
+    */
+    bool fixColumnTypes(const RecordType& record) {
+        std::array<RecordValueType, RecordSize> types;
+        for (size_t i = 0; i < RecordSize; i++) {
+            if (!record.columns[i]) {
+                return false;
+            }
+            types[i] = record.columns[i]->type();
+        }
+
+        auto conflicts = [&](bool& missing) {
+            missing = false;
+            for (size_t i = 0; i < RecordSize; i++) {
+                if (m_columnTypes[i] == RecordValueType::None) {
+                    missing = true;
+                }
+                else if (m_columnTypes[i] != types[i]) {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        bool missing = false;
+        {
+            std::shared_lock<std::shared_mutex> lock(m_schemaMutex);
+            if (conflicts(missing)) {
+                return false;
+            }
+            if (!missing) {
+                return true;
+            }
+        }
+
+        std::unique_lock<std::shared_mutex> lock(m_schemaMutex);
+        if (conflicts(missing)) {
+            return false;
+        }
+        for (size_t i = 0; i < RecordSize; i++) {
+            if (m_columnTypes[i] == RecordValueType::None) {
+                const std::string& name = m_columnNames[i];
+                if (!forAllShards([&](CollectionType& c) { return c.setColumnType(name, types[i]); })) {
+                    return false;
+                }
+                m_columnTypes[i] = types[i];
+            }
+        }
+        return true;
+    }
+
+    // Runs fn on every shard under its exclusive lock. Returns true if it returned true for all of them.
+    template <typename Fn>
+    bool forAllShards(Fn&& fn) {
+        bool ok = true;
+        for (auto& shard : m_shards) {
+            std::unique_lock<std::shared_mutex> lock(shard->mutex);
+            ok = fn(shard->collection) && ok;
+        }
+        return ok;
+    }
+
+    ColumnNamesType m_columnNames;
+    std::array<RecordValueType, RecordSize> m_columnTypes;
+    mutable std::shared_mutex m_schemaMutex;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+};
+
+} // namespace qb
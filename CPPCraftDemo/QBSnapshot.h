@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace qb {
+
+/**
+    A read-only memory mapping of a whole file. The pages are loaded by the OS on first access, so mapping a
+    large file costs next to nothing until it is read.
+*/
+struct MappedFile {
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Returns false if the file cannot be opened or mapped. Empty files cannot be mapped.
+    bool open(const std::string& path);
+    void close();
+
+    const std::byte* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const std::byte* m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    void* m_file = nullptr;
+    void* m_mapping = nullptr;
+#endif
+};
+
+namespace snapshot {
+
+inline constexpr char Magic[8] = { 'Q', 'B', 'S', 'N', 'A', 'P', '\0', '\0' };
+// Bump when the layout changes, older files are then rejected.
+inline constexpr uint32_t Version = 2;
+// Written in the header, so files from a machine of the other endianness are rejected.
+inline constexpr uint32_t ByteOrderMark = 0x01020304;
+// Arrays start at multiples of this, so they can be read in place from the mapping.
+inline constexpr size_t Alignment = 64;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrderMark;
+    uint32_t columnsCount;
+    uint32_t reserved;
+    uint64_t slotCount;
+};
+
+/**
+    Appends values and arrays to a snapshot file. Every array is written as its element count followed by the
+    elements, starting at the next multiple of Alignment.
+*/
+struct Writer {
+    explicit Writer(const std::string& path) : m_out(path, std::ios::binary | std::ios::trunc) {}
+
+    // Every write returns false once a write failed.
+    template <typename T>
+    bool value(const T& v) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        bytes(&v, sizeof(T));
+        return bool(m_out);
+    }
+
+    template <typename T>
+    bool array(std::span<const T> values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        value(uint64_t(values.size()));
+        pad();
+        bytes(values.data(), values.size_bytes());
+        return bool(m_out);
+    }
+
+    bool string(std::string_view s) { return array(std::span<const char>(s.data(), s.size())); }
+
+    // Returns false if any write failed.
+    bool finish() {
+        m_out.flush();
+        return bool(m_out);
+    }
+
+private:
+    void bytes(const void* p, size_t n) {
+        m_out.write(static_cast<const char*>(p), std::streamsize(n));
+        m_offset += n;
+    }
+
+    void pad() {
+        static constexpr char zeros[Alignment] = {};
+        bytes(zeros, (Alignment - m_offset % Alignment) % Alignment);
+    }
+
+    std::ofstream m_out;
+    size_t m_offset = 0;
+};
+
+/**
+    Reads what a Writer wrote from a mapped file. Arrays are returned as spans into the mapping, nothing is
+    copied. Every read is bounds checked, once a read fails all further reads fail too.
+*/
+struct Reader {
+    explicit Reader(std::span<const std::byte> data) : m_data(data) {}
+
+    bool ok() const { return m_ok; }
+
+    template <typename T>
+    bool value(T& v) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (!reserve(sizeof(T))) {
+            return false;
+        }
+        std::memcpy(&v, m_data.data() + m_offset, sizeof(T));
+        m_offset += sizeof(T);
+        return true;
+    }
+
+    template <typename T>
+    bool array(std::span<const T>& values) {
+        static_assert(std::is_trivially_copyable_v<T> && Alignment % alignof(T) == 0);
+        uint64_t count = 0;
+        if (!value(count)) {
+            return false;
+        }
+
+        size_t padding = (Alignment - m_offset % Alignment) % Alignment;
+        if (count > (m_data.size() - m_offset) / sizeof(T) || !reserve(padding + count * sizeof(T))) {
+            return fail();
+        }
+
+        m_offset += padding;
+        values = std::span<const T>(reinterpret_cast<const T*>(m_data.data() + m_offset), size_t(count));
+        m_offset += values.size_bytes();
+        return true;
+    }
+
+    bool string(std::string_view& s) {
+        std::span<const char> chars;
+        if (!array(chars)) {
+            return false;
+        }
+        s = std::string_view(chars.data(), chars.size());
+        return true;
+    }
+
+    bool fail() {
+        m_ok = false;
+        return false;
+    }
+
+private:
+    bool reserve(size_t n) {
+        if (!m_ok || m_data.size() - m_offset < n) {
+            return fail();
+        }
+        return true;
+    }
+
+    std::span<const std::byte> m_data;
+    size_t m_offset = 0;
+    bool m_ok = true;
+};
+
+} // namespace snapshot
+
+} // namespace qb
@@ -0,0 +1,168 @@
+#include "stdafx.h"
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    #define QB_SCAN_X86 1
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#endif
+
+#if defined(QB_SCAN_X86) && (defined(__GNUC__) || defined(__clang__))
+    #define QB_TARGET_SSE2 __attribute__((target("sse2")))
+    #define QB_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+    #define QB_TARGET_SSE2
+    #define QB_TARGET_AVX2
+#endif
+
+namespace qb::scan {
+
+namespace {
+
+using FindFn = size_t(*)(const char* s, size_t n, const char* needle, size_t k);
+
+constexpr size_t npos = std::string_view::npos;
+
+size_t findScalar(const char* s, size_t n, const char* needle, size_t k) {
+    return std::string_view(s, n).find(std::string_view(needle, k));
+}
+
+/**
+    The vector kernels compare a block of candidate start positions against the first byte of the needle and
+    the same block shifted by k - 1 against the last byte. Only positions that pass both filters are verified
+    with memcmp. The tail that does not fill a whole block is handled by the scalar kernel.
+*/
+
+#ifdef QB_SCAN_X86
+
+QB_TARGET_SSE2 size_t findSse2(const char* s, size_t n, const char* needle, size_t k) {
+    if (k < 2 || n < k) {
+        return findScalar(s, n, needle, k);
+    }
+
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[k - 1]);
+
+    size_t i = 0;
+    for (; i + k - 1 + 16 <= n; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + k - 1));
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast));
+
+        uint32_t mask = uint32_t(_mm_movemask_epi8(eq));
+        while (mask != 0) {
+            size_t bit = size_t(std::countr_zero(mask));
+            if (std::memcmp(s + i + bit + 1, needle + 1, k - 2) == 0) {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    size_t rest = findScalar(s + i, n - i, needle, k);
+    return rest == npos ? npos : i + rest;
+}
+
+QB_TARGET_AVX2 size_t findAvx2(const char* s, size_t n, const char* needle, size_t k) {
+    if (k < 2 || n < k) {
+        return findScalar(s, n, needle, k);
+    }
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+
+    size_t i = 0;
+    for (; i + k - 1 + 32 <= n; i += 32) {
+        __m256i blockFirst = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        __m256i blockLast = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + k - 1));
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast));
+
+        uint32_t mask = uint32_t(_mm256_movemask_epi8(eq));
+        while (mask != 0) {
+            size_t bit = size_t(std::countr_zero(mask));
+            if (std::memcmp(s + i + bit + 1, needle + 1, k - 2) == 0) {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    size_t rest = findSse2(s + i, n - i, needle, k);
+    return rest == npos ? npos : i + rest;
+}
+
+bool cpuSupportsAvx2() {
+#ifdef _MSC_VER
+    int regs[4] = {};
+    __cpuid(regs, 0);
+    if (regs[0] < 7) {
+        return false;
+    }
+
+    // The OS must save the YMM registers on context switches.
+    __cpuid(regs, 1);
+    bool osxsave = (regs[2] & (1 << 27)) != 0;
+    bool avx = (regs[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // QB_SCAN_X86
+
+Isa detectIsa() {
+#ifdef QB_SCAN_X86
+    // SSE2 is part of every x86-64 CPU and is all the first/last byte filter needs.
+    return cpuSupportsAvx2() ? Isa::AVX2 : Isa::SSE2;
+#else
+    return Isa::Scalar;
+#endif
+}
+
+FindFn kernelFor(Isa isa) {
+    switch (isa) {
+#ifdef QB_SCAN_X86
+        case Isa::AVX2: return findAvx2;
+        case Isa::SSE2: return findSse2;
+#endif
+        default: return findScalar;
+    }
+}
+
+} // namespace
+
+Isa detectedIsa() {
+    static const Isa isa = detectIsa();
+    return isa;
+}
+
+const char* isaName(Isa isa) {
+    switch (isa) {
+        case Isa::Scalar: return "Scalar";
+        case Isa::SSE2:   return "SSE2";
+        case Isa::AVX2:   return "AVX2";
+        default:          return "Unknown";
+    }
+}
+
+size_t find(std::string_view haystack, std::string_view needle) {
+    static const FindFn kernel = kernelFor(detectedIsa());
+    return kernel(haystack.data(), haystack.size(), needle.data(), needle.size());
+}
+
+size_t find(Isa isa, std::string_view haystack, std::string_view needle) {
+    return kernelFor(isa)(haystack.data(), haystack.size(), needle.data(), needle.size());
+}
+
+} // namespace qb::scan
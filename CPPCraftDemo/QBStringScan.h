@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+namespace qb::scan {
+
+enum struct Isa {
+    Scalar,
+    SSE2,
+    AVX2,
+
+    SENTINEL
+};
+
+/**
+    The best instruction set supported by the CPU the process runs on. Detected once on first use.
+*/
+Isa detectedIsa();
+
+const char* isaName(Isa isa);
+
+/**
+    Returns the position of the first occurrence of needle in haystack or std::string_view::npos, like
+    std::string_view::find. Dispatches to the best kernel for detectedIsa().
+*/
+size_t find(std::string_view haystack, std::string_view needle);
+
+/**
+    Same as find, but forces a specific kernel. The isa must not be better than detectedIsa().
+*/
+size_t find(Isa isa, std::string_view haystack, std::string_view needle);
+
+} // namespace qb::scan
@@ -0,0 +1,91 @@
+#include "stdafx.h"
+
+#include "QBThreadPool.h"
+
+namespace qb {
+
+ThreadPool::ThreadPool(size_t threadsCount) {
+    for (size_t i = 1; i < threadsCount; i++) {
+        m_workers.emplace_back([this] { workerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for (auto& worker : m_workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::parallelFor(size_t tasksCount, const std::function<void(size_t)>& fn) {
+    if (tasksCount == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> loopLock(m_loopMutex);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fn = &fn;
+        m_tasksCount = tasksCount;
+        m_nextTask = 0;
+        m_generation++;
+    }
+    m_wake.notify_all();
+
+    runTasks(fn, tasksCount);
+
+    // All tasks are handed out, wait for the workers still running one. Workers waking up after this see no
+    // loop and go back to sleep.
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_activeWorkers == 0; });
+    m_fn = nullptr;
+    m_tasksCount = 0;
+}
+
+ThreadPool& ThreadPool::shared() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::workerLoop() {
+    uint64_t seenGeneration = 0;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_wake.wait(lock, [&] { return m_stop || m_generation != seenGeneration; });
+        if (m_stop) {
+            return;
+        }
+
+        seenGeneration = m_generation;
+        const auto* fn = m_fn;
+        size_t tasksCount = m_tasksCount;
+        if (!fn) {
+            continue;
+        }
+
+        m_activeWorkers++;
+        lock.unlock();
+
+        runTasks(*fn, tasksCount);
+
+        lock.lock();
+        if (--m_activeWorkers == 0) {
+            m_done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::runTasks(const std::function<void(size_t)>& fn, size_t tasksCount) {
+    size_t task;
+    while ((task = m_nextTask.fetch_add(1, std::memory_order_relaxed)) < tasksCount) {
+        fn(task);
+    }
+}
+
+} // namespace qb
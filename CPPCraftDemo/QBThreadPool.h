@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace qb {
+
+/**
+    A fixed set of worker threads for running parallel loops. The threads are started once and sleep between
+    loops, so a query pays for waking them up, not for creating them.
+
+    Loops from different threads are serialized. fn must not throw and must not start another loop on the same
+    pool.
+*/
+struct ThreadPool {
+    // threadsCount includes the thread calling parallelFor, so threadsCount - 1 workers are started.
+    explicit ThreadPool(size_t threadsCount = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t threadsCount() const { return m_workers.size() + 1; }
+
+    /**
+        Calls fn(task) for every task in [0, tasksCount) and returns once all calls returned. Tasks are handed out
+        one by one to the workers and the calling thread, so uneven tasks balance out.
+    */
+    void parallelFor(size_t tasksCount, const std::function<void(size_t)>& fn);
+
+    // A pool with one thread per hardware thread, started on first use.
+    static ThreadPool& shared();
+
+private:
+    void workerLoop();
+    void runTasks(const std::function<void(size_t)>& fn, size_t tasksCount);
+
+    std::vector<std::thread> m_workers;
+
+    // Serializes loops started from different threads.
+    std::mutex m_loopMutex;
+
+    // Guards the fields below, except m_nextTask.
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    uint64_t m_generation = 0;
+    size_t m_activeWorkers = 0;
+    bool m_stop = false;
+
+    const std::function<void(size_t)>* m_fn = nullptr;
+    size_t m_tasksCount = 0;
+    std::atomic<size_t> m_nextTask = 0;
+};
+
+} // namespace qb
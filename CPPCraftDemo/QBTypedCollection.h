@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "QBCollection.h"
+#include "QBColumnStore.h"
+#include "QBHashIndex.h"
+#include "QBIdSlotTable.h"
+#include "QBNGramIndex.h"
+#include "QBOrderedIndex.h"
+#include "QBResultSet.h"
+
+namespace qb {
+
+/**
+    A string literal usable as a template argument, e.g. TypedColumn<"column1", std::string_view>.
+*/
+template <size_t N>
+struct FixedName {
+    char value[N] = {};
+
+    constexpr FixedName(const char (&s)[N]) { std::copy_n(s, N, value); }
+
+    constexpr std::string_view view() const { return std::string_view(value, N - 1); }
+};
+
+struct NoIndex {
+    template <typename V> void insert(const V&, SlotType) {}
+    template <typename V> void erase(const V&, SlotType) {}
+};
+
+// Maps a column value type and an index kind to the index structure. Unsupported pairs do not compile.
+template <typename T, IndexKind Kind> struct IndexFor;
+template <typename T> struct IndexFor<T, IndexKind::None> { using Type = NoIndex; };
+template <> struct IndexFor<int32_t, IndexKind::Hash> { using Type = HashIndex<int32_t>; };
+template <> struct IndexFor<int64_t, IndexKind::Hash> { using Type = HashIndex<int64_t>; };
+template <> struct IndexFor<std::string_view, IndexKind::Hash> { using Type = HashIndex<std::string>; };
+template <> struct IndexFor<std::string_view, IndexKind::NGram> { using Type = NGramIndex; };
+template <> struct IndexFor<int64_t, IndexKind::Ordered> { using Type = OrderedIndex; };
+
+/**
+    Describes one column of a TypedCollection. T is one of int32_t, int64_t or std::string_view.
+*/
+template <FixedName Name, typename T, IndexKind Kind = IndexKind::None>
+struct TypedColumn {
+    static constexpr std::string_view name = Name.view();
+    static constexpr IndexKind indexKind = Kind;
+
+    using ValueType = T;
+    using StorageType = typename ColumnFor<T>::Type;
+    using IndexType = typename IndexFor<T, Kind>::Type;
+};
+
+/**
+    A collection with a schema fixed at compile time. Column positions, value types and indices are resolved
+    by the compiler, so inserts and lookups need no RTTI, no virtual calls and no column name hashing.
+
+    The first column must be the int32_t record id. Matching semantics follow Collection: Hash and Ordered
+    indices match exact values, NGram indices and unindexed string columns match substrings, unindexed numeric
+    columns are scanned for exact values.
+*/
+template <typename... Columns>
+struct TypedCollection {
+    static constexpr size_t ColumnsCount = sizeof...(Columns);
+    static_assert(ColumnsCount > 0, "At least the id column is required");
+
+    using ColumnsTuple = std::tuple<Columns...>;
+    static_assert(std::is_same_v<typename std::tuple_element_t<0, ColumnsTuple>::ValueType, int32_t>,
+                  "The first column must be the int32_t record id");
+
+    using IdType = uint32_t;
+
+    static constexpr size_t findColumn(std::string_view name) {
+        constexpr std::array<std::string_view, ColumnsCount> names = { Columns::name... };
+        size_t i = 0;
+        while (i < ColumnsCount && names[i] != name) {
+            i++;
+        }
+        return i;
+    }
+
+    template <FixedName Name>
+    static constexpr size_t positionOf() {
+        constexpr size_t pos = findColumn(Name.view());
+        static_assert(pos < ColumnsCount, "Unknown column name");
+        return pos;
+    }
+
+    template <FixedName Name>
+    using ColumnAt = std::tuple_element_t<positionOf<Name>(), ColumnsTuple>;
+
+    struct RowView {
+        const TypedCollection* collection;
+        SlotType slot;
+
+        IdType id() const { return IdType(at<0>()); }
+
+        template <size_t I>
+        auto at() const { return std::get<I>(collection->m_columns).storage.get(slot); }
+
+        template <FixedName Name>
+        auto get() const { return at<positionOf<Name>()>(); }
+    };
+
+    using ConstIterator = LiveRowIterator<TypedCollection>;
+    using ResultSet = BasicResultSet<TypedCollection>;
+
+    void reserve(size_t n) {
+        m_slotAllocator.reserve(n);
+        m_slots.reserve(n);
+        forEachColumn([n](auto& data) { data.storage.reserve(n); });
+    }
+
+    bool empty() const { return m_slotAllocator.empty(); }
+
+    size_t size() const { return m_slotAllocator.size(); }
+
+    ConstIterator begin() const { return ConstIterator{ this, &m_slotAllocator, m_slotAllocator.nextLive(0) }; }
+    ConstIterator end() const { return ConstIterator{ this, &m_slotAllocator, SlotType(m_slotAllocator.slotCount()) }; }
+
+    bool insert(const typename Columns::ValueType&... values) {
+        return insertImpl(std::index_sequence_for<Columns...>{}, values...);
+    }
+
+    template <FixedName Name>
+    ResultSet match(const typename ColumnAt<Name>::ValueType& v) const {
+        constexpr size_t pos = positionOf<Name>();
+        using Column = ColumnAt<Name>;
+        const auto& data = std::get<pos>(m_columns);
+
+        if constexpr (pos == 0) {
+            SlotType slot = m_slots.find(IdType(v));
+            return slot != IdSlotTable::NoSlot ? ResultSet(this, std::vector<SlotType>{ slot }) : ResultSet(this);
+        }
+        else if constexpr (Column::indexKind == IndexKind::Hash) {
+            const auto* list = data.index.find(v);
+            return list ? ResultSet(this, *list) : ResultSet(this);
+        }
+        else if constexpr (Column::indexKind == IndexKind::Ordered) {
+            const PostingList* list = data.index.find(v);
+            return list ? ResultSet(this, std::span<const SlotType>(*list)) : ResultSet(this);
+        }
+        else if constexpr (std::is_same_v<typename Column::ValueType, std::string_view>) {
+            std::vector<SlotType> slots;
+            if (v.empty()) {
+                slots = liveSlots();
+            }
+            else if constexpr (Column::indexKind == IndexKind::NGram) {
+                data.index.matches(data.storage, v, slots);
+            }
+            else {
+                data.storage.forEachContaining(v, [&](SlotType slot) { slots.push_back(slot); });
+            }
+            return ResultSet(this, std::move(slots));
+        }
+        else {
+            std::vector<SlotType> slots;
+            const auto& values = data.storage.values;
+            for (size_t slot = 0; slot < values.size(); slot++) {
+                if (values[slot] == v && m_slotAllocator.isLive(SlotType(slot))) {
+                    slots.push_back(SlotType(slot));
+                }
+            }
+            return ResultSet(this, std::move(slots));
+        }
+    }
+
+    // Returns the rows whose value falls in the range, in increasing key order.
+    template <FixedName Name>
+    ResultSet matchRange(const KeyRange& range) const {
+        static_assert(ColumnAt<Name>::indexKind == IndexKind::Ordered, "matchRange requires an Ordered index");
+
+        std::vector<SlotType> slots;
+        std::get<positionOf<Name>()>(m_columns).index.forEachInRange(range, [&](int64_t, const PostingList& list) {
+            slots.insert(slots.end(), list.begin(), list.end());
+            return true;
+        });
+        return ResultSet(this, std::move(slots));
+    }
+
+    void remove(IdType id) {
+        SlotType slot = m_slots.erase(id);
+        if (slot == IdSlotTable::NoSlot) {
+            return;
+        }
+
+        forEachColumn([slot](auto& data) {
+            data.index.erase(data.storage.get(slot), slot);
+            data.storage.clear(slot);
+        });
+        m_slotAllocator.release(slot);
+    }
+
+private:
+    friend ResultSet;
+
+    template <typename Column>
+    struct ColumnData {
+        typename Column::StorageType storage;
+        typename Column::IndexType index;
+    };
+
+    template <typename Fn>
+    void forEachColumn(Fn&& fn) {
+        std::apply([&fn](auto&... data) { (fn(data), ...); }, m_columns);
+    }
+
+    SlotType allocateSlot() {
+        bool grown = false;
+        SlotType slot = m_slotAllocator.allocate(grown);
+        if (grown) {
+            forEachColumn([n = m_slotAllocator.slotCount()](auto& data) { data.storage.resize(n); });
+        }
+        return slot;
+    }
+
+    template <size_t... I>
+    bool insertImpl(std::index_sequence<I...>, const typename Columns::ValueType&... values) {
+        auto id = IdType(std::get<0>(std::forward_as_tuple(values...)));
+        if (m_slots.contains(id)) {
+            // Ids are unique.
+            return false;
+        }
+
+        SlotType slot = allocateSlot();
+        if (!(std::get<I>(m_columns).storage.set(slot, values) && ...)) {
+            forEachColumn([slot](auto& data) { data.storage.clear(slot); });
+            m_slotAllocator.release(slot);
+            return false;
+        }
+
+        (std::get<I>(m_columns).index.insert(values, slot), ...);
+        m_slots.insert(id, slot);
+        return true;
+    }
+
+    std::vector<SlotType> liveSlots() const {
+        std::vector<SlotType> slots;
+        slots.reserve(size());
+        for (auto it = begin(); it != end(); ++it) {
+            slots.push_back(it.slot);
+        }
+        return slots;
+    }
+
+    TypedCollection emptyCopy() const { return TypedCollection(); }
+
+    template <typename Slots>
+    void copyRowsFrom(const TypedCollection& src, const Slots& srcSlots) {
+        for (SlotType srcSlot : srcSlots) {
+            copyRowImpl(src, srcSlot, std::index_sequence_for<Columns...>{});
+        }
+    }
+
+    template <size_t... I>
+    void copyRowImpl(const TypedCollection& src, SlotType srcSlot, std::index_sequence<I...>) {
+        insertImpl(std::index_sequence<I...>{}, std::get<I>(src.m_columns).storage.get(srcSlot)...);
+    }
+
+    std::tuple<ColumnData<Columns>...> m_columns;
+    SlotAllocator m_slotAllocator;
+    IdSlotTable m_slots;
+};
+
+using QBTypedRecordCollection = TypedCollection<
+    TypedColumn<"column0", int32_t>,
+    TypedColumn<"column1", std::string_view, IndexKind::NGram>,
+    TypedColumn<"column2", int64_t, IndexKind::Hash>,
+    TypedColumn<"column3", std::string_view, IndexKind::NGram>
+>;
+
+} // namespace qb
@@ -0,0 +1,327 @@
+#include "stdafx.h"
+
+#include "QBWriteAheadLog.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <utility>
+
+#include "QBSnapshot.h"
+
+#ifdef _WIN32
+    #include <fcntl.h>
+    #include <io.h>
+    #include <sys/stat.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+namespace qb {
+
+namespace {
+
+constexpr char LogMagic[8] = { 'Q', 'B', 'W', 'A', 'L', '\0', '\0', '\0' };
+constexpr uint32_t LogVersion = 1;
+constexpr uint32_t LogByteOrderMark = 0x01020304;
+
+struct LogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrderMark;
+};
+
+// Precedes the kind byte and the payload of every entry. size counts both.
+struct EntryHeader {
+    uint32_t size;
+    uint32_t checksum;
+};
+
+constexpr std::array<uint32_t, 256> makeCrcTable() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+}
+
+constexpr std::array<uint32_t, 256> CrcTable = makeCrcTable();
+
+// CRC-32 as used by zlib, continued from crc.
+uint32_t crc32(std::span<const std::byte> data, uint32_t crc = 0) {
+    crc = ~crc;
+    for (std::byte b : data) {
+        crc = CrcTable[(crc ^ uint32_t(b)) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+    Calls fn(kind, payload) for every intact entry after the header and returns the offset just past the last
+    one. Returns 0 if the header is not a log header.
+*/
+template <typename Fn>
+size_t scanEntries(std::span<const std::byte> data, Fn&& fn) {
+    LogHeader header;
+    if (data.size() < sizeof(header)) {
+        return 0;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (!std::equal(std::begin(header.magic), std::end(header.magic), LogMagic) || header.version != LogVersion ||
+        header.byteOrderMark != LogByteOrderMark) {
+        return 0;
+    }
+
+    size_t offset = sizeof(header);
+    EntryHeader entry;
+    while (data.size() - offset >= sizeof(entry)) {
+        std::memcpy(&entry, data.data() + offset, sizeof(entry));
+        if (entry.size == 0 || entry.size > data.size() - offset - sizeof(entry)) {
+            break;
+        }
+
+        auto body = data.subspan(offset + sizeof(entry), entry.size);
+        if (crc32(body) != entry.checksum) {
+            break;
+        }
+
+        fn(WriteAheadLog::EntryKind(body[0]), body.subspan(1));
+        offset += sizeof(entry) + entry.size;
+    }
+    return offset;
+}
+
+#ifdef _WIN32
+
+int openFile(const std::string& path) {
+    int fd = -1;
+    _sopen_s(&fd, path.c_str(), _O_RDWR | _O_CREAT | _O_APPEND | _O_BINARY, _SH_DENYWR, _S_IREAD | _S_IWRITE);
+    return fd;
+}
+
+bool writeAll(int fd, const std::byte* data, size_t n) {
+    while (n > 0) {
+        int chunk = _write(fd, data, unsigned(std::min<size_t>(n, 1 << 30)));
+        if (chunk <= 0) {
+            return false;
+        }
+        data += chunk;
+        n -= size_t(chunk);
+    }
+    return true;
+}
+
+bool flushFile(int fd) { return _commit(fd) == 0; }
+bool resizeFile(int fd, size_t size) { return _chsize_s(fd, int64_t(size)) == 0; }
+void closeFile(int fd) { _close(fd); }
+
+#else
+
+int openFile(const std::string& path) { return ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644); }
+
+bool writeAll(int fd, const std::byte* data, size_t n) {
+    while (n > 0) {
+        ssize_t chunk = ::write(fd, data, n);
+        if (chunk <= 0) {
+            return false;
+        }
+        data += chunk;
+        n -= size_t(chunk);
+    }
+    return true;
+}
+
+bool flushFile(int fd) { return ::fsync(fd) == 0; }
+bool resizeFile(int fd, size_t size) { return ::ftruncate(fd, off_t(size)) == 0; }
+void closeFile(int fd) { ::close(fd); }
+
+#endif
+
+bool writeHeader(int fd) {
+    LogHeader header{};
+    std::copy(std::begin(LogMagic), std::end(LogMagic), header.magic);
+    header.version = LogVersion;
+    header.byteOrderMark = LogByteOrderMark;
+    return writeAll(fd, reinterpret_cast<const std::byte*>(&header), sizeof(header)) && flushFile(fd);
+}
+
+} // namespace
+
+WriteAheadLog::WriteAheadLog(SyncPolicy policy) : m_policy(policy) {
+    m_policy.maxPendingEntries = std::max<size_t>(m_policy.maxPendingEntries, 1);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    close();
+}
+
+bool WriteAheadLog::open(const std::string& path) {
+    close();
+
+    // Find where the intact entries of an existing log end.
+    size_t validEnd = 0;
+    std::error_code error;
+    if (std::filesystem::file_size(path, error) > 0 && !error) {
+        MappedFile file;
+        if (!file.open(path)) {
+            return false;
+        }
+        validEnd = scanEntries(std::span<const std::byte>(file.data(), file.size()), [](EntryKind, auto) {});
+        if (validEnd == 0) {
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_fd = openFile(path);
+    if (m_fd == -1) {
+        return false;
+    }
+
+    bool ok = validEnd == 0 ? resizeFile(m_fd, 0) && writeHeader(m_fd) : resizeFile(m_fd, validEnd) && flushFile(m_fd);
+    if (!ok) {
+        closeFile(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    m_syncedSize = validEnd == 0 ? sizeof(LogHeader) : validEnd;
+    m_failed = false;
+    return true;
+}
+
+void WriteAheadLog::close() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd == -1) {
+        return;
+    }
+
+    syncLocked();
+    closeFile(m_fd);
+    m_fd = -1;
+    m_buffer.clear();
+    m_pendingEntries = 0;
+    m_failed = false;
+}
+
+bool WriteAheadLog::append(EntryKind kind, std::span<const std::byte> payload) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd == -1 || m_failed) {
+        return false;
+    }
+
+    EntryHeader entry{ uint32_t(payload.size() + 1), 0 };
+    std::byte kindByte = std::byte(kind);
+    entry.checksum = crc32(payload, crc32(std::span<const std::byte>(&kindByte, 1)));
+
+    const auto* header = reinterpret_cast<const std::byte*>(&entry);
+    m_buffer.insert(m_buffer.end(), header, header + sizeof(entry));
+    m_buffer.push_back(kindByte);
+    m_buffer.insert(m_buffer.end(), payload.begin(), payload.end());
+
+    auto now = std::chrono::steady_clock::now();
+    if (m_pendingEntries++ == 0) {
+        m_oldestPending = now;
+    }
+
+    if (m_pendingEntries >= m_policy.maxPendingEntries || now - m_oldestPending >= m_policy.maxDelay) {
+        return syncLocked();
+    }
+    return true;
+}
+
+bool WriteAheadLog::sync() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_fd != -1 && syncLocked();
+}
+
+bool WriteAheadLog::truncate() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd == -1) {
+        return false;
+    }
+
+    if (!resizeFile(m_fd, sizeof(LogHeader)) || !flushFile(m_fd)) {
+        return false;
+    }
+
+    m_buffer.clear();
+    m_pendingEntries = 0;
+    m_syncedSize = sizeof(LogHeader);
+    m_failed = false;
+    return true;
+}
+
+bool WriteAheadLog::failed() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failed;
+}
+
+size_t WriteAheadLog::pendingEntries() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pendingEntries;
+}
+
+bool WriteAheadLog::attach() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return !std::exchange(m_attached, true);
+}
+
+void WriteAheadLog::detach() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_attached = false;
+}
+
+bool WriteAheadLog::replay(const std::string& path, const std::function<void(EntryKind, std::span<const std::byte>)>& fn) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+    return scanEntries(std::span<const std::byte>(file.data(), file.size()), fn) != 0;
+}
+
+bool WriteAheadLog::syncFile(const std::string& path) {
+#ifdef _WIN32
+    int fd = -1;
+    _sopen_s(&fd, path.c_str(), _O_RDWR | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+#endif
+    if (fd == -1) {
+        return false;
+    }
+
+    bool ok = flushFile(fd);
+    closeFile(fd);
+    return ok;
+}
+
+bool WriteAheadLog::syncLocked() {
+    if (m_failed) {
+        return false;
+    }
+    if (m_pendingEntries == 0) {
+        return true;
+    }
+
+    if (!writeAll(m_fd, m_buffer.data(), m_buffer.size()) || !flushFile(m_fd)) {
+        // Cut off what part of the batch made it to the file, so no torn entry hides the entries appended after
+        // the log recovers. The batch stays buffered, the log takes no more entries until truncate().
+        resizeFile(m_fd, m_syncedSize);
+        m_failed = true;
+        return false;
+    }
+
+    m_syncedSize += m_buffer.size();
+    m_buffer.clear();
+    m_pendingEntries = 0;
+    return true;
+}
+
+} // namespace qb
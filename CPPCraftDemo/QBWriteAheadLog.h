@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace qb {
+
+/**
+    An append-only log of collection changes, written before they can be lost in a crash. Entries are buffered
+    in memory and written and flushed to disk (fsync) together, once enough entries are pending or the oldest of
+    them waited long enough, see SyncPolicy. Many entries thus share one fsync (group commit), at the price of
+    losing the entries of the last unsynced batch in a crash.
+
+    Every entry carries a checksum. A crash in the middle of a write leaves a torn entry at the end of the file,
+    which replay() stops at and open() cuts off.
+
+    A log belongs to one collection, see attach(): its entries carry no collection, so replay() applies all of
+    them to whichever collection replays the log, and a checkpoint of the owner truncates every entry. Appends
+    are serialized with a mutex, so the owner may be written from several threads under its own locking.
+
+    There is no background thread. maxDelay is only checked when the next entry is appended, so the entries of
+    a burst followed by silence stay unsynced until the next append, sync() or close(). Call sync() after a
+    burst that has to be durable.
+*/
+struct WriteAheadLog {
+    enum struct EntryKind : uint8_t {
+        Insert = 1,
+        Remove = 2,
+    };
+
+    struct SyncPolicy {
+        // Sync once this many entries are pending. 1 syncs every entry.
+        size_t maxPendingEntries = 1024;
+        // Sync on the next append once the oldest pending entry is this old. Nothing syncs without an append.
+        std::chrono::milliseconds maxDelay = std::chrono::milliseconds(10);
+    };
+
+    WriteAheadLog() : WriteAheadLog(SyncPolicy()) {}
+    explicit WriteAheadLog(SyncPolicy policy);
+    // Syncs the pending entries.
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    /**
+        Opens the log for appending, creating it if it does not exist. A torn entry at the end of an existing log
+        is cut off. Returns false if the file cannot be opened or is not a log.
+    */
+    bool open(const std::string& path);
+
+    // Syncs the pending entries and closes the file.
+    void close();
+
+    bool isOpen() const { return m_fd != -1; }
+
+    /**
+        Buffers the entry and syncs if the policy says so. Returns false if the log is closed, has failed or the
+        sync failed, see failed().
+    */
+    bool append(EntryKind kind, std::span<const std::byte> payload);
+
+    // Writes and flushes the pending entries to disk. Returns false if that failed.
+    bool sync();
+
+    /**
+        Whether a sync failed. The file is then cut back to the entries synced before, the failed batch stays
+        pending and every append() and sync() fails, since the log no longer holds every change it took. Only a
+        truncate() once a snapshot covers the changes, or reopening the log, clears the state.
+    */
+    bool failed() const;
+
+    // Drops every entry, e.g. once they are covered by a snapshot. Clears a failed state.
+    bool truncate();
+
+    size_t pendingEntries() const;
+
+    /**
+        Claims the log for a collection. Returns false if another collection holds it, until that one calls
+        detach(). Called by Collection::setWriteAheadLog().
+    */
+    bool attach();
+    void detach();
+
+    /**
+        Calls fn(kind, payload) for every intact entry of the log at path, in order, and stops at the first torn
+        or damaged one. Returns false if the file cannot be read or is not a log.
+    */
+    static bool replay(const std::string& path, const std::function<void(EntryKind, std::span<const std::byte>)>& fn);
+
+    // Flushes a file written by other means to disk, e.g. a snapshot before the log is truncated.
+    static bool syncFile(const std::string& path);
+
+private:
+    bool syncLocked();
+
+    SyncPolicy m_policy;
+
+    mutable std::mutex m_mutex;
+    int m_fd = -1;
+    std::vector<std::byte> m_buffer;
+    size_t m_pendingEntries = 0;
+    // Size of the file up to the last synced entry.
+    size_t m_syncedSize = 0;
+    bool m_failed = false;
+    bool m_attached = false;
+    std::chrono::steady_clock::time_point m_oldestPending;
+};
+
+} // namespace qb
@@ -5,24 +5,36 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
-#include <ratio>
+#include <limits>
+#include <map>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace {
 
 static constexpr int32_t TEST_CASES = 100000;
 static constexpr int32_t TEST_RND_ELEMENTS = 1000;
+// Fixed, so a failing run can be repeated.
+static constexpr uint32_t TEST_SEED = 42;
 static std::array<std::string, TEST_RND_ELEMENTS> rndStrings;
 static std::array<int64_t, TEST_RND_ELEMENTS> rndLongs;
 
 static base_impl::QBRecordCollection testBaseImplementation;
-static qb::QBRecordCollection testQBImplementation({ "column0", "column1", "column2", "column3" });
+// Bulk loaded once and never shrunk, so a bump arena fits.
+static qb::QBRecordCollection testQBImplementation({ "column0", "column1", "column2", "column3" },
+    qb::makeMemoryResource(qb::AllocatorKind::Arena));
+static qb::QBTypedRecordCollection testQBTypedImplementation;
 
 void beforeTests() {
-    srand(uint32_t(time(0)));
+    srand(TEST_SEED);
 
     for (int32_t i = 0; i < TEST_RND_ELEMENTS; i++) {
         int32_t strSize = core::genRndInt32(5, 29);
@@ -39,18 +51,24 @@ void beforeTests() {
     {
         auto& c1 = testBaseImplementation;
         auto& c2 = testQBImplementation;
+        auto& c3 = testQBTypedImplementation;
         bool ok = false;
 
         c1.reserve(TEST_CASES);
 
-        ok = c2.createIndex("column1", qb::RecordValueType::String);
+        // NGram indices answer the same substring queries as the base implementation.
+        ok = c2.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram);
         assert(ok);
         ok = c2.createIndex("column2", qb::RecordValueType::Int64);
         assert(ok);
-        ok = c2.createIndex("column3", qb::RecordValueType::String);
+        ok = c2.createIndex("column3", qb::RecordValueType::String, qb::IndexKind::NGram);
         assert(ok);
 
-        c2.reserve(TEST_CASES);
+        c3.reserve(TEST_CASES);
+
+        // Loaded in one batch, which builds the indices in a single sorted pass.
+        std::vector<qb::Record<4>> c2Records;
+        c2Records.reserve(TEST_CASES);
 
         // Make sure all generated random elemnts are present in the collection:
         for (int32_t i = 0; i < TEST_RND_ELEMENTS; i++) {
@@ -70,9 +88,11 @@ void beforeTests() {
                 r.columns[1] = std::make_unique<qb::StrRecordValue>(rndStrings[i]);
                 r.columns[2] = std::make_unique<qb::Int64RecordValue>(rndLongs[i]);
                 r.columns[3] = std::make_unique<qb::StrRecordValue>(rndStrings[TEST_RND_ELEMENTS - i - 1]);
-                c2.insertRecord(std::move(r));
+                c2Records.push_back(std::move(r));
             }
 
+            c3.insert(uniqueIdx, rndStrings[i], rndLongs[i], rndStrings[TEST_RND_ELEMENTS - i - 1]);
+
             uniqueIdx++;
         }
 
@@ -97,11 +117,16 @@ void beforeTests() {
                 r.columns[1] = std::make_unique<qb::StrRecordValue>(rndStrings[rndIdx1]);
                 r.columns[2] = std::make_unique<qb::Int64RecordValue>(rndLongs[rndIdx2]);
                 r.columns[3] = std::make_unique<qb::StrRecordValue>(rndStrings[rndIdx3]);
-                c2.insertRecord(std::move(r));
+                c2Records.push_back(std::move(r));
             }
 
+            c3.insert(uniqueIdx, rndStrings[rndIdx1], rndLongs[rndIdx2], rndStrings[rndIdx3]);
+
             uniqueIdx++;
         }
+
+        ok = c2.bulkInsert(std::move(c2Records));
+        assert(ok);
     }
 }
 
@@ -111,21 +136,16 @@ void runFunctionalTests() {
     using QBRecordCollection = qb::QBRecordCollection;
 
     auto assertColumns = [](const auto& r, const auto& c1, const auto& c2, const auto& c3, const auto& c4) {
-        auto* idRecord = dynamic_cast<qb::Int32RecordValue*>(r.columns[0].get());
-        assert(idRecord);
-        assert(idRecord->value == c1);
-
-        auto* strRecord = dynamic_cast<qb::StrRecordValue*>(r.columns[1].get());
+        assert(r.id() == uint32_t(c1));
+        assert(r.template get<int32_t>(0) == c1);
+        assert(r.template get<std::string_view>(1) == c2);
+        assert(r.template get<int64_t>(2) == c3);
+        assert(r.template get<std::string_view>(3) == c4);
+
+        auto rec = r.toRecord();
+        auto* strRecord = dynamic_cast<qb::StrRecordValue*>(rec.columns[1].get());
         assert(strRecord);
         assert(strRecord->value == c2);
-
-        auto* intRecord = dynamic_cast<qb::Int64RecordValue*>(r.columns[2].get());
-        assert(intRecord);
-        assert(intRecord->value == c3);
-
-        auto* strRecord2 = dynamic_cast<qb::StrRecordValue*>(r.columns[3].get());
-        assert(strRecord2);
-        assert(strRecord2->value == c4);
     };
 
     struct TestRecord {
@@ -135,12 +155,12 @@ void runFunctionalTests() {
         std::string column3;
     };
 
-    auto assertResult = [&](const QBRecordCollection& res, size_t expectedSize, const std::vector<TestRecord>& expected) {
+    auto assertResult = [&](const auto& res, size_t expectedSize, const std::vector<TestRecord>& expected) {
         assert(res.size() == expectedSize);
         size_t i = 0;
-        for (const auto& [id, r] : res) {
+        for (const auto& row : res) {
             auto& ex = expected[i];
-            assertColumns(r, ex.id, ex.column1, ex.column2, ex.column3);
+            assertColumns(row, ex.id, ex.column1, ex.column2, ex.column3);
             i++;
         }
     };
@@ -276,66 +296,1822 @@ void runFunctionalTests() {
             assertResult(res, 1, { { 1, "data1", 60, "data2" } });
         }
     }
-}
 
-template <size_t TCount>
-void runPerfTestFindMatchingIn() {
-    std::cout << "Running perf test with " << TCount << " iterations" << std::endl;
+    {
+        // Column storage: types are fixed by the first record, ids are unique and removed slots are reused.
+        bool ok = false;
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+        assert(c.createIndex("column2", qb::RecordValueType::Int64));
+
+        auto makeRecord = [](int32_t id, const std::string& c1, int64_t c2, const std::string& c3) {
+            return qb::Record<4>{ {
+                std::make_unique<qb::Int32RecordValue>(id),
+                std::make_unique<qb::StrRecordValue>(c1),
+                std::make_unique<qb::Int64RecordValue>(c2),
+                std::make_unique<qb::StrRecordValue>(c3)
+            } };
+        };
+
+        assert(c.insertRecord(makeRecord(0, "a", 1, "b")));
+        assert(c.insertRecord(makeRecord(1, "c", 1, "d")));
+        assert(!c.insertRecord(makeRecord(1, "e", 2, "f")));
+        assert(c.size() == 2);
+
+        ok = c.insertRecord({
+            {
+                std::make_unique<qb::Int32RecordValue>(2),
+                std::make_unique<qb::Int64RecordValue>(5),
+                std::make_unique<qb::Int64RecordValue>(1),
+                std::make_unique<qb::StrRecordValue>("g")
+            }
+        });
+        assert(!ok);
+        assert(c.size() == 2);
+        assert(!c.createIndex("column1", qb::RecordValueType::Int64));
+
+        c.remove(0);
+        assert(c.insertRecord(makeRecord(7, "h", 1, "i")));
+        assert(c.size() == 2);
 
-    size_t useTheResultToAvoidCompilerOptimization1 = 0;
+        auto res = c.match("column2", "1", ok);
+        assert(ok);
+        assertResult(res, 2, { { 7, "h", 1, "i" }, { 1, "c", 1, "d" } });
+    }
 
     {
-        auto start = std::chrono::high_resolution_clock::now();
+        // Result sets reference the source rows, materialize() copies them into an independent collection.
+        bool ok = false;
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+        assert(c.createIndex("column1", qb::RecordValueType::String));
 
-        for (int32_t i = 0; i < TCount; i++) {
-            auto res = QBFindMatchingRecords(testQBImplementation, "column1", rndStrings[i % TEST_RND_ELEMENTS]);
-            useTheResultToAvoidCompilerOptimization1 += res.size();
+        for (int32_t i = 0; i < 3; i++) {
+            ok = c.insertRecord({
+                {
+                    std::make_unique<qb::Int32RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>(i == 1 ? "other" : "data1"),
+                    std::make_unique<qb::Int64RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>("data2")
+                }
+            });
+            assert(ok);
         }
-        for (int32_t i = 0; i < TCount; i++) {
-            auto res = QBFindMatchingRecords(testQBImplementation, "column2", std::to_string(rndLongs[i % TEST_RND_ELEMENTS]));
-            useTheResultToAvoidCompilerOptimization1 += res.size();
+
+        auto res = qb::QBFindMatchingRecords(c, "column1", "data1");
+        assertResult(res, 2, { { 0, "data1", 0, "data2" }, { 2, "data1", 2, "data2" } });
+
+        QBRecordCollection copy = res.materialize();
+        assertResult(copy, 2, { { 0, "data1", 0, "data2" }, { 2, "data1", 2, "data2" } });
+
+        c.remove(0);
+        assert(c.size() == 2);
+        assertResult(copy, 2, { { 0, "data1", 0, "data2" }, { 2, "data1", 2, "data2" } });
+        assertResult(copy.match("column0", "2", ok), 1, { { 2, "data1", 2, "data2" } });
+        assert(ok);
+    }
+
+    {
+        // NGram indices match substrings, like base_impl::QBFindMatchingRecords.
+        bool ok = false;
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+        assert(c.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram));
+        assert(!c.createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::NGram));
+
+        const char* values[] = { "data1", "metadata", "dat", "abcabcabc" };
+        for (int32_t i = 0; i < 4; i++) {
+            ok = c.insertRecord({
+                {
+                    std::make_unique<qb::Int32RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>(values[i]),
+                    std::make_unique<qb::Int64RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>("x")
+                }
+            });
+            assert(ok);
         }
-        for (int32_t i = 0; i < TCount; i++) {
-            auto res = QBFindMatchingRecords(testQBImplementation, "column3", rndStrings[i % TEST_RND_ELEMENTS]);
-            useTheResultToAvoidCompilerOptimization1 += res.size();
+
+        auto count = [&](const std::string& pattern) {
+            auto res = c.match("column1", pattern, ok);
+            assert(ok);
+            return res.size();
+        };
+
+        assert(count("data") == 2);
+        assert(count("data1") == 1);
+        assert(count("dat") == 3);
+        assert(count("at") == 3);
+        assert(count("") == 4);
+        assert(count("cabca") == 1);
+        assert(count("atad") == 0);
+        assert(count("zzz") == 0);
+
+        c.remove(1);
+        assert(count("data") == 1);
+        assert(count("meta") == 0);
+    }
+
+    {
+        // Every scan kernel the CPU supports agrees with std::string_view::find.
+        std::string haystack;
+        for (int32_t i = 0; i < 2000; i++) {
+            haystack += char('a' + core::genRndInt32(0, 3));
         }
 
-        auto end = std::chrono::high_resolution_clock::now();
+        for (int32_t isa = 0; isa <= int32_t(qb::scan::detectedIsa()); isa++) {
+            for (int32_t i = 0; i < 200; i++) {
+                std::string needle;
+                int32_t len = core::genRndInt32(0, 8);
+                for (int32_t j = 0; j < len; j++) {
+                    needle += char('a' + core::genRndInt32(0, 3));
+                }
+
+                size_t from = size_t(core::genRndInt32(0, int32_t(haystack.size())));
+                std::string_view hay = std::string_view(haystack).substr(from);
+                assert(qb::scan::find(qb::scan::Isa(isa), hay, needle) == hay.find(needle));
+            }
+        }
+    }
 
-        std::cout << "QBFindMatchingRecords: " << TCount << " iterations took: "
-            << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+    {
+        // Columns without an index are scanned. String columns match substrings, numeric columns match exactly.
+        bool ok = false;
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+
+        {
+            auto res = c.match("column1", "data", ok);
+            assert(ok);
+            assert(res.size() == 0);
+        }
+
+        for (int32_t i = 0; i < 100; i++) {
+            std::string s = "row" + std::to_string(i) + (i % 10 == 0 ? "_needle_" : "_hay_stack_padding_");
+            ok = c.insertRecord({
+                {
+                    std::make_unique<qb::Int32RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>(s),
+                    std::make_unique<qb::Int64RecordValue>(i % 7),
+                    std::make_unique<qb::StrRecordValue>("x")
+                }
+            });
+            assert(ok);
+        }
+        c.remove(20);
+
+        auto count = [&](const std::string& column, const std::string& pattern) {
+            auto res = c.match(column, pattern, ok);
+            assert(ok);
+            assert(c.count(column, pattern, ok) == res.size() && ok);
+            return res.size();
+        };
+
+        assert(count("column1", "_needle_") == 9);
+        assert(count("column1", "row1") == 11);
+        assert(count("column1", "_row") == 0);
+        assert(count("column1", "") == 99);
+        assert(count("column2", "3") == 14);
+        assert(count("column3", "x") == 99);
+        c.match("column2", "nan", ok);
+        assert(!ok);
+        c.count("column2", "nan", ok);
+        assert(!ok);
     }
 
-    if (TCount > 1000) {
-        std::cout << "Skipping base_impl::QBFindMatchingRecords for " << TCount << " iterations, as it's too slow." << std::endl;
-        return;
+    {
+        // Ordered indices answer range queries and stream rows in key order.
+        bool ok = false;
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+        assert(c.createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered));
+        assert(!c.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::Ordered));
+
+        std::vector<int64_t> keys;
+        for (int32_t i = 0; i < 2000; i++) {
+            int64_t key = core::genRndInt64(-500, 500) * 3;
+            keys.push_back(key);
+            ok = c.insertRecord({
+                {
+                    std::make_unique<qb::Int32RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>("x"),
+                    std::make_unique<qb::Int64RecordValue>(key),
+                    std::make_unique<qb::StrRecordValue>("y")
+                }
+            });
+            assert(ok);
+        }
+        for (int32_t i = 0; i < 2000; i += 3) {
+            c.remove(i);
+        }
+
+        auto expectedCount = [&](const qb::KeyRange& range) {
+            size_t n = 0;
+            for (int32_t i = 0; i < 2000; i++) {
+                if (i % 3 != 0 && keys[i] >= range.low && keys[i] <= range.high) n++;
+            }
+            return n;
+        };
+
+        auto assertRange = [&](const qb::KeyRange& range) {
+            auto res = c.matchRange("column2", range, ok);
+            assert(ok);
+            assert(res.size() == expectedCount(range));
+
+            int64_t prev = std::numeric_limits<int64_t>::min();
+            for (const auto& row : res) {
+                int64_t key = row.get<int64_t>(2);
+                assert(key >= prev);
+                assert(key >= range.low && key <= range.high);
+                prev = key;
+            }
+        };
+
+        assertRange(qb::KeyRange::all());
+        assertRange(qb::KeyRange::lessThan(0));
+        assertRange(qb::KeyRange::atMost(0));
+        assertRange(qb::KeyRange::greaterThan(30));
+        assertRange(qb::KeyRange::between(-99, 99));
+        assertRange(qb::KeyRange::between(99, -99));
+        assertRange(qb::KeyRange::lessThan(std::numeric_limits<int64_t>::min()));
+
+        auto res = c.match("column2", std::to_string(keys[1]), ok);
+        assert(ok);
+        assert(res.size() == expectedCount(qb::KeyRange::equal(keys[1])));
+
+        size_t seen = 0;
+        ok = c.forEachInRange("column2", qb::KeyRange::all(), [&](const auto&) { return ++seen < 10; });
+        assert(ok);
+        assert(seen == 10);
+        c.matchRange("column1", qb::KeyRange::all(), ok);
+        assert(!ok);
     }
 
-    size_t useTheResultToAvoidCompilerOptimization2 = 0;
+    {
+        // Pages of a match are slices of the full result, for indexed and scanned columns alike.
+        bool ok = false;
+        QBRecordCollection indexed({ "column0", "column1", "column2", "column3" });
+        QBRecordCollection plain({ "column0", "column1", "column2", "column3" });
+        assert(indexed.setEncoding("column3", qb::ColumnEncoding::Dictionary));
+        assert(plain.setEncoding("column3", qb::ColumnEncoding::Dictionary));
+        for (int32_t i = 0; i < 10000; i++) {
+            for (auto* target : { &indexed, &plain }) {
+                target->insertRecord({
+                    {
+                        std::make_unique<qb::Int32RecordValue>(i),
+                        std::make_unique<qb::StrRecordValue>("data" + std::to_string(i % 50)),
+                        std::make_unique<qb::Int64RecordValue>(i % 20),
+                        std::make_unique<qb::StrRecordValue>("tag" + std::to_string(i % 5))
+                    }
+                });
+            }
+        }
+        assert(indexed.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram));
+        assert(indexed.createIndex("column2", qb::RecordValueType::Int64));
+        assert(indexed.createIndex("column3", qb::RecordValueType::String));
+        for (int32_t i = 0; i < 10000; i += 7) {
+            indexed.remove(i);
+            plain.remove(i);
+        }
+
+        auto idsOf = [](const QBRecordCollection::ResultSet& res) {
+            std::vector<int32_t> ids;
+            for (const auto& row : res) {
+                ids.push_back(row.id());
+            }
+            return ids;
+        };
+
+        for (auto* c : { &indexed, &plain }) {
+            for (const auto& [column, value] : std::vector<std::pair<std::string, std::string>>{
+                     { "column0", "43" }, { "column0", "42" }, { "column1", "data1" }, { "column1", "a4" },
+                     { "column1", "" }, { "column2", "3" }, { "column3", "tag2" }, { "column3", "ag" } }) {
+                auto all = idsOf(c->match(column, value, ok));
+                assert(ok);
+
+                std::vector<int32_t> paged;
+                for (size_t offset = 0; offset <= all.size(); offset += 333) {
+                    auto page = idsOf(c->matchPage(column, value, offset, 333, ok));
+                    assert(ok);
+                    assert(page.size() == std::min<size_t>(333, all.size() - offset));
+                    paged.insert(paged.end(), page.begin(), page.end());
+                }
+                assert(paged == all);
+                assert(c->matchPage(column, value, 0, 0, ok).size() == 0);
+            }
+
+            // The callback is not called again once it asked to stop.
+            size_t seen = 0;
+            c->forEachMatch("column1", "data", ok, [&](const auto&) { return ++seen < 10; });
+            assert(ok);
+            assert(seen == 10);
+
+            c->matchPage("column2", "x", 0, 10, ok);
+            assert(!ok);
+            c->matchPage("column9", "1", 0, 10, ok);
+            assert(!ok);
+        }
+    }
 
     {
-        auto start = std::chrono::high_resolution_clock::now();
+        // Cached results stay equal to uncached ones while rows are inserted and removed.
+        bool ok = false;
+        QBRecordCollection cached({ "column0", "column1", "column2", "column3" });
+        QBRecordCollection plain({ "column0", "column1", "column2", "column3" });
+        cached.setResultCacheCapacity(4);
+        assert(cached.createIndex("column2", qb::RecordValueType::Int64));
+        assert(cached.createIndex("column3", qb::RecordValueType::String, qb::IndexKind::NGram));
+        assert(plain.createIndex("column2", qb::RecordValueType::Int64));
+
+        auto insert = [&](int32_t i) {
+            for (auto* target : { &cached, &plain }) {
+                target->insertRecord({
+                    {
+                        std::make_unique<qb::Int32RecordValue>(i),
+                        std::make_unique<qb::StrRecordValue>("data" + std::to_string(i % 50)),
+                        std::make_unique<qb::Int64RecordValue>(i % 20),
+                        std::make_unique<qb::StrRecordValue>("tag" + std::to_string(i % 7))
+                    }
+                });
+            }
+        };
 
-        for (int32_t i = 0; i < TCount; i++) {
-            auto res = base_impl::QBFindMatchingRecords(testBaseImplementation, "column1", rndStrings[i % TEST_RND_ELEMENTS]);
-            useTheResultToAvoidCompilerOptimization2 += res.size();
+        auto idsOf = [](const QBRecordCollection::ResultSet& res) {
+            std::set<int32_t> ids;
+            for (const auto& row : res) {
+                ids.insert(row.id());
+            }
+            return ids;
+        };
+
+        auto assertSame = [&](const std::string& column, const std::string& value) {
+            auto a = idsOf(cached.match(column, value, ok));
+            assert(ok);
+            assert(a == idsOf(plain.match(column, value, ok)));
+        };
+
+        for (int32_t i = 0; i < 1000; i++) {
+            insert(i);
+        }
+
+        const auto* cache = cached.resultCache();
+        assertSame("column1", "data1");
+        assertSame("column1", "data1");
+        assert(cache->hits() == 1);
+        assert(cache->size() == 1);
+
+        // Exact matches answered from a posting list are not copied into the cache.
+        assertSame("column2", "7");
+        assert(cache->size() == 1);
+        cached.remove(7);
+        plain.remove(7);
+        assertSame("column2", "7");
+        assertSame("column2", "007");
+        assert(cache->size() == 2);
+        assert(cache->hits() == 2);
+
+        // A row only drops the entries it belongs to.
+        assertSame("column3", "ag3");
+        assertSame("column1", "data2");
+        assert(cache->size() == 4);
+        insert(1001);
+        assert(cache->size() == 3);
+        assertSame("column1", "data1");
+        assertSame("column2", "7");
+        assert(cache->hits() == 3);
+
+        // The least recently hit entries are evicted once the cache is full.
+        for (const char* pattern : { "a", "b", "c", "d", "e", "f" }) {
+            assertSame("column1", pattern);
+        }
+        assert(cache->size() == 4);
+
+        for (int32_t i = 0; i < 1000; i++) {
+            if (i % 3 == 0) {
+                cached.remove(i);
+                plain.remove(i);
+            }
+            else if (i % 3 == 1) {
+                insert(2000 + i);
+            }
+            assertSame("column1", "data" + std::to_string(i % 11));
+            assertSame("column2", std::to_string(i % 5));
+            assertSame("column3", "tag" + std::to_string(i % 3));
+            assertSame("column3", "ag");
+        }
+
+        // A batch drops the entries of all its rows in one pass, or every substring entry of a column once it has
+        // too many distinct values to check.
+        for (int32_t n : { 3, 200 }) {
+            for (int pass = 0; pass < 2; pass++) {
+                assertSame("column1", "data4");
+                assertSame("column1", "ata19");
+                assertSame("column2", "4");
+                assertSame("column3", "ag");
+                if (pass == 1) {
+                    break;
+                }
+
+                for (auto* target : { &cached, &plain }) {
+                    std::vector<qb::Record<4>> batch;
+                    for (int32_t i = 0; i < n; i++) {
+                        batch.push_back({
+                            {
+                                std::make_unique<qb::Int32RecordValue>(10000 * n + i),
+                                std::make_unique<qb::StrRecordValue>("data" + std::to_string(i)),
+                                std::make_unique<qb::Int64RecordValue>(i % 5),
+                                std::make_unique<qb::StrRecordValue>("tag" + std::to_string(i))
+                            }
+                        });
+                    }
+                    assert(target->bulkInsert(std::move(batch)));
+                }
+            }
+        }
+
+        // A new index turns the matches on the column from substring into exact ones.
+        assertSame("column1", "data1");
+        assert(cached.createIndex("column1", qb::RecordValueType::String));
+        assert(plain.createIndex("column1", qb::RecordValueType::String));
+        assertSame("column1", "data1");
+        assertSame("column1", "ata1");
+
+        cached.setResultCacheCapacity(0);
+        assert(!cached.resultCache());
+        assertSame("column1", "data1");
+    }
+
+    {
+        // Aggregates agree with the same numbers computed from the matching rows.
+        bool ok = false;
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+        assert(c.setEncoding("column3", qb::ColumnEncoding::Dictionary));
+        assert(c.createIndex("column1", qb::RecordValueType::String));
+        assert(c.createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered));
+        assert(c.createIndex("column3", qb::RecordValueType::String));
+        for (int32_t i = 0; i < 5000; i++) {
+            c.insertRecord({
+                {
+                    std::make_unique<qb::Int32RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>("data" + std::to_string(i % 50)),
+                    std::make_unique<qb::Int64RecordValue>(int64_t(i % 20) * 1000000007 - 3),
+                    std::make_unique<qb::StrRecordValue>("tag" + std::to_string(i % 7))
+                }
+            });
+        }
+
+        auto expectedAggregate = [&](const std::string& column, const std::string& value, size_t valuePos) {
+            qb::Aggregate res;
+            for (const auto& row : c.match(column, value, ok)) {
+                res.add(valuePos == 0 ? row.id() : row.get<int64_t>(valuePos));
+            }
+            return res;
+        };
+
+        auto assertAggregate = [&](const std::string& column, const std::string& value, size_t valuePos) {
+            auto expected = expectedAggregate(column, value, valuePos);
+            auto res = c.aggregate(column, value, valuePos == 0 ? "column0" : "column2", ok);
+            assert(ok);
+            assert(res.count == expected.count && res.sum == expected.sum);
+            assert(res.count == 0 || (res.min == expected.min && res.max == expected.max));
+            assert(c.count(column, value, ok) == expected.count);
+        };
+
+        auto assertGroups = [&](const std::string& groupColumn, size_t groupPos) {
+            std::map<std::string, size_t> expectedCounts;
+            std::map<std::string, int64_t> expectedSums;
+            for (const auto& row : c) {
+                std::string key = groupPos == 2 ? std::to_string(row.get<int64_t>(2))
+                                                : std::string(row.get<std::string_view>(groupPos));
+                expectedCounts[key]++;
+                expectedSums[key] += row.id();
+            }
+
+            auto keyOf = [](const qb::CellView& key) {
+                return key.type == qb::RecordValueType::String ? std::string(key.text) : std::to_string(key.number);
+            };
+
+            std::map<std::string, size_t> counts;
+            assert(c.groupCount(groupColumn, [&](const qb::CellView& key, size_t n) { counts[keyOf(key)] = n; }));
+            assert(counts == expectedCounts);
+
+            std::map<std::string, int64_t> sums;
+            assert(c.groupBy(groupColumn, "column0", [&](const qb::CellView& key, const qb::Aggregate& a) {
+                assert(a.count == expectedCounts[keyOf(key)]);
+                sums[keyOf(key)] = a.sum;
+            }));
+            assert(sums == expectedSums);
+        };
+
+        auto assertAll = [&]() {
+            assertAggregate("column1", "data3", 2);
+            assertAggregate("column2", std::to_string(int64_t(7) * 1000000007 - 3), 0);
+            assertAggregate("column3", "tag4", 2);
+            assertAggregate("column3", "tag9", 2);
+            assertAggregate("column0", "77", 2);
+            assertGroups("column1", 1);
+            assertGroups("column2", 2);
+            assertGroups("column3", 3);
+        };
+
+        assertAll();
+        c.setCompactionThreshold(1);
+        for (int32_t i = 0; i < 5000; i += 3) {
+            c.remove(i);
+        }
+        assertAll();
+        c.compact();
+        assertAll();
+
+        c.count("column2", "nan", ok);
+        assert(!ok);
+        c.aggregate("column1", "data3", "column3", ok);
+        assert(!ok);
+        c.aggregate("column9", "1", "column2", ok);
+        assert(!ok);
+        assert(!c.groupBy("column1", "column1", [](const auto&, const auto&) {}));
+        assert(!c.groupCount("column0", [](const auto&, size_t) {}));
+        assert(!c.groupCount("column9", [](const auto&, size_t) {}));
+    }
+
+    {
+        // Dictionary encoded columns answer the same queries as plain string columns.
+        bool ok = false;
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+        assert(!c.setEncoding("column0", qb::ColumnEncoding::Dictionary));
+        assert(c.setEncoding("column1", qb::ColumnEncoding::Dictionary));
+        assert(c.setEncoding("column3", qb::ColumnEncoding::Dictionary));
+        assert(c.createIndex("column1", qb::RecordValueType::String));
+        assert(!c.setEncoding("column1", qb::ColumnEncoding::Plain));
+        assert(c.createIndex("column2", qb::RecordValueType::Int64));
+        assert(!c.setEncoding("column2", qb::ColumnEncoding::Dictionary));
+
+        const char* tags[] = { "red", "green", "blue", "" };
+        for (int32_t i = 0; i < 100; i++) {
+            ok = c.insertRecord({
+                {
+                    std::make_unique<qb::Int32RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>(tags[i % 4]),
+                    std::make_unique<qb::Int64RecordValue>(i % 10),
+                    std::make_unique<qb::StrRecordValue>(std::string("note") + tags[i % 3])
+                }
+            });
+            assert(ok);
+        }
+        assert(!c.setEncoding("column3", qb::ColumnEncoding::Plain));
+
+        assert(c.match("column1", "red", ok).size() == 25 && ok);
+        assert(c.match("column1", "re", ok).empty() && ok);
+        assert(c.match("column1", "", ok).size() == 25 && ok);
+        assert(c.match("column1", "purple", ok).empty() && ok);
+        assert(c.match("column3", "ree", ok).size() == 33 && ok);
+        assert(c.match("column3", "note", ok).size() == 100 && ok);
+
+        auto res = c.match("column1", "green", ok);
+        assert(ok);
+        assertColumns(*res.begin(), 1, "green", 1, "notegreen");
+
+        auto copy = res.materialize();
+        assert(copy.size() == 25);
+        assert(copy.match("column3", "green", ok).size() == 9 && ok);
+        assert(copy.match("column1", "green", ok).size() == 25 && ok);
+
+        c.remove(1);
+        c.remove(2);
+        assert(c.match("column1", "green", ok).size() == 24);
+        assert(c.match("column3", "ree", ok).size() == 32);
+    }
+
+    {
+        // Collections allocate rows and indices from the memory resource they are given.
+        struct CountingResource : std::pmr::memory_resource {
+            size_t allocated = 0;
+            size_t deallocated = 0;
+
+            void* do_allocate(size_t bytes, size_t alignment) override {
+                allocated += bytes;
+                return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+            }
+
+            void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+                deallocated += bytes;
+                std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+            }
+
+            bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+        };
+
+        auto counting = std::make_shared<CountingResource>();
+        std::vector<qb::MemoryResourcePtr> resources = {
+            counting,
+            qb::makeMemoryResource(qb::AllocatorKind::Arena, 4096),
+            qb::makeMemoryResource(qb::AllocatorKind::Pool),
+            qb::makeMemoryResource(qb::AllocatorKind::Default)
+        };
+
+        for (auto& memory : resources) {
+            bool ok = false;
+            QBRecordCollection c({ "column0", "column1", "column2", "column3" }, memory);
+            assert(c.setEncoding("column3", qb::ColumnEncoding::Dictionary));
+            assert(c.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram));
+            assert(c.createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered));
+            assert(c.createIndex("column3", qb::RecordValueType::String));
+
+            for (int32_t i = 0; i < 1000; i++) {
+                ok = c.insertRecord({
+                    {
+                        std::make_unique<qb::Int32RecordValue>(i),
+                        std::make_unique<qb::StrRecordValue>("a rather long value number " + std::to_string(i)),
+                        std::make_unique<qb::Int64RecordValue>(i % 7),
+                        std::make_unique<qb::StrRecordValue>(i % 2 ? "odd" : "even")
+                    }
+                });
+                assert(ok);
+            }
+            for (int32_t i = 0; i < 1000; i += 2) {
+                c.remove(i);
+            }
+
+            assert(c.size() == 500);
+            assert(c.match("column1", "number 99", ok).size() == 6 && ok);
+            assert(c.match("column2", "3", ok).size() == 72 && ok);
+            assert(c.match("column3", "odd", ok).size() == 500 && ok);
+            assert(c.match("column3", "even", ok).empty() && ok);
+        }
+
+        // Everything, including the index buckets and the id map, went through the resource and was given back.
+        assert(counting->allocated > 0);
+        assert(counting->allocated == counting->deallocated);
+    }
+
+    {
+        // Compressed posting lists hold the same slots as plain ones, across array and bitmap chunks.
+        qb::CompressedPostingList list;
+        std::set<qb::SlotType> expected;
+
+        auto assertSame = [&]() {
+            assert(list.size() == expected.size());
+            assert(std::equal(list.begin(), list.end(), expected.begin(), expected.end()));
+        };
+
+        // Dense enough in the first chunk to become a bitmap, sparse in the others.
+        for (int32_t i = 0; i < 20000; i++) {
+            auto slot = qb::SlotType(core::genRndInt32(0, 9000));
+            if (i % 4 == 0) {
+                slot = qb::SlotType(core::genRndInt32(0, 400000));
+            }
+            list.insert(slot);
+            expected.insert(slot);
+        }
+        assertSame();
+        assert(list.bytes() < expected.size() * sizeof(qb::SlotType) / 2);
+
+        // Erasing by predicate rewrites the bitmap chunk as an array once it is sparse enough.
+        qb::CompressedPostingList filtered = list;
+        filtered.eraseIf([](qb::SlotType slot) { return slot % 3 != 0; });
+        std::vector<qb::SlotType> kept;
+        std::copy_if(expected.begin(), expected.end(), std::back_inserter(kept), [](qb::SlotType slot) { return slot % 3 == 0; });
+        assert(filtered.size() == kept.size());
+        assert(std::equal(filtered.begin(), filtered.end(), kept.begin(), kept.end()));
+        assert(filtered.bytes() < list.bytes());
+        filtered.eraseIf([](qb::SlotType) { return true; });
+        assert(filtered.empty());
+
+        // Appending sorted slots builds the same chunks, past the end of the list and merged into its middle.
+        qb::CompressedPostingList appended;
+        std::vector<qb::SlotType> sorted(expected.begin(), expected.end());
+        auto middle = sorted.begin() + sorted.size() / 2;
+        appended.append(std::span<const qb::SlotType>(&*sorted.begin(), middle - sorted.begin()));
+        appended.append(std::span<const qb::SlotType>(&*middle, sorted.end() - middle));
+        std::vector<qb::SlotType> odd;
+        std::copy_if(sorted.begin(), sorted.end(), std::back_inserter(odd), [](qb::SlotType slot) { return slot % 2 == 1; });
+        appended.append(odd);
+        assert(appended.size() == expected.size());
+        assert(std::equal(appended.begin(), appended.end(), expected.begin(), expected.end()));
+        assert(appended.bytes() == list.bytes());
+
+        // Shrink the bitmap back into an array and empty some chunks.
+        for (int32_t i = 0; i < 30000; i++) {
+            auto slot = qb::SlotType(core::genRndInt32(0, 400000));
+            if (i % 2 == 0) {
+                slot = qb::SlotType(core::genRndInt32(0, 9000));
+            }
+            list.erase(slot);
+            expected.erase(slot);
+        }
+        assertSame();
+
+        for (auto slot : std::vector<qb::SlotType>(expected.begin(), expected.end())) {
+            list.erase(slot);
+        }
+        assert(list.empty());
+        assert(list.begin() == list.end());
+
+        list.insert(std::numeric_limits<qb::SlotType>::max());
+        list.insert(0);
+        assert(*list.begin() == 0);
+        assert(*std::next(list.begin()) == std::numeric_limits<qb::SlotType>::max());
+    }
+
+    {
+        // The flat hash map holds the same entries as std::map through inserts, erases and growth.
+        qb::FlatHashMap<int64_t, int64_t> map;
+        std::map<int64_t, int64_t> expected;
+
+        for (int32_t i = 0; i < 200000; i++) {
+            int64_t key = core::genRndInt32(0, 20000);
+            if (i % 3 == 0) {
+                assert(map.erase(key) == expected.erase(key));
+            } else if (i % 3 == 1) {
+                assert(map.try_emplace(key, i).second == expected.try_emplace(key, i).second);
+            } else {
+                map[key] += i;
+                expected[key] += i;
+            }
+        }
+        assert(map.size() == expected.size());
+        for (const auto& [key, value] : map) {
+            assert(expected.at(key) == value);
         }
-        for (int32_t i = 0; i < TCount; i++) {
-            auto res = base_impl::QBFindMatchingRecords(testBaseImplementation, "column2", std::to_string(rndLongs[i % TEST_RND_ELEMENTS]));
-            useTheResultToAvoidCompilerOptimization2 += res.size();
+
+        // Erasing while iterating visits every other entry once.
+        size_t visited = 0;
+        for (auto it = map.begin(); it != map.end(); visited++) {
+            it = it->first % 2 == 0 ? map.erase(it) : std::next(it);
+        }
+        assert(visited == expected.size());
+        std::erase_if(expected, [](const auto& entry) { return entry.first % 2 == 0; });
+        assert(map.size() == expected.size());
+        assert(std::all_of(expected.begin(), expected.end(), [&](const auto& entry) { return map.at(entry.first) == entry.second; }));
+
+        // String keys are looked up by std::string_view without building a key.
+        qb::FlatHashMap<std::pmr::string, int32_t, qb::StringHash, qb::StringEqual> strings;
+        for (int32_t i = 0; i < 1000; i++) {
+            strings.emplace(std::pmr::string(rndStrings[i]), i);
         }
-        for (int32_t i = 0; i < TCount; i++) {
-            auto res = base_impl::QBFindMatchingRecords(testBaseImplementation, "column3", rndStrings[i % TEST_RND_ELEMENTS]);
-            useTheResultToAvoidCompilerOptimization2 += res.size();
+        for (int32_t i = 0; i < 1000; i++) {
+            auto it = strings.find(std::string_view(rndStrings[i]));
+            assert(it != strings.end() && rndStrings[it->second] == rndStrings[i]);
         }
+        assert(!strings.contains(std::string_view("not a random string")));
+    }
 
-        auto end = std::chrono::high_resolution_clock::now();
+    {
+        // The id table maps dense and sparse ids like std::map and drops pages once they are empty.
+        qb::IdSlotTable table;
+        std::map<uint32_t, qb::SlotType> expected;
+
+        for (int32_t i = 0; i < 100000; i++) {
+            auto id = uint32_t(core::genRndInt32(0, 50000));
+            if (i % 10 == 0) {
+                // Sparse ids, up to the largest one.
+                id = std::numeric_limits<uint32_t>::max() - uint32_t(core::genRndInt32(0, 1 << 20)) * 4096;
+            }
+
+            if (i % 3 == 0) {
+                auto it = expected.find(id);
+                assert(table.erase(id) == (it != expected.end() ? it->second : qb::IdSlotTable::NoSlot));
+                if (it != expected.end()) {
+                    expected.erase(it);
+                }
+            } else {
+                assert(table.insert(id, qb::SlotType(i)) == expected.try_emplace(id, qb::SlotType(i)).second);
+            }
+        }
 
-        std::cout << "base_impl::QBFindMatchingRecords: " << TCount << " iterations took: "
-            << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+        assert(table.size() == expected.size());
+        for (const auto& [id, slot] : expected) {
+            assert(table.find(id) == slot);
+        }
+        assert(!table.contains(50001));
+
+        for (const auto& entry : expected) {
+            table.erase(entry.first);
+        }
+        assert(table.empty());
+        assert(!table.contains(expected.begin()->first));
+        assert(table.insert(expected.begin()->first, 7) && table.find(expected.begin()->first) == 7);
     }
 
-    assert(useTheResultToAvoidCompilerOptimization1 == useTheResultToAvoidCompilerOptimization2);
+    {
+        // Bulk inserts build the same indices as inserting record by record, and reject bad batches as a whole.
+        bool ok = false;
+        auto makeCollection = []() {
+            QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+            assert(c.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram));
+            assert(c.createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered));
+            return c;
+        };
+        auto makeRecord = [](int32_t id) {
+            return qb::Record<4>{
+                {
+                    std::make_unique<qb::Int32RecordValue>(id),
+                    std::make_unique<qb::StrRecordValue>("data" + std::to_string(id % 97)),
+                    std::make_unique<qb::Int64RecordValue>(id % 31),
+                    std::make_unique<qb::StrRecordValue>("tag" + std::to_string(id % 7))
+                }
+            };
+        };
+
+        QBRecordCollection one = makeCollection();
+        QBRecordCollection bulk = makeCollection();
+        assert(bulk.setEncoding("column3", qb::ColumnEncoding::Dictionary));
+        assert(bulk.createIndex("column3", qb::RecordValueType::String));
+        qb::ThreadPool pool(4);
+        bulk.setThreadPool(&pool);
+
+        auto assertSame = [&]() {
+            assert(one.size() == bulk.size());
+            for (const auto& [column, value] : std::vector<std::pair<std::string, std::string>>{
+                     { "column1", "data5" }, { "column1", "ta1" }, { "column2", "7" }, { "column3", "tag3" },
+                     { "column0", "5000" } }) {
+                std::multiset<int32_t> a, b;
+                for (const auto& row : one.match(column, value, ok)) a.insert(row.id());
+                for (const auto& row : bulk.match(column, value, ok)) b.insert(row.id());
+                assert(a == b);
+            }
+            std::vector<int64_t> a, b;
+            one.forEachInRange("column2", qb::KeyRange::between(3, 9), [&](const auto& r) { a.push_back(r.id()); return true; });
+            bulk.forEachInRange("column2", qb::KeyRange::between(3, 9), [&](const auto& r) { b.push_back(r.id()); return true; });
+            assert(a == b);
+        };
+
+        std::vector<qb::Record<4>> batch;
+        for (int32_t i = 0; i < 10000; i++) {
+            assert(one.insertRecord(makeRecord(i)));
+            batch.push_back(makeRecord(i));
+        }
+        assert(bulk.bulkInsert(std::move(batch)));
+        assertSame();
+
+        // Refill the slots of removed rows with a second batch.
+        for (int32_t i = 0; i < 10000; i += 2) {
+            one.remove(i);
+            bulk.remove(i);
+        }
+        batch.clear();
+        for (int32_t i = 10000; i < 15000; i++) {
+            assert(one.insertRecord(makeRecord(i)));
+            batch.push_back(makeRecord(i));
+        }
+        assert(bulk.bulkInsert(std::move(batch)));
+        assertSame();
+
+        // A duplicate id, a taken id or a wrong type rejects the whole batch.
+        for (int32_t bad = 0; bad < 3; bad++) {
+            batch.clear();
+            for (int32_t i = 20000; i < 20010; i++) {
+                batch.push_back(makeRecord(i));
+            }
+            if (bad == 0) batch.push_back(makeRecord(20000));
+            if (bad == 1) batch.push_back(makeRecord(11));
+            if (bad == 2) batch[5].columns[2] = std::make_unique<qb::StrRecordValue>("x");
+            assert(!bulk.bulkInsert(std::move(batch)));
+            assert(bulk.size() == one.size());
+            assert(bulk.match("column0", "20000", ok).empty());
+        }
+        assert(bulk.bulkInsert({}));
+
+        // The first batch of an empty collection fixes the column types.
+        QBRecordCollection untyped({ "column0", "column1", "column2", "column3" });
+        batch.clear();
+        batch.push_back(makeRecord(1));
+        batch.push_back(makeRecord(2));
+        batch[1].columns[3] = std::make_unique<qb::Int64RecordValue>(3);
+        assert(!untyped.bulkInsert(std::move(batch)));
+        assert(untyped.insertRecord({
+            {
+                std::make_unique<qb::Int32RecordValue>(1),
+                std::make_unique<qb::Int64RecordValue>(1),
+                std::make_unique<qb::Int64RecordValue>(1),
+                std::make_unique<qb::Int64RecordValue>(1)
+            }
+        }));
+    }
+
+    {
+        // Indices created on a populated collection answer like indices declared up front, also when built in
+        // the background.
+        bool ok = false;
+        auto makeRecord = [](int32_t id) {
+            return qb::Record<4>{
+                {
+                    std::make_unique<qb::Int32RecordValue>(id),
+                    std::make_unique<qb::StrRecordValue>("data" + std::to_string(id % 97)),
+                    std::make_unique<qb::Int64RecordValue>(id % 31),
+                    std::make_unique<qb::StrRecordValue>("tag" + std::to_string(id % 7))
+                }
+            };
+        };
+
+        // The reference declares its indices before loading.
+        QBRecordCollection plain({ "column0", "column1", "column2", "column3" });
+        assert(plain.createIndex("column1", qb::RecordValueType::String));
+        assert(plain.createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered));
+        assert(plain.createIndex("column3", qb::RecordValueType::String, qb::IndexKind::NGram));
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+        assert(c.setEncoding("column3", qb::ColumnEncoding::Dictionary));
+        for (int32_t i = 0; i < 20000; i++) {
+            plain.insertRecord(makeRecord(i));
+            c.insertRecord(makeRecord(i));
+        }
+
+        auto assertSame = [&](const std::string& column, const std::string& value) {
+            std::vector<int32_t> a, b;
+            for (const auto& row : plain.match(column, value, ok)) a.push_back(row.id());
+            for (const auto& row : c.match(column, value, ok)) b.push_back(row.id());
+            std::sort(a.begin(), a.end());
+            std::sort(b.begin(), b.end());
+            assert(a == b);
+        };
+        auto assertAllSame = [&]() {
+            assert(plain.size() == c.size());
+            assertSame("column1", "data42");
+            assertSame("column1", "data9");
+            assertSame("column2", "17");
+            assertSame("column3", "tag4");
+            assertSame("column3", "ag5");
+        };
+
+        assert(c.createIndex("column1", qb::RecordValueType::String));
+        assertAllSame();
+
+        // Readers keep querying while the keys are sorted in the background.
+        assert(c.startIndexBuild("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered));
+        assert(c.startIndexBuild("column3", qb::RecordValueType::String, qb::IndexKind::NGram));
+        assert(!c.startIndexBuild("column3", qb::RecordValueType::String, qb::IndexKind::NGram));
+        assert(!c.createIndex("column2", qb::RecordValueType::Int64));
+        assert(!c.startIndexBuild("column1", qb::RecordValueType::String, qb::IndexKind::NGram));
+        assert(!c.finishIndexBuild("column1"));
+
+        std::vector<std::thread> readers;
+        for (int32_t t = 0; t < 2; t++) {
+            readers.emplace_back([&]() {
+                bool readerOk = false;
+                assert(c.match("column2", "17", readerOk).size() == plain.match("column2", "17", readerOk).size());
+                assert(c.match("column3", "ag5", readerOk).size() == plain.match("column3", "ag5", readerOk).size());
+            });
+        }
+        for (auto& t : readers) {
+            t.join();
+        }
+
+        // Rows changed before the switch-over are covered too. Compaction waits for the builds.
+        c.setCompactionThreshold(0.01);
+        for (int32_t i = 0; i < 20000; i += 10) {
+            plain.remove(i);
+            c.remove(i);
+        }
+        assert(c.deadCount() == 2000);
+        for (int32_t i = 20000; i < 21000; i++) {
+            plain.insertRecord(makeRecord(i));
+            c.insertRecord(makeRecord(i));
+        }
+        assertAllSame();
+
+        assert(c.finishIndexBuild("column2"));
+        assert(!c.isIndexBuildReady("column2"));
+        assert(c.deadCount() == 2000);
+        assertAllSame();
+        assert(c.finishIndexBuild("column3"));
+        assert(c.deadCount() == 0);
+        assertAllSame();
+        assert(!c.createIndex("column2", qb::RecordValueType::Int64));
+
+        std::vector<int64_t> keys;
+        c.forEachInRange("column2", qb::KeyRange::between(29, 30), [&](const auto& row) {
+            keys.push_back(row.template get<int64_t>(2));
+            return true;
+        });
+        assert(keys.size() == plain.match("column2", "29", ok).size() + plain.match("column2", "30", ok).size());
+        assert(std::is_sorted(keys.begin(), keys.end()));
+
+        // A build started on an empty collection indexes everything at the switch-over.
+        QBRecordCollection empty({ "column0", "column1", "column2", "column3" });
+        assert(empty.startIndexBuild("column1", qb::RecordValueType::String));
+        assert(empty.insertRecord(makeRecord(1)));
+        while (!empty.isIndexBuildReady("column1")) {
+            std::this_thread::yield();
+        }
+        assert(empty.finishIndexBuild("column1"));
+        assert(empty.match("column1", "data1", ok).size() == 1);
+    }
+
+    {
+        // Removed rows are skipped by every kind of query until compaction drops them from the indices.
+        bool ok = false;
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+        assert(c.setEncoding("column3", qb::ColumnEncoding::Dictionary));
+        assert(c.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram));
+        assert(c.createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered));
+        assert(c.createIndex("column3", qb::RecordValueType::String));
+        c.setCompactionThreshold(1);
+
+        static constexpr int32_t RowsCount = 3000;
+        QBRecordCollection plain({ "column0", "column1", "column2", "column3" });
+        for (int32_t i = 0; i < RowsCount; i++) {
+            for (auto* target : { &c, &plain }) {
+                target->insertRecord({
+                    {
+                        std::make_unique<qb::Int32RecordValue>(i),
+                        std::make_unique<qb::StrRecordValue>("data" + std::to_string(i % 50)),
+                        std::make_unique<qb::Int64RecordValue>(i % 20),
+                        std::make_unique<qb::StrRecordValue>("tag" + std::to_string(i % 5))
+                    }
+                });
+            }
+        }
+
+        auto assertSameIds = [&](const QBRecordCollection::ResultSet& a, const QBRecordCollection::ResultSet& b) {
+            std::set<int32_t> ids;
+            for (const auto& row : a) {
+                ids.insert(row.id());
+            }
+            assert(ids.size() == a.size());
+            assert(ids.size() == b.size());
+            for (const auto& row : b) {
+                assert(ids.count(row.id()) == 1);
+            }
+        };
+
+        auto assertQueriesAgree = [&]() {
+            assert(c.size() == plain.size());
+            for (const auto& [column, value] : std::vector<std::pair<std::string, std::string>>{
+                     { "column1", "data1" }, { "column1", "ta4" }, { "column1", "7" }, { "column2", "3" },
+                     { "column3", "tag2" }, { "column0", "42" }, { "column0", "43" } }) {
+                assertSameIds(c.match(column, value, ok), plain.match(column, value, ok));
+            }
+            assertSameIds(c.matchRange("column2", qb::KeyRange::between(5, 9), ok),
+                          plain.matchAny({ { "column2", "5" }, { "column2", "6" }, { "column2", "7" },
+                                           { "column2", "8" }, { "column2", "9" } }, ok));
+            assertSameIds(c.matchAll({ { "column3", "tag1" }, { "column2", "6" } }, ok),
+                          plain.matchAll({ { "column3", "tag1" }, { "column2", "6" } }, ok));
+        };
+
+        for (int32_t i = 0; i < RowsCount; i += 3) {
+            c.remove(i);
+            plain.remove(i);
+        }
+        assert(c.deadCount() == RowsCount / 3);
+        assertQueriesAgree();
+
+        c.compact();
+        assert(c.deadCount() == 0);
+        assertQueriesAgree();
+
+        // Compacted slots are reused, automatic compaction keeps the dead rows below the threshold.
+        c.setCompactionThreshold(0.1);
+        for (int32_t i = 0; i < RowsCount; i += 3) {
+            c.insertRecord({
+                {
+                    std::make_unique<qb::Int32RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>("new"),
+                    std::make_unique<qb::Int64RecordValue>(-1),
+                    std::make_unique<qb::StrRecordValue>("tag2")
+                }
+            });
+        }
+        assert(c.size() == RowsCount);
+        assert(c.match("column2", "-1", ok).size() == RowsCount / 3);
+
+        for (int32_t i = 1; i < RowsCount; i += 2) {
+            c.remove(i);
+            assert(c.deadCount() <= RowsCount / 10);
+        }
+        assert(c.size() == RowsCount / 2);
+        assert(c.match("column1", "new", ok).size() == RowsCount / 6);
+        size_t tag2 = 0;
+        for (int32_t i = 0; i < RowsCount; i += 2) {
+            tag2 += i % 3 == 0 || i % 5 == 2;
+        }
+        assert(c.match("column3", "tag2", ok).size() == tag2);
+    }
+
+    {
+        // A snapshot reopens with the same rows, column types and indices, removed rows stay removed.
+        bool ok = false;
+        const std::string path = (std::filesystem::temp_directory_path() / "qb_snapshot_test.bin").string();
+
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+        assert(c.setEncoding("column3", qb::ColumnEncoding::Dictionary));
+        assert(c.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram));
+        assert(c.createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered));
+        assert(c.createIndex("column3", qb::RecordValueType::String));
+        c.setCompactionThreshold(1);
+        for (int32_t i = 0; i < 2000; i++) {
+            c.insertRecord({
+                {
+                    std::make_unique<qb::Int32RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>("data" + std::to_string(i % 50)),
+                    std::make_unique<qb::Int64RecordValue>(i % 20),
+                    std::make_unique<qb::StrRecordValue>("tag" + std::to_string(i % 5))
+                }
+            });
+        }
+        assert(c.insertRecord({
+            {
+                std::make_unique<qb::Int32RecordValue>(5000),
+                std::make_unique<qb::StrRecordValue>("removed-secret"),
+                std::make_unique<qb::Int64RecordValue>(5),
+                std::make_unique<qb::StrRecordValue>("tag1")
+            }
+        }));
+        c.remove(5000);
+        for (int32_t i = 0; i < 2000; i += 3) {
+            c.remove(i);
+        }
+
+        auto idsOf = [](const QBRecordCollection::ResultSet& res) {
+            std::set<int32_t> ids;
+            for (const auto& row : res) {
+                ids.insert(row.id());
+            }
+            return ids;
+        };
+
+        assert(c.save(path));
+        {
+            // Removed rows leave no values behind in the file.
+            std::ifstream in(path, std::ios::binary);
+            std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            assert(bytes.find("removed-secret") == std::string::npos);
+        }
+        auto opened = QBRecordCollection::open(path);
+        assert(opened);
+        assert(opened->size() == c.size() && opened->deadCount() == 0);
+        for (const auto& [column, value] : std::vector<std::pair<std::string, std::string>>{
+                 { "column1", "data1" }, { "column1", "ta4" }, { "column2", "3" }, { "column3", "tag2" },
+                 { "column0", "42" }, { "column0", "43" } }) {
+            assert(idsOf(opened->match(column, value, ok)) == idsOf(c.match(column, value, ok)));
+        }
+        assert(idsOf(opened->matchRange("column2", qb::KeyRange::between(5, 9), ok)) ==
+               idsOf(c.matchRange("column2", qb::KeyRange::between(5, 9), ok)));
+
+        // The reopened collection takes new rows into the slots of the removed ones.
+        assert(opened->insertRecord({
+            {
+                std::make_unique<qb::Int32RecordValue>(0),
+                std::make_unique<qb::StrRecordValue>("new"),
+                std::make_unique<qb::Int64RecordValue>(100),
+                std::make_unique<qb::StrRecordValue>("tag9")
+            }
+        }));
+        assert(opened->match("column3", "tag9", ok).size() == 1);
+        assert(opened->match("column1", "new", ok).size() == 1);
+        assert(!opened->setEncoding("column1", qb::ColumnEncoding::Dictionary));
+
+        // The shared test collection survives a round trip too.
+        assert(testQBImplementation.save(path));
+        auto big = QBRecordCollection::open(path);
+        assert(big && big->size() == testQBImplementation.size());
+        for (int32_t i = 0; i < TEST_RND_ELEMENTS; i += 97) {
+            std::string part = rndStrings[i].substr(0, 3);
+            assert(idsOf(big->match("column1", part, ok)) == idsOf(testQBImplementation.match("column1", part, ok)));
+            assert(idsOf(big->match("column2", std::to_string(rndLongs[i]), ok)) ==
+                   idsOf(testQBImplementation.match("column2", std::to_string(rndLongs[i]), ok)));
+        }
+
+        // Truncated files, other record sizes and missing files are rejected.
+        assert(c.save(path));
+        std::filesystem::resize_file(path, std::filesystem::file_size(path) - 8);
+        assert(!QBRecordCollection::open(path));
+        assert(c.save(path));
+        assert(!qb::Collection<3>::open(path));
+        std::filesystem::remove(path);
+        assert(!QBRecordCollection::open(path));
+    }
+
+    {
+        // Changes logged since the last checkpoint are replayed on top of its snapshot after a crash.
+        bool ok = false;
+        const auto dir = std::filesystem::temp_directory_path();
+        const std::string snapshotPath = (dir / "qb_wal_test.snapshot").string();
+        const std::string logPath = (dir / "qb_wal_test.log").string();
+        std::filesystem::remove(logPath);
+
+        auto makeCollection = []() {
+            auto c = std::make_unique<QBRecordCollection>(QBRecordCollection::ColumnNamesType{ "column0", "column1", "column2", "column3" });
+            c->createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram);
+            c->createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered);
+            return c;
+        };
+        auto makeRecord = [](int32_t id) {
+            return qb::Record<4>{ {
+                std::make_unique<qb::Int32RecordValue>(id),
+                std::make_unique<qb::StrRecordValue>("data" + std::to_string(id % 50)),
+                std::make_unique<qb::Int64RecordValue>(id % 20),
+                std::make_unique<qb::StrRecordValue>(std::string(id % 7, 'x'))
+            } };
+        };
+        auto assertSame = [&](const QBRecordCollection& a, const QBRecordCollection& b) {
+            assert(a.size() == b.size());
+            for (const auto& row : a) {
+                auto res = b.match("column0", std::to_string(row.id()), ok);
+                assert(res.size() == 1);
+                const auto other = *res.begin();
+                assert(other.get<std::string_view>(1) == row.get<std::string_view>(1));
+                assert(other.get<int64_t>(2) == row.get<int64_t>(2));
+                assert(other.get<std::string_view>(3) == row.get<std::string_view>(3));
+            }
+            assert(a.match("column1", "ta1", ok).size() == b.match("column1", "ta1", ok).size());
+            assert(a.matchRange("column2", qb::KeyRange::between(3, 8), ok).size() ==
+                   b.matchRange("column2", qb::KeyRange::between(3, 8), ok).size());
+        };
+
+        {
+            // Entries are synced in groups.
+            qb::WriteAheadLog log(qb::WriteAheadLog::SyncPolicy{ 64, std::chrono::hours(1) });
+            assert(log.open(logPath));
+            auto c = makeCollection();
+            assert(c->setWriteAheadLog(&log));
+            {
+                // A log serves one collection.
+                auto other = makeCollection();
+                assert(!other->setWriteAheadLog(&log));
+
+                // A row the log rejects leaves no column type behind.
+                qb::WriteAheadLog closed;
+                assert(other->setWriteAheadLog(&closed));
+                assert(!other->insertRecord(makeRecord(1)));
+                assert(other->setWriteAheadLog(nullptr));
+                auto record = makeRecord(1);
+                record.columns[3] = std::make_unique<qb::Int64RecordValue>(7);
+                assert(other->insertRecord(std::move(record)));
+            }
+
+            for (int32_t i = 0; i < 1000; i++) {
+                assert(c->insertRecord(makeRecord(i)));
+                assert(log.pendingEntries() < 64);
+            }
+            assert(!c->insertRecord(makeRecord(5)));
+            assert(c->checkpoint(snapshotPath));
+            assert(log.pendingEntries() == 0);
+
+            // After the checkpoint: single inserts, a batch, removes and an id inserted again.
+            for (int32_t i = 0; i < 1000; i += 4) {
+                c->remove(i);
+            }
+            std::vector<qb::Record<4>> batch;
+            for (int32_t i = 1000; i < 1500; i++) {
+                batch.push_back(makeRecord(i));
+            }
+            assert(c->bulkInsert(std::move(batch)));
+            assert(c->insertRecord(makeRecord(8)));
+            c->remove(9999);
+            assert(log.sync() && !log.failed());
+
+            auto recovered = QBRecordCollection::open(snapshotPath);
+            assert(recovered && recovered->size() == 1000);
+            assert(recovered->replay(logPath));
+            assertSame(*c, *recovered);
+
+            // A torn entry at the end is skipped by replay and cut off by open().
+            log.close();
+            {
+                std::ofstream torn(logPath, std::ios::binary | std::ios::app);
+                torn.write("\x20\0\0\0garbage", 11);
+            }
+            auto reopened = QBRecordCollection::open(snapshotPath);
+            assert(reopened->replay(logPath));
+            assertSame(*c, *reopened);
+
+            assert(log.open(logPath));
+            c->remove(1001);
+            assert(log.sync());
+        }
+
+        auto recovered = QBRecordCollection::open(snapshotPath);
+        assert(recovered->replay(logPath));
+        assert(recovered->size() == 1000 - 250 + 500 + 1 - 1);
+        assert(recovered->match("column0", "1001", ok).empty());
+        assert(recovered->match("column0", "8", ok).size() == 1);
+
+        // Replaying into a fresh collection rebuilds everything from the log alone.
+        auto fresh = makeCollection();
+        assert(fresh->replay(logPath));
+        assert(fresh->size() == 500 + 1 - 1);
+        assert(!fresh->replay((dir / "qb_missing.log").string()));
+
+        std::filesystem::remove(snapshotPath);
+        std::filesystem::remove(logPath);
+    }
+
+    {
+        // Delimited and NDJSON files load in parsed batches, bad rows are counted and skipped.
+        bool ok = false;
+        const std::string path = (std::filesystem::temp_directory_path() / "qb_loader_test.txt").string();
+        const std::array<qb::RecordValueType, 4> types = {
+            qb::RecordValueType::Int32, qb::RecordValueType::String, qb::RecordValueType::Int64, qb::RecordValueType::String };
+        auto writeFile = [&](const std::string& content) {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            out << content;
+        };
+
+        writeFile("id;name;score;note\r\n"
+                  "1;plain;10;x\r\n"
+                  "2;\"quoted;field\";-20;\"say \"\"hi\"\"\"\n"
+                  "\n"
+                  "3;\"multi\nline\";30;\n"
+                  "4;bad;number;x\n"
+                  "5;too;few\n"
+                  "1;duplicate;0;x\n"
+                  "6;last;9223372036854775807;end");
+        QBRecordCollection csv({ "column0", "column1", "column2", "column3" });
+        csv.createIndex("column1", qb::RecordValueType::String);
+        qb::LoadStats stats;
+        assert(qb::loadDelimited(csv, path, types, stats, qb::DelimitedFormat{ ';', true, 2 }));
+        assert(stats.inserted == 4 && stats.rejected == 3);
+        assert(csv.match("column1", "quoted;field", ok).size() == 1);
+        assert((*csv.match("column0", "2", ok).begin()).get<std::string_view>(3) == "say \"hi\"");
+        assert(csv.match("column1", "multi\nline", ok).size() == 1);
+        assert(csv.match("column3", "end", ok).size() == 1);
+        assert((*csv.match("column0", "6", ok).begin()).get<int64_t>(2) == std::numeric_limits<int64_t>::max());
+
+        writeFile("{\"column0\": 1, \"column1\": \"a\\\"b\\u00e9\\ud83d\\ude00\", \"column2\": -5, \"column3\": \"\", \"extra\": true}\n"
+                  "{\"column3\":\"x\",\"column2\":7,\"column1\":\"reordered\",\"column0\":2}\n"
+                  "{\"column0\": 3, \"column1\": \"missing\", \"column2\": 1}\n"
+                  "{\"column0\": 4, \"column1\": \"nested\", \"column2\": 1, \"column3\": \"x\", \"o\": {\"a\": 1}}\n"
+                  "{\"column0\": 5, \"column1\": 5, \"column2\": 1, \"column3\": \"x\"}\n"
+                  "\n");
+        QBRecordCollection json({ "column0", "column1", "column2", "column3" });
+        assert(qb::loadNdjson(json, path, types, stats));
+        assert(stats.inserted == 2 && stats.rejected == 3);
+        assert((*json.match("column0", "1", ok).begin()).get<std::string_view>(1) == "a\"b\xC3\xA9\xF0\x9F\x98\x80");
+        assert(json.match("column1", "reordered", ok).size() == 1);
+
+        // Batches overlap with parsing, the result is the same as inserting the rows one by one.
+        std::string big;
+        QBRecordCollection expected({ "column0", "column1", "column2", "column3" });
+        for (int32_t i = 0; i < 20000; i++) {
+            big += std::to_string(i) + ",data" + std::to_string(i % 77) + "," + std::to_string(i % 13) + ",tag\n";
+            expected.insertRecord({
+                {
+                    std::make_unique<qb::Int32RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>("data" + std::to_string(i % 77)),
+                    std::make_unique<qb::Int64RecordValue>(i % 13),
+                    std::make_unique<qb::StrRecordValue>("tag")
+                }
+            });
+        }
+        writeFile(big);
+        QBRecordCollection loaded({ "column0", "column1", "column2", "column3" });
+        loaded.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram);
+        loaded.createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered);
+        assert(qb::loadDelimited(loaded, path, types, stats, qb::DelimitedFormat{ ',', false, 1000 }));
+        assert(stats.inserted == 20000 && stats.rejected == 0);
+        assert(loaded.match("column1", "data7", ok).size() == expected.match("column1", "data7", ok).size());
+        assert(loaded.matchRange("column2", qb::KeyRange::atMost(3), ok).size() ==
+               expected.match("column2", "0", ok).size() + expected.match("column2", "1", ok).size() +
+               expected.match("column2", "2", ok).size() + expected.match("column2", "3", ok).size());
+
+        writeFile("");
+        assert(qb::loadDelimited(loaded, path, types, stats) && stats.inserted == 0);
+        std::filesystem::remove(path);
+        assert(!qb::loadNdjson(loaded, path, types, stats));
+    }
+
+    {
+        // Multi-predicate queries return the same rows as combining single matches by hand.
+        bool ok = false;
+        QBRecordCollection indexed({ "column0", "column1", "column2", "column3" });
+        assert(indexed.createIndex("column1", qb::RecordValueType::String));
+        assert(indexed.createIndex("column2", qb::RecordValueType::Int64, qb::IndexKind::Ordered));
+        assert(indexed.createIndex("column3", qb::RecordValueType::String, qb::IndexKind::NGram));
+        QBRecordCollection plain({ "column0", "column1", "column2", "column3" });
+
+        const char* tags[] = { "red", "green", "blue", "cyan", "teal" };
+        for (auto* c : { &indexed, &plain }) {
+            for (int32_t i = 0; i < 3000; i++) {
+                ok = c->insertRecord({
+                    {
+                        std::make_unique<qb::Int32RecordValue>(i),
+                        std::make_unique<qb::StrRecordValue>(tags[i % 5]),
+                        std::make_unique<qb::Int64RecordValue>(i % 13),
+                        std::make_unique<qb::StrRecordValue>("item" + std::to_string(i))
+                    }
+                });
+                assert(ok);
+            }
+            for (int32_t i = 0; i < 3000; i += 7) {
+                c->remove(i);
+            }
+        }
+
+        auto slotsOf = [](const auto& res) {
+            std::set<qb::SlotType> slots;
+            for (const auto& row : res) {
+                slots.insert(row.slot);
+            }
+            return slots;
+        };
+
+        auto assertQuery = [&](const QBRecordCollection& c, const std::vector<qb::Predicate>& predicates) {
+            std::set<qb::SlotType> all, any;
+            for (size_t i = 0; i < predicates.size(); i++) {
+                auto single = slotsOf(c.match(predicates[i].columnName, predicates[i].matchString, ok));
+                assert(ok);
+                any.insert(single.begin(), single.end());
+                if (i == 0) {
+                    all = single;
+                }
+                else {
+                    std::erase_if(all, [&](qb::SlotType slot) { return !single.count(slot); });
+                }
+            }
+
+            auto resAll = c.matchAll(predicates, ok);
+            assert(ok);
+            assert(resAll.size() == all.size() && slotsOf(resAll) == all);
+
+            auto resAny = c.matchAny(predicates, ok);
+            assert(ok);
+            assert(resAny.size() == any.size() && slotsOf(resAny) == any);
+        };
+
+        for (auto* c : { &indexed, &plain }) {
+            assertQuery(*c, { { "column1", "green" }, { "column2", "6" } });
+            assertQuery(*c, { { "column2", "6" }, { "column1", "green" }, { "column3", "item1" } });
+            assertQuery(*c, { { "column3", "item1" }, { "column3", "9" } });
+            assertQuery(*c, { { "column0", "42" }, { "column1", "green" } });
+            assertQuery(*c, { { "column1", "red" }, { "column1", "blue" } });
+            assertQuery(*c, { { "column3", "item" }, { "column1", "teal" }, { "column2", "0" } });
+            assertQuery(*c, { { "column1", "cyan" } });
+
+            assert(c->matchAll({}, ok).size() == c->size() && ok);
+            assert(c->matchAny({}, ok).empty() && ok);
+            c->matchAll({ { "column1", "red" }, { "column2", "x" } }, ok);
+            assert(!ok);
+            c->matchAny({ { "column1", "red" }, { "column4", "x" } }, ok);
+            assert(!ok);
+        }
+
+        // The rows are only materialized for the final result.
+        auto copy = indexed.matchAll({ { "column1", "green" }, { "column2", "6" }, { "column3", "11" } }, ok).materialize();
+        assert(ok);
+        for (const auto& row : copy) {
+            assert(row.get<std::string_view>(1) == "green");
+            assert(row.get<int64_t>(2) == 6);
+            assert(row.get<std::string_view>(3).find("11") != std::string_view::npos);
+        }
+        assert(copy.size() == 2);
+    }
+
+    {
+        // The thread pool runs every task exactly once and can be reused.
+        qb::ThreadPool pool(4);
+        assert(pool.threadsCount() == 4);
+
+        std::vector<std::atomic<int32_t>> runs(37);
+        for (int32_t i = 0; i < 100; i++) {
+            pool.parallelFor(runs.size(), [&](size_t task) { runs[task]++; });
+        }
+        pool.parallelFor(0, [&](size_t) { assert(false); });
+        assert(std::all_of(runs.begin(), runs.end(), [](const auto& n) { return n == 100; }));
+
+        // Partitioned scans return the same rows in the same order as single threaded ones.
+        bool ok = false;
+        QBRecordCollection c({ "column0", "column1", "column2", "column3" });
+        assert(c.setEncoding("column3", qb::ColumnEncoding::Dictionary));
+        for (int32_t i = 0; i < 20000; i++) {
+            ok = c.insertRecord({
+                {
+                    std::make_unique<qb::Int32RecordValue>(i),
+                    std::make_unique<qb::StrRecordValue>(core::genRndStr(8)),
+                    std::make_unique<qb::Int64RecordValue>(i % 100),
+                    std::make_unique<qb::StrRecordValue>(std::to_string(i % 1000))
+                }
+            });
+            assert(ok);
+        }
+        for (int32_t i = 0; i < 20000; i += 3) {
+            c.remove(i);
+        }
+
+        auto slotsOf = [](const auto& res) {
+            std::vector<qb::SlotType> slots;
+            for (const auto& row : res) {
+                slots.push_back(row.slot);
+            }
+            return slots;
+        };
+
+        for (const auto& [column, value] : std::vector<std::pair<std::string, std::string>>{
+                 { "column1", "a" }, { "column1", "" }, { "column2", "42" }, { "column3", "99" }, { "column3", "x" } }) {
+            c.setThreadPool(nullptr);
+            auto serial = slotsOf(c.match(column, value, ok));
+            c.setThreadPool(&pool, 1);
+            auto parallel = slotsOf(c.match(column, value, ok));
+            assert(ok);
+            assert(serial == parallel);
+        }
+
+        auto base = base_impl::populateDummyData("testdata", 20000);
+        for (const auto& [column, value] : std::vector<std::pair<std::string, std::string>>{
+                 { "column1", "testdata1" }, { "column2", "42" }, { "column3", "99test" } }) {
+            assert(base_impl::QBFindMatchingRecordsParallel(base, column, value, pool) ==
+                   base_impl::QBFindMatchingRecords(base, column, value));
+        }
+
+        // An invalid number throws on the calling thread, not on the pool.
+        bool thrown = false;
+        try {
+            base_impl::QBFindMatchingRecordsParallel(base, "column2", "x", pool);
+        }
+        catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(base_impl::QBFindMatchingRecordsParallel(base, "column0", "1234", pool).size() == 1);
+    }
+
+    {
+        // Readers of a concurrent collection always see the state after a complete write.
+        using ConcurrentCollection = qb::ConcurrentCollection<QBRecordCollection>;
+        ConcurrentCollection c(QBRecordCollection::ColumnNamesType{ "column0", "column1", "column2", "column3" });
+        c.write([](QBRecordCollection& c) { return c.createIndex("column2", qb::RecordValueType::Int64); });
+
+        static constexpr int32_t RowsCount = 2000;
+        std::atomic<bool> done = false;
+
+        auto reader = [&]() {
+            size_t lastSize = 0;
+            while (!done) {
+                c.read([&](const QBRecordCollection& snapshot) {
+                    // Every write keeps the sum of the column2 values at zero.
+                    bool ok = false;
+                    int64_t sum = 0;
+                    size_t rows = 0;
+                    for (const auto& row : snapshot) {
+                        sum += row.get<int64_t>(2);
+                        rows++;
+                    }
+                    assert(sum == 0);
+                    assert(rows == snapshot.size());
+                    assert(snapshot.match("column2", "0", ok).size() == snapshot.match("column1", "zero", ok).size());
+
+                    // The writer only grows the collection until done.
+                    assert(snapshot.size() >= lastSize);
+                    lastSize = snapshot.size();
+                });
+            }
+        };
+
+        std::vector<std::thread> readers;
+        for (int32_t i = 0; i < 3; i++) {
+            readers.emplace_back(reader);
+        }
+
+        for (int32_t i = 0; i < RowsCount; i += 2) {
+            c.write([i](QBRecordCollection& c) {
+                for (int32_t j = i; j < i + 2; j++) {
+                    int64_t v = j % 2 ? -(j / 2 % 10) : j / 2 % 10;
+                    c.insertRecord({
+                        {
+                            std::make_unique<qb::Int32RecordValue>(j),
+                            std::make_unique<qb::StrRecordValue>(v == 0 ? "zero" : "other"),
+                            std::make_unique<qb::Int64RecordValue>(v),
+                            std::make_unique<qb::StrRecordValue>("")
+                        }
+                    });
+                }
+            });
+        }
+
+        done = true;
+        for (auto& t : readers) {
+            t.join();
+        }
+
+        assert(c.size() == RowsCount);
+        qb::Record<4> r;
+        r.columns[0] = std::make_unique<qb::Int32RecordValue>(RowsCount);
+        r.columns[1] = std::make_unique<qb::StrRecordValue>("zero");
+        r.columns[2] = std::make_unique<qb::Int64RecordValue>(0);
+        r.columns[3] = std::make_unique<qb::StrRecordValue>("");
+        assert(c.insertRecord(r));
+        assert(!c.insertRecord(r));
+        c.remove(0);
+        assert(c.size() == RowsCount);
+        assert(c.read([](const QBRecordCollection& s) { bool ok; return s.match("column0", "0", ok).empty(); }));
+
+        qb::ConcurrentCollection<qb::QBTypedRecordCollection> typed;
+        assert(typed.insert(1, "a", 2, "b"));
+        assert(typed.read([](const auto& s) { return s.template match<"column2">(2).size(); }) == 1);
+
+        {
+            // Writes are logged once, not once per copy, so the log replays without duplicate ids.
+            const std::string logPath = (std::filesystem::temp_directory_path() / "qb_concurrent_test.log").string();
+            std::filesystem::remove(logPath);
+            qb::WriteAheadLog log;
+            assert(log.open(logPath));
+            assert(c.setWriteAheadLog(&log));
+            QBRecordCollection other(QBRecordCollection::ColumnNamesType{ "column0", "column1", "column2", "column3" });
+            assert(!other.setWriteAheadLog(&log));
+
+            for (int32_t i = RowsCount + 1; i < RowsCount + 11; i++) {
+                r.columns[0] = std::make_unique<qb::Int32RecordValue>(i);
+                assert(c.insertRecord(r));
+            }
+            c.remove(RowsCount + 1);
+            assert(log.sync());
+
+            QBRecordCollection replayed(QBRecordCollection::ColumnNamesType{ "column0", "column1", "column2", "column3" });
+            assert(replayed.replay(logPath));
+            assert(replayed.size() == 9);
+
+            // A change the log rejects is made to neither copy.
+            log.close();
+            r.columns[0] = std::make_unique<qb::Int32RecordValue>(RowsCount + 20);
+            assert(!c.insertRecord(r));
+            assert(c.size() == RowsCount + 9);
+            assert(c.read([](const QBRecordCollection& s) { bool ok; return s.match("column0", std::to_string(RowsCount + 20), ok).empty(); }));
+
+            assert(c.setWriteAheadLog(nullptr));
+            assert(other.setWriteAheadLog(&log));
+            assert(other.setWriteAheadLog(nullptr));
+            assert(c.insertRecord(r));
+            assert(c.size() == RowsCount + 10);
+            std::filesystem::remove(logPath);
+        }
+    }
+
+    {
+        // A sharded collection answers queries like one collection while producers insert concurrently.
+        using Sharded = qb::ShardedCollection<4>;
+        Sharded c(Sharded::ColumnNamesType{ "column0", "column1", "column2", "column3" }, 4, qb::AllocatorKind::Pool);
+        assert(c.shardsCount() == 4);
+        assert(c.createIndex("column1", qb::RecordValueType::String, qb::IndexKind::NGram));
+        assert(c.createIndex("column2", qb::RecordValueType::Int64));
+
+        static constexpr int32_t ProducersCount = 4;
+        static constexpr int32_t RowsPerProducer = 1000;
+        auto makeRecord = [](int32_t id) {
+            return qb::Record<4>{
+                {
+                    std::make_unique<qb::Int32RecordValue>(id),
+                    std::make_unique<qb::StrRecordValue>("data" + std::to_string(id % 10)),
+                    std::make_unique<qb::Int64RecordValue>(id % 7),
+                    std::make_unique<qb::StrRecordValue>("")
+                }
+            };
+        };
+
+        std::atomic<bool> done = false;
+        std::thread reader([&]() {
+            while (!done) {
+                bool ok = false;
+                c.forEachMatch("column2", "3", ok, [](const auto& row) { assert(row.template get<int64_t>(2) == 3); });
+                assert(ok);
+            }
+        });
+
+        // Half of the producers insert one by one, the others in batches.
+        std::vector<std::thread> producers;
+        for (int32_t p = 0; p < ProducersCount; p++) {
+            producers.emplace_back([&, p]() {
+                int32_t first = p * RowsPerProducer;
+                if (p % 2) {
+                    for (int32_t id = first; id < first + RowsPerProducer; id++) {
+                        c.insertRecord(makeRecord(id));
+                    }
+                    return;
+                }
+
+                std::vector<qb::Record<4>> batch;
+                for (int32_t id = first; id < first + RowsPerProducer; id++) {
+                    batch.push_back(makeRecord(id));
+                }
+                batch.push_back(makeRecord(first));
+                assert(c.insertRecords(std::move(batch)) == RowsPerProducer);
+            });
+        }
+
+        for (auto& t : producers) {
+            t.join();
+        }
+        done = true;
+        reader.join();
+
+        static constexpr int32_t RowsCount = ProducersCount * RowsPerProducer;
+        assert(c.size() == RowsCount);
+        assert(!c.insertRecord(makeRecord(5)));
+
+        size_t shardRows = 0;
+        c.forEachShard([&](const QBRecordCollection& shard) {
+            assert(!shard.empty());
+            shardRows += shard.size();
+        });
+        assert(shardRows == RowsCount);
+
+        bool ok = false;
+        QBRecordCollection res = c.match("column0", "1234", ok);
+        assert(ok && res.size() == 1);
+        assert(res.match("column1", "data4", ok).size() == 1);
+        assert(c.match("column0", "x", ok).empty() && !ok);
+
+        size_t expected = 0;
+        for (int32_t id = 0; id < RowsCount; id++) {
+            expected += id % 7 == 3;
+        }
+        assert(c.match("column2", "3", ok).size() == expected);
+        assert(c.match("column1", "ta9", ok).size() == RowsCount / 10);
+        assert(c.match("column3", "", ok).size() == RowsCount);
+
+        c.remove(1234);
+        assert(c.size() == RowsCount - 1);
+        assert(c.match("column0", "1234", ok).empty());
+        assert(c.match("column1", "data4", ok).size() == RowsCount / 10 - 1);
+
+        {
+            // The first row fixes the column types on every shard, rows of other types are rejected by all of them.
+            Sharded typed(Sharded::ColumnNamesType{ "column0", "column1", "column2", "column3" }, 4);
+            assert(typed.setColumnType("column3", qb::RecordValueType::String));
+            assert(typed.insertRecord(makeRecord(1)));
+            for (int32_t id = 2; id < 10; id++) {
+                auto record = makeRecord(id);
+                record.columns[2] = std::make_unique<qb::StrRecordValue>("3");
+                assert(!typed.insertRecord(std::move(record)));
+            }
+            std::vector<qb::Record<4>> batch;
+            for (int32_t id = 10; id < 20; id++) {
+                batch.push_back(makeRecord(id));
+                if (id % 2) {
+                    batch.back().columns[3] = std::make_unique<qb::Int64RecordValue>(id);
+                }
+            }
+            assert(typed.insertRecords(std::move(batch)) == 5);
+            assert(!typed.setColumnType("column2", qb::RecordValueType::String));
+            assert(!typed.createIndex("column1", qb::RecordValueType::Int64));
+            assert(typed.size() == 6);
+            assert(typed.match("column2", "3", ok).size() == 1 && ok);
+        }
+    }
+
+    {
+        // The compile time schema answers the same queries as the dynamic collection.
+        using Typed = qb::TypedCollection<
+            qb::TypedColumn<"id", int32_t>,
+            qb::TypedColumn<"name", std::string_view, qb::IndexKind::NGram>,
+            qb::TypedColumn<"score", int64_t, qb::IndexKind::Ordered>,
+            qb::TypedColumn<"tag", std::string_view, qb::IndexKind::Hash>,
+            qb::TypedColumn<"note", std::string_view>,
+            qb::TypedColumn<"count", int64_t>
+        >;
+        static_assert(Typed::positionOf<"score">() == 2);
+
+        Typed c;
+        assert(c.insert(0, "data1", 60, "a", "first", 1));
+        assert(c.insert(1, "metadata", 10, "b", "second", 1));
+        assert(c.insert(2, "other", 60, "a", "third", 2));
+        assert(!c.insert(2, "dup", 0, "c", "", 0));
+        assert(c.size() == 3);
+
+        assert(c.match<"id">(1).size() == 1);
+        assert(c.match<"name">("data").size() == 2);
+        assert(c.match<"name">("er").size() == 1);
+        assert(c.match<"score">(60).size() == 2);
+        assert(c.match<"tag">("a").size() == 2);
+        assert(c.match<"note">("ir").size() == 2);
+        assert(c.match<"count">(1).size() == 2);
+        assert(c.matchRange<"score">(qb::KeyRange::lessThan(60)).size() == 1);
+
+        auto res = c.match<"tag">("a");
+        auto it = res.begin();
+        assert((*it).id() == 0);
+        assert((*it).get<"name">() == "data1");
+        assert((*it).get<"score">() == 60);
+
+        Typed copy = res.materialize();
+        assert(copy.size() == 2);
+        assert(copy.match<"name">("other").size() == 1);
+
+        c.remove(0);
+        assert(c.size() == 2);
+        assert(c.match<"tag">("a").size() == 1);
+        assert(c.match<"name">("data").size() == 1);
+        assert(c.match<"id">(0).empty());
+        assert(copy.match<"id">(0).size() == 1);
+    }
+}
+
+// The collections answer the same queries as the base implementation. Timings are left to CPPCraftBench.
+void runAgreementTests() {
+    std::cout << "Running agreement tests" << std::endl;
+
+    static constexpr int32_t QueriesCount = 100;
+    for (int32_t i = 0; i < QueriesCount; i++) {
+        const std::string& str1 = rndStrings[i];
+        const std::string& str3 = rndStrings[TEST_RND_ELEMENTS - i - 1];
+        const int64_t v = rndLongs[i];
+
+        size_t expected = base_impl::QBFindMatchingRecords(testBaseImplementation, "column1", str1).size();
+        assert(expected > 0);
+        assert(QBFindMatchingRecords(testQBImplementation, "column1", str1).size() == expected);
+        assert(testQBTypedImplementation.match<"column1">(str1).size() == expected);
+
+        expected = base_impl::QBFindMatchingRecords(testBaseImplementation, "column2", std::to_string(v)).size();
+        assert(QBFindMatchingRecords(testQBImplementation, "column2", std::to_string(v)).size() == expected);
+        assert(testQBTypedImplementation.match<"column2">(v).size() == expected);
+
+        expected = base_impl::QBFindMatchingRecords(testBaseImplementation, "column3", str3).size();
+        assert(QBFindMatchingRecords(testQBImplementation, "column3", str3).size() == expected);
+        assert(testQBTypedImplementation.match<"column3">(str3).size() == expected);
+    }
 }
 
 }
@@ -344,16 +2120,7 @@ void runAllTestCases() {
     beforeTests();
 
     runFunctionalTests();
-    std::cout << std::endl;
-
-    runPerfTestFindMatchingIn<10>();
-    std::cout << std::endl;
-    runPerfTestFindMatchingIn<100>();
-    std::cout << std::endl;
-    runPerfTestFindMatchingIn<1000>();
-    std::cout << std::endl;
-    runPerfTestFindMatchingIn<10000>();
-    std::cout << std::endl;
+    runAgreementTests();
 
     std::cout << std::endl;
     std::cout << "All tests passed!" << std::endl;
@@ -13,4 +13,8 @@
 #include "BaseSolution.h"
 #include "Utils.h"
 #include "QBCollection.h"
+#include "QBTypedCollection.h"
+#include "QBConcurrentCollection.h"
+#include "QBShardedCollection.h"
+#include "QBLoader.h"
 #include "Tests.h"
\ No newline at end of file